@@ -0,0 +1,158 @@
+#include <boost/asio.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#ifdef __linux__
+#include <sys/socket.h>
+#endif
+
+// One connection to the admin port: a request, its answer, closed
+class admin_exchange : public std::enable_shared_from_this<admin_exchange>
+{
+public:
+  admin_exchange(
+		 boost::asio::io_context& ioc,
+		 boost::asio::ip::tcp::socket socket,
+		 std::function<std::string()> metrics_text)
+    : socket_(std::move(socket))
+    , timer_(ioc)
+    , metrics_text_(std::move(metrics_text))
+  {
+  }
+
+  void
+  run()
+  {
+    // a client that never finishes its request doesn't keep the socket
+    timer_.expires_after(std::chrono::seconds(10));
+    timer_.async_wait(
+		      [self = shared_from_this()](boost::system::error_code ec)
+		      {
+			if(! ec)
+			  self->socket_.close(ec);
+		      });
+    boost::beast::http::async_read(
+				   socket_,
+				   buffer_,
+				   req_,
+				   [self = shared_from_this()](boost::system::error_code ec, std::size_t)
+				   {
+				     self->on_read(ec);
+				   });
+  }
+
+private:
+  void
+  on_read(boost::system::error_code ec)
+  {
+    if(ec)
+      return;
+    namespace http = boost::beast::http;
+    res_.version(req_.version());
+    res_.keep_alive(false);
+    if(req_.method() == http::verb::get && req_.target() == "/metrics")
+      {
+	res_.result(http::status::ok);
+	res_.set(http::field::content_type, "text/plain; version=0.0.4");
+	res_.body() = metrics_text_();
+      }
+    else
+      {
+	res_.result(http::status::not_found);
+	res_.set(http::field::content_type, "text/plain");
+	res_.body() = "GET /metrics\n";
+      }
+    res_.prepare_payload();
+    http::async_write(
+		      socket_,
+		      res_,
+		      [self = shared_from_this()](boost::system::error_code ec, std::size_t)
+		      {
+			self->socket_.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
+			self->timer_.cancel();
+		      });
+  }
+
+  boost::asio::ip::tcp::socket socket_;
+  boost::asio::steady_timer timer_;
+  std::function<std::string()> metrics_text_;
+  boost::beast::flat_buffer buffer_;
+  boost::beast::http::request<boost::beast::http::string_body> req_;
+  boost::beast::http::response<boost::beast::http::string_body> res_;
+};
+
+// The admin port, serving GET /metrics from metrics_text. Bound with SO_REUSEPORT
+// so a new process taking over during an upgrade can listen next to the old one.
+class admin_server : public std::enable_shared_from_this<admin_server>
+{
+public:
+  admin_server(
+	       boost::asio::io_context& ioc,
+	       std::function<std::string()> metrics_text)
+    : ioc_(ioc)
+    , acceptor_(ioc)
+    , retry_timer_(ioc)
+    , metrics_text_(std::move(metrics_text))
+  {
+  }
+
+  // false with ec set if endpoint can't be listened on
+  bool
+  listen(boost::asio::ip::tcp::endpoint const & endpoint, boost::system::error_code& ec)
+  {
+    acceptor_.open(endpoint.protocol(), ec);
+    if(! ec)
+      acceptor_.set_option(boost::asio::socket_base::reuse_address(true), ec);
+#ifdef SO_REUSEPORT
+    if(! ec)
+      acceptor_.set_option(boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true), ec);
+#endif
+    if(! ec)
+      acceptor_.bind(endpoint, ec);
+    if(! ec)
+      acceptor_.listen(boost::asio::socket_base::max_listen_connections, ec);
+    return ! ec;
+  }
+
+  void
+  run()
+  {
+    acceptor_.async_accept(
+			   [self = shared_from_this()](boost::system::error_code ec, boost::asio::ip::tcp::socket socket)
+			   {
+			     if(! self->acceptor_.is_open())
+			       return;
+			     if(! ec)
+			       {
+				 std::make_shared<admin_exchange>(self->ioc_, std::move(socket), self->metrics_text_)->run();
+				 return self->run();
+			       }
+			     // e.g. out of descriptors, try again in a while
+			     self->retry_timer_.expires_after(std::chrono::seconds(1));
+			     self->retry_timer_.async_wait(
+							   [self](boost::system::error_code ec)
+							   {
+							     if(! ec)
+							       self->run();
+							   });
+			   });
+  }
+
+  // Stop accepting, from the thread running its io_context
+  void
+  stop()
+  {
+    boost::system::error_code ec;
+    acceptor_.close(ec);
+    retry_timer_.cancel();
+  }
+
+private:
+  boost::asio::io_context& ioc_;
+  boost::asio::ip::tcp::acceptor acceptor_;
+  boost::asio::steady_timer retry_timer_;
+  std::function<std::string()> metrics_text_;
+};
@@ -0,0 +1,266 @@
+#include <boost/asio.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Process-wide limits on concurrent sessions, in total and per client address.
+// A session holds a ticket for its lifetime; a listener that finds no room stops
+// accepting and is woken up again when a ticket is returned.
+class admission_control
+{
+public:
+  // One admitted session, gives its slot back when destroyed
+  class ticket
+  {
+  public:
+    ticket()
+      : owner_{nullptr}
+    {
+    }
+
+    ticket(ticket&& other)
+      : owner_{other.owner_}
+      , address_(other.address_)
+    {
+      other.owner_ = nullptr;
+    }
+
+    ticket& operator=(ticket&& other)
+    {
+      if(this != &other)
+	{
+	  release();
+	  owner_ = other.owner_;
+	  address_ = other.address_;
+	  other.owner_ = nullptr;
+	}
+      return *this;
+    }
+
+    ~ticket()
+    {
+      release();
+    }
+
+    explicit operator bool() const
+    {
+      return owner_ != nullptr;
+    }
+
+  private:
+    friend class admission_control;
+
+    ticket(admission_control* owner, boost::asio::ip::address const & address)
+      : owner_{owner}
+      , address_(address)
+    {
+    }
+
+    void
+    release()
+    {
+      if(owner_)
+	owner_->release(address_);
+      owner_ = nullptr;
+    }
+
+    admission_control* owner_;
+    boost::asio::ip::address address_;
+  };
+
+  // 0 means no limit
+  admission_control(std::size_t max_sessions, std::size_t max_sessions_per_client)
+    : max_sessions_{max_sessions}
+    , max_sessions_per_client_{max_sessions_per_client}
+    , active_{0}
+  {
+  }
+
+  // A slot for a session from address, an empty ticket if a limit is reached
+  ticket
+  admit(boost::asio::ip::address const & address)
+  {
+    std::lock_guard<proxy_mutex> lock(admission_mutex);
+    if(max_sessions_ && active_ >= max_sessions_)
+      return ticket();
+    auto& from_client = clients_[address];
+    if(max_sessions_per_client_ && from_client >= max_sessions_per_client_)
+      return ticket();
+    from_client++;
+    active_++;
+    return ticket(this, address);
+  }
+
+  // True if there is room for another session now. Otherwise false, and resume is
+  // called once a ticket comes back, on that thread, so it should only post.
+  bool
+  when_room(std::function<void()> resume)
+  {
+    std::lock_guard<proxy_mutex> lock(admission_mutex);
+    if(max_sessions_ && active_ >= max_sessions_)
+      {
+	waiting_.push_back(std::move(resume));
+	return false;
+      }
+    return true;
+  }
+
+  std::size_t
+  active() const
+  {
+    std::lock_guard<proxy_mutex> lock(admission_mutex);
+    return active_;
+  }
+
+private:
+  void
+  release(boost::asio::ip::address const & address)
+  {
+    // wake every paused listener: the kernel picks which one a new connection
+    // queues on, the one holding it may not be the first to ask for room
+    std::vector<std::function<void()> > resume;
+    {
+      std::lock_guard<proxy_mutex> lock(admission_mutex);
+      active_--;
+      auto it = clients_.find(address);
+      if(it != clients_.end() && --it->second == 0)
+	clients_.erase(it);
+      resume.swap(waiting_);
+    }
+    for(auto& r : resume)
+      r();
+  }
+
+  struct address_hash
+  {
+    std::size_t
+    operator()(boost::asio::ip::address const & address) const
+    {
+      return std::hash<std::string>()(address.to_string());
+    }
+  };
+
+  std::size_t max_sessions_;
+  std::size_t max_sessions_per_client_;
+  std::size_t active_;
+  std::unordered_map<boost::asio::ip::address, std::size_t, address_hash> clients_;
+  std::vector<std::function<void()> > waiting_;	// listeners paused for room
+  mutable proxy_mutex admission_mutex{"admission"};
+};
+
+// How late a timer on the event loop fires: the time a ready handler waits
+// for its turn, i.e. the queueing delay every session on the loop is seeing.
+class loop_lag_probe
+{
+public:
+  loop_lag_probe(
+		 boost::asio::io_context& ioc,
+		 std::chrono::milliseconds interval)
+    : timer_{ioc}
+    , interval_{interval}
+    , lag_ms_{0}
+  {
+  }
+
+  void
+  run()
+  {
+    timer_.expires_after(interval_);
+    timer_.async_wait(
+		      [this](boost::system::error_code ec)
+		      {
+			if(ec)
+			  return;
+			auto late = std::chrono::duration_cast<std::chrono::milliseconds>(
+											 std::chrono::steady_clock::now() - timer_.expiry());
+			// rise at once, fall off slowly so one quiet sample doesn't end shedding
+			auto lag = std::max<long>(late.count(), lag_ms_.load() * 7 / 8);
+			lag_ms_.store(lag);
+			run();
+		      });
+  }
+
+  std::chrono::milliseconds
+  lag() const
+  {
+    return std::chrono::milliseconds(lag_ms_.load());
+  }
+
+private:
+  boost::asio::steady_timer timer_;
+  std::chrono::milliseconds interval_;
+  std::atomic<long> lag_ms_;
+};
+
+// Turn away a connection we accepted but won't serve: a canned 503, then the
+// connection is closed once the client hung up or after a second at most. Closing
+// right away would reset it while its request is unread and lose the 503.
+void
+shed_connection(boost::asio::io_context& ioc, boost::asio::ip::tcp::socket sock)
+{
+  static char const response[] =
+    "HTTP/1.1 503 Service Unavailable\r\n"
+    "Content-Length: 0\r\n"
+    "Retry-After: 1\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+
+  struct shed
+  {
+    shed(boost::asio::io_context& ioc, boost::asio::ip::tcp::socket s)
+      : sock(std::move(s))
+      , timer{ioc}
+    {
+    }
+
+    static void
+    drain(std::shared_ptr<shed> self)
+    {
+      self->sock.async_read_some(
+				 boost::asio::buffer(self->discard),
+				 [self](boost::system::error_code ec, std::size_t)
+				 {
+				   if(ec)
+				     return self->finish();
+				   drain(self);
+				 });
+    }
+
+    void
+    finish()
+    {
+      boost::system::error_code ec;
+      timer.cancel();
+      sock.close(ec);
+    }
+
+    boost::asio::ip::tcp::socket sock;
+    boost::asio::steady_timer timer;
+    char discard[512];
+  };
+
+  auto s = std::make_shared<shed>(ioc, std::move(sock));
+  boost::asio::async_write(
+			   s->sock,
+			   boost::asio::buffer(response, sizeof(response) - 1),
+			   [s](boost::system::error_code ec, std::size_t)
+			   {
+			     if(ec)
+			       return s->finish();
+			     s->sock.shutdown(boost::asio::ip::tcp::socket::shutdown_send, ec);
+			     s->timer.expires_after(std::chrono::seconds(1));
+			     s->timer.async_wait(
+						 [s](boost::system::error_code ec)
+						 {
+						   if(! ec)
+						     s->finish();
+						 });
+			     shed::drain(s);
+			   });
+}
@@ -0,0 +1,38 @@
+#!/bin/bash
+# Heap allocations per request on a keep-alive connection, counted by the proxy
+# itself. Builds ./proxy-alloc (make proxy-alloc) and runs it on PORT with one thread,
+# session events into a binary log as a production proxy would; text log lines cost
+# allocations of their own.
+#
+#   ./alloc_bench.sh [URL] [REQUESTS]
+#
+# URL should be small and cacheable, the first request fetches it, the rest are hits.
+# A pooled upstream connection is reused for uncacheable URLs. Prints the allocations
+# of the first request and the median and maximum of the others.
+
+URL=${1:-http://www.example.com/}
+REQUESTS=${2:-1000}
+PORT=${PORT:-12398}
+LOG=$(pwd)/logs/alloc_bench.log
+EVENTS=$(pwd)/logs/alloc_bench.bin
+
+make proxy-alloc > /dev/null || exit 1
+mkdir -p logs
+pkill -x proxy-alloc; sleep 0.3
+./proxy-alloc --port "$PORT" --threads 1 --log-file "$LOG" --binary-log "$EVENTS" --binary-log-mb 4 > /dev/null || exit 1
+sleep 0.5
+
+args=()
+for i in $(seq "$REQUESTS"); do
+    args+=(-o /dev/null "$URL")
+done
+curl -s -x "127.0.0.1:$PORT" "${args[@]}"
+sleep 0.3
+pkill -x proxy-alloc
+
+counts=$(grep -o 'NOTE [0-9]* allocations' "$LOG" | awk '{ print $2 }')
+first=$(echo "$counts" | head -n 1)
+echo "$counts" | tail -n +2 | sort -n | awk -v first="$first" '{ v[NR] = $1 }
+    END { if(NR == 0) { print "no requests counted"; exit 1 }
+          printf "first request %d, then median %d, max %d allocations per request (%d requests)\n",
+                 first, v[int((NR + 1) / 2)], v[NR], NR }'
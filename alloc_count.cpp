@@ -0,0 +1,35 @@
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+// Built with -DCOUNT_ALLOCATIONS every operator new of the process is counted per
+// thread, the sessions log what each request cost. Without it nothing is counted.
+#ifdef COUNT_ALLOCATIONS
+
+thread_local std::size_t allocation_count = 0;
+
+void* operator new(std::size_t size)
+{
+  allocation_count++;
+  if(void* p = std::malloc(size ? size : 1))
+    return p;
+  throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+  std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+  std::free(p);
+}
+
+// allocations made by the calling thread so far
+std::size_t allocations()
+{
+  return allocation_count;
+}
+
+#endif
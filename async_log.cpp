@@ -0,0 +1,301 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cerrno>
+#include <climits>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Bytes of whole log lines from one thread to the writer: the thread is the only
+// one to advance head_, the writer the only one to advance tail_, neither locks
+class log_ring
+{
+public:
+  explicit
+  log_ring(std::size_t capacity)
+    : data_(capacity)
+    , head_{0}
+    , tail_{0}
+    , dropped_{0}
+  {
+  }
+
+  // All of line and a newline or nothing, false if it didn't fit and was counted as dropped
+  bool
+  push(char const* line, std::size_t size)
+  {
+    auto head = head_.load(std::memory_order_relaxed);
+    auto tail = tail_.load(std::memory_order_acquire);
+    if(data_.size() - (head - tail) < size + 1)
+      {
+	dropped_.fetch_add(1, std::memory_order_relaxed);
+	return false;
+      }
+    auto at = head % data_.size();
+    auto first = std::min(size, data_.size() - at);
+    std::memcpy(&data_[at], line, first);
+    std::memcpy(&data_[0], line + first, size - first);
+    data_[(head + size) % data_.size()] = '\n';
+    head_.store(head + size + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Append everything pushed so far to out
+  void
+  drain(std::string& out)
+  {
+    auto tail = tail_.load(std::memory_order_relaxed);
+    auto head = head_.load(std::memory_order_acquire);
+    auto size = head - tail;
+    auto at = tail % data_.size();
+    auto first = std::min(size, data_.size() - at);
+    out.append(&data_[at], first);
+    out.append(&data_[0], size - first);
+    tail_.store(head, std::memory_order_release);
+  }
+
+  std::size_t
+  used() const
+  {
+    return head_.load(std::memory_order_relaxed) - tail_.load(std::memory_order_relaxed);
+  }
+
+  std::size_t
+  capacity() const
+  {
+    return data_.size();
+  }
+
+  std::size_t
+  dropped() const
+  {
+    return dropped_.load(std::memory_order_relaxed);
+  }
+
+private:
+  std::vector<char> data_;
+  // running byte counts, the position in data_ is modulo its size
+  std::atomic<std::size_t> head_;
+  std::atomic<std::size_t> tail_;
+  std::atomic<std::size_t> dropped_;
+};
+
+// The log file, written by a thread of its own. A thread logging only copies the line
+// into its ring; the writer collects the rings every flush interval, or sooner once
+// one is half full, and writes them out with one write(2) per flush_bytes. A line
+// that doesn't fit into its ring is dropped and counted, the writer notes how many.
+// One per process: a thread's ring is found through a thread_local.
+class async_log
+{
+public:
+  async_log(
+	    std::size_t ring_bytes,
+	    std::size_t flush_bytes,
+	    std::chrono::milliseconds flush_interval)
+    : ring_bytes_(ring_bytes)
+    , flush_bytes_(flush_bytes)
+    , flush_interval_(flush_interval)
+    , fd_(-1)
+    , running_{false}
+    , reopen_{false}
+    , dropped_noted_{0}
+  {
+  }
+
+  async_log(async_log const &) = delete;
+  async_log& operator=(async_log const &) = delete;
+
+  // what is still in the rings goes out, from the calling thread if need be
+  ~async_log()
+  {
+    stop();
+    if(fd_ >= 0)
+      ::close(fd_);
+  }
+
+  // Append to path, emptied first if truncate; false with errno set if it can't be opened
+  bool
+  open(std::string const & path, bool truncate)
+  {
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | (truncate ? O_TRUNC : 0), 0644);
+    if(fd < 0)
+      return false;
+    if(fd_ >= 0)
+      ::close(fd_);
+    fd_ = fd;
+    // a daemon changes directory, reopen() has to find the file all the same
+    char cwd[PATH_MAX];
+    if(path.front() != '/' && ::getcwd(cwd, sizeof(cwd)))
+      path_ = std::string(cwd) + "/" + path;
+    else
+      path_ = path;
+    return true;
+  }
+
+  // Start the writer. Lines logged before go out with its first flush; a fork()
+  // before this leaves the writer behind, so daemons start it afterwards.
+  void
+  start()
+  {
+    if(running_)
+      return;
+    running_ = true;
+    writer_ = std::thread([this]() { run(); });
+  }
+
+  // Stop the writer after it wrote everything logged so far
+  void
+  stop()
+  {
+    if(running_)
+      {
+	{
+	  std::lock_guard<std::mutex> lock(wake_mutex_);
+	  running_ = false;
+	}
+	wake_.notify_one();
+	writer_.join();
+      }
+    else
+      collect();
+  }
+
+  // A line from any thread, the newline is added. Never blocks; false if it was dropped.
+  bool
+  write(char const* line, std::size_t size)
+  {
+    auto& ring = my_ring();
+    if(! ring.push(line, size))
+      return false;
+    // the writer looks every flush interval anyway, this only brings it sooner
+    if(ring.used() > ring.capacity() / 2)
+      wake_.notify_one();
+    return true;
+  }
+
+  // Open the file under its name again with the next flush, e.g. after logrotate
+  // moved it away. Safe to call from anywhere.
+  void
+  reopen()
+  {
+    reopen_ = true;
+    wake_.notify_one();
+  }
+
+  // lines dropped because their thread's ring was full
+  std::size_t
+  dropped()
+  {
+    std::lock_guard<proxy_mutex> lock(rings_mutex_);
+    std::size_t n = 0;
+    for(auto const & ring : rings_)
+      n += ring->dropped();
+    return n;
+  }
+
+private:
+  log_ring&
+  my_ring()
+  {
+    thread_local log_ring* ring = nullptr;
+    if(! ring)
+      {
+	// once per thread, the rings stay until the log goes
+	std::lock_guard<proxy_mutex> lock(rings_mutex_);
+	rings_.emplace_back(new log_ring(ring_bytes_));
+	ring = rings_.back().get();
+      }
+    return *ring;
+  }
+
+  void
+  run()
+  {
+    for(;;)
+      {
+	bool running;
+	{
+	  std::unique_lock<std::mutex> lock(wake_mutex_);
+	  wake_.wait_for(lock, flush_interval_);
+	  running = running_;
+	}
+	if(reopen_.exchange(false))
+	  do_reopen();
+	collect();
+	if(! running)
+	  return;
+      }
+  }
+
+  // Drain every ring into batch_, then write it out once the rings are let go:
+  // a thread adding its ring must not wait for the disk
+  void
+  collect()
+  {
+    std::size_t dropped = 0;
+    {
+      std::lock_guard<proxy_mutex> lock(rings_mutex_);
+      for(auto const & ring : rings_)
+	{
+	  ring->drain(batch_);
+	  dropped += ring->dropped();
+	}
+    }
+    if(dropped > dropped_noted_)
+      {
+	batch_ += "NOTE log full, dropped " + std::to_string(dropped - dropped_noted_) + " lines\n";
+	dropped_noted_ = dropped;
+      }
+    flush();
+  }
+
+  // batch_ out, flush_bytes at a time
+  void
+  flush()
+  {
+    std::size_t done = 0;
+    while(fd_ >= 0 && done < batch_.size())
+      {
+	auto n = ::write(fd_, batch_.data() + done, std::min(batch_.size() - done, flush_bytes_));
+	if(n < 0 && errno == EINTR)
+	  continue;
+	if(n <= 0)
+	  break;
+	done += n;
+      }
+    batch_.clear();
+    // a burst may have grown it, it stays a flush or so
+    if(batch_.capacity() > 2 * flush_bytes_)
+      batch_.shrink_to_fit();
+  }
+
+  void
+  do_reopen()
+  {
+    if(! open(path_, false))
+      batch_ += "NOTE could not reopen log file " + path_ + ": " + std::strerror(errno) + "\n";
+  }
+
+  std::size_t const ring_bytes_;
+  std::size_t const flush_bytes_;
+  std::chrono::milliseconds const flush_interval_;
+  int fd_;
+  std::string path_;
+  proxy_mutex rings_mutex_{"log_rings"};	// taken by threads only to add their ring
+  std::vector<std::unique_ptr<log_ring> > rings_;
+  std::string batch_;	// the writer's
+  std::thread writer_;
+  std::mutex wake_mutex_;	// the writer's sleep, nobody logging takes it
+  std::condition_variable wake_;
+  bool running_;
+  std::atomic<bool> reopen_;
+  std::size_t dropped_noted_;
+};
@@ -0,0 +1,55 @@
+#!/bin/bash
+# Latency of small requests through the proxy with each socket option on its own.
+# Runs ./proxy on PORT once per setting, so nothing else may use that port.
+#
+#   ./bench.sh [URL] [REQUESTS]
+#
+# URL should be small and cacheable so the origin's latency stays out of it. Per
+# setting it prints the time to first byte in ms (median and 99th percentile) on
+# fresh connections and on one keep-alive connection.
+
+URL=${1:-http://www.example.com/}
+REQUESTS=${2:-200}
+PORT=${PORT:-12399}
+PROXY=127.0.0.1:$PORT
+
+SETTINGS=(
+    "--tcp-nodelay 0"
+    "--tcp-nodelay 1"
+    "--tcp-quickack 1"
+    "--tcp-defer-accept 5"
+    "--tcp-fastopen 256"
+    "--tcp-fastopen-connect 1"
+    "--tcp-keepalive 60 --tcp-keepalive-interval 10 --tcp-keepalive-count 5"
+    "--socket-rcvbuf 65536 --socket-sndbuf 65536"
+    "--tcp-notsent-lowat 16384"
+)
+
+# median and p99 of the numbers on stdin, in seconds, printed in ms
+percentiles() {
+    sort -n | awk '{ v[NR] = $1 }
+        END { if(NR == 0) { print "no samples"; exit }
+              p = int(NR * 0.99 + 0.5); if(p < 1) p = 1
+              printf "median %7.2f  p99 %7.2f", v[int((NR + 1) / 2)] * 1000, v[p] * 1000 }'
+}
+
+for setting in "${SETTINGS[@]}"; do
+    pkill -x proxy; sleep 0.3
+    ./proxy --port "$PORT" $setting > /dev/null || exit 1
+    sleep 0.5
+    # warm the cache
+    curl -s -o /dev/null -x "$PROXY" "$URL"
+
+    fresh=$(for i in $(seq "$REQUESTS"); do
+		curl -s -o /dev/null -w '%{time_starttransfer}\n' -x "$PROXY" "$URL"
+	    done | percentiles)
+
+    args=()
+    for i in $(seq "$REQUESTS"); do
+	args+=(-o /dev/null "$URL")
+    done
+    reused=$(curl -s -w '%{time_starttransfer}\n' -x "$PROXY" "${args[@]}" | percentiles)
+
+    printf '%-70s fresh: %s   keep-alive: %s\n' "$setting" "$fresh" "$reused"
+done
+pkill -x proxy
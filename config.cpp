@@ -0,0 +1,396 @@
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
+#include <sys/resource.h>
+#include <unistd.h>
+#include "cpu_affinity.cpp"
+#include "log_levels.cpp"
+#include "socket_options.cpp"
+
+// How long a session may spend in each phase, 0 means no limit
+struct session_timeouts
+{
+  std::chrono::seconds header{10};	// from connect or first byte to the end of the request header
+  std::chrono::seconds body{30};	// the rest of the request
+  std::chrono::seconds connect{10};	// name resolution and connecting upstream
+  std::chrono::seconds first_byte{30};	// request sent until the response starts
+  std::chrono::seconds idle{60};	// keep-alive between requests, silence within a response or tunnel
+};
+
+// Admission control, see admission_control
+struct admission_limits
+{
+  std::size_t max_sessions = 0;		// 0: as many as the descriptor limit allows
+  std::size_t max_sessions_per_client = 256;	// 0: no limit
+  std::chrono::milliseconds max_queue_delay{100};	// shed new connections beyond this loop lag, 0: never
+};
+
+// Rate limits per second, 0 means unlimited, see rate_limits
+struct rate_settings
+{
+  double requests_per_client = 0;
+  double bytes_per_client = 0;
+  double requests_total = 0;
+  double bytes_total = 0;
+};
+
+// Per request timing beyond the access log and histograms, see request_timing
+struct request_tracing
+{
+  bool server_timing = false;	// a Server-Timing header on responses
+  std::chrono::milliseconds slow_request{0};	// log the timeline of requests taking longer, 0: never
+};
+
+// Runtime settings. Defaults are overridden by the config file, which is overridden
+// by the command line. Config file lines are "key = value", '#' starts a comment;
+// the keys are the long option names without their dashes.
+struct proxy_config
+{
+  std::string address = "127.0.0.1";
+  unsigned short port = 12345;
+  std::string log_file;
+  std::string binary_log;	// empty: session events go to log_file as text
+  std::size_t binary_log_mb = 64;
+  log_settings logging;
+  std::string config_file;	// --config, read again on SIGHUP for the log levels
+  int threads = 0;		// 0: one per CPU left after cpus and numa_node
+  std::vector<int> cpus;	// empty: every CPU sched_getaffinity allows
+  int numa_node = -1;		// -1: don't restrict CPUs to a node
+  session_timeouts timeouts;
+  admission_limits admission;
+  rate_settings rates;
+  socket_options sockets;
+  std::string upgrade_socket;	// empty: no hot upgrade
+  std::chrono::seconds drain_timeout{30};
+  std::string admin_address = "127.0.0.1";
+  unsigned short admin_port = 0;	// 0: no admin port
+  request_tracing tracing;
+};
+
+char const* const config_usage =
+  "usage: proxy [options]\n"
+  "  --config FILE           read options from FILE (key = value per line)\n"
+  "  --address ADDR          listen address (127.0.0.1)\n"
+  "  --port PORT             listen port (12345)\n"
+  "  --log-file PATH         log file (logs/proxy.log)\n"
+  "  --binary-log PATH       session events as binary records into PATH, see event-decoder (off)\n"
+  "  --binary-log-mb N       size of the binary log file in MB, it wraps around (64)\n"
+  "  --log-access LEVEL      off, error, info or debug for request lines (debug)\n"
+  "  --log-cache LEVEL       likewise for cache lines (debug)\n"
+  "  --log-tunnel LEVEL      likewise for CONNECT tunnel lines (debug)\n"
+  "  --log-errors LEVEL      likewise for errors, timeouts and notes (debug)\n"
+  "  --log-sample-access N   log one in N access lines below error, likewise -cache, -tunnel, -errors (1)\n"
+  "  SIGHUP reads the log levels from the config file again\n"
+  "  --threads N             event loop threads (one per available CPU)\n"
+  "  --cpus LIST             CPUs to pin the threads to, e.g. 0-3,8\n"
+  "  --numa-node N           only use CPUs of NUMA node N\n"
+  "  --header-timeout S      seconds to receive a request header (10)\n"
+  "  --body-timeout S        seconds to receive the request body after it (30)\n"
+  "  --connect-timeout S     seconds to resolve and connect upstream (10)\n"
+  "  --first-byte-timeout S  seconds for the origin to start responding (30)\n"
+  "  --idle-timeout S        seconds of silence on keep-alive, response or tunnel (60)\n"
+  "  0 disables a timeout\n"
+  "  --max-sessions N        concurrent sessions before accepting pauses (from the raised RLIMIT_NOFILE)\n"
+  "  --max-sessions-per-client N  concurrent sessions per client address, 0 for no limit (256)\n"
+  "  --max-queue-delay MS    event loop lag beyond which new clients get a 503, 0 never (100)\n"
+  "  --client-requests-per-second N  requests per client address (unlimited)\n"
+  "  --client-bytes-per-second N     response and tunnel bytes per client address (unlimited)\n"
+  "  --total-requests-per-second N   requests of all clients together (unlimited)\n"
+  "  --total-bytes-per-second N      bytes of all clients together (unlimited)\n"
+  "  0 removes a rate limit\n"
+  "  --tcp-nodelay 0|1       TCP_NODELAY on client and upstream connections (1)\n"
+  "  --tcp-fastopen N        TCP_FASTOPEN queue length of the listener (off)\n"
+  "  --tcp-fastopen-connect 0|1  TCP_FASTOPEN_CONNECT upstream (0)\n"
+  "  --tcp-defer-accept S    TCP_DEFER_ACCEPT seconds on the listener (off)\n"
+  "  --tcp-quickack 0|1      TCP_QUICKACK on connections (0)\n"
+  "  --tcp-keepalive S       SO_KEEPALIVE, probing after S idle seconds (off)\n"
+  "  --tcp-keepalive-interval S  seconds between keepalive probes (kernel default)\n"
+  "  --tcp-keepalive-count N     probes before a connection is dropped (kernel default)\n"
+  "  --socket-rcvbuf BYTES   SO_RCVBUF of all sockets (autotuned)\n"
+  "  --socket-sndbuf BYTES   SO_SNDBUF of all sockets (autotuned)\n"
+  "  --tcp-notsent-lowat BYTES  TCP_NOTSENT_LOWAT on connections (off)\n"
+  "  --upgrade-socket PATH   UNIX socket to take over from and hand over to another process (off)\n"
+  "  --drain-timeout S       seconds the old process keeps serving its sessions after a hand over (30)\n"
+  "  --admin-port PORT       serve GET /metrics in the Prometheus text format on PORT (off)\n"
+  "  --admin-address ADDR    address of the admin port (127.0.0.1)\n"
+  "  --server-timing 0|1     Server-Timing header with the phases of each response (0)\n"
+  "  --slow-request-ms MS    log the phase timeline of requests slower than MS, 0 never (0)\n";
+
+bool parse_int(std::string const & value, long min, long max, long& result)
+{
+  char* end = nullptr;
+  long n = std::strtol(value.c_str(), &end, 10);
+  if(value.empty() || *end != '\0' || n < min || n > max)
+    return false;
+  result = n;
+  return true;
+}
+
+// log-CATEGORY = LEVEL and log-sample-CATEGORY = N, false if key is neither
+bool set_log_option(log_settings& logging, std::string const & key, std::string const & value)
+{
+  for(int i = 0; i < int(log_category::count); i++)
+    {
+      long n = 0;
+      if(key == std::string("log-") + log_category_names[i])
+	return parse_log_level(value, logging.level[i]);
+      if(key == std::string("log-sample-") + log_category_names[i] && parse_int(value, 1, 1000000000, n))
+	{
+	  logging.sample[i] = n;
+	  return true;
+	}
+    }
+  return false;
+}
+
+// apply one option, false with error set if key or value is bad
+bool set_config_option(
+		       proxy_config& config,
+		       std::string const & key,
+		       std::string const & value,
+		       std::string& error)
+{
+  long n = 0;
+  if(key.compare(0, 4, "log-") == 0 && set_log_option(config.logging, key, value))
+    ;
+  else if(key == "address")
+    config.address = value;
+  else if(key == "port" && parse_int(value, 1, 65535, n))
+    config.port = static_cast<unsigned short>(n);
+  else if(key == "log-file" && ! value.empty())
+    config.log_file = value;
+  else if(key == "binary-log")
+    config.binary_log = value;
+  else if(key == "binary-log-mb" && parse_int(value, 1, 65536, n))
+    config.binary_log_mb = n;
+  else if(key == "threads" && parse_int(value, 1, 4096, n))
+    config.threads = static_cast<int>(n);
+  else if(key == "cpus" && parse_cpu_list(value, config.cpus))
+    ;
+  else if(key == "numa-node" && parse_int(value, 0, 4095, n))
+    config.numa_node = static_cast<int>(n);
+  else if(key == "header-timeout" && parse_int(value, 0, 86400, n))
+    config.timeouts.header = std::chrono::seconds(n);
+  else if(key == "body-timeout" && parse_int(value, 0, 86400, n))
+    config.timeouts.body = std::chrono::seconds(n);
+  else if(key == "connect-timeout" && parse_int(value, 0, 86400, n))
+    config.timeouts.connect = std::chrono::seconds(n);
+  else if(key == "first-byte-timeout" && parse_int(value, 0, 86400, n))
+    config.timeouts.first_byte = std::chrono::seconds(n);
+  else if(key == "idle-timeout" && parse_int(value, 0, 86400, n))
+    config.timeouts.idle = std::chrono::seconds(n);
+  else if(key == "max-sessions" && parse_int(value, 1, 100000000, n))
+    config.admission.max_sessions = n;
+  else if(key == "max-sessions-per-client" && parse_int(value, 0, 100000000, n))
+    config.admission.max_sessions_per_client = n;
+  else if(key == "max-queue-delay" && parse_int(value, 0, 60000, n))
+    config.admission.max_queue_delay = std::chrono::milliseconds(n);
+  else if(key == "client-requests-per-second" && parse_int(value, 0, 1000000000, n))
+    config.rates.requests_per_client = n;
+  else if(key == "client-bytes-per-second" && parse_int(value, 0, LONG_MAX, n))
+    config.rates.bytes_per_client = n;
+  else if(key == "total-requests-per-second" && parse_int(value, 0, 1000000000, n))
+    config.rates.requests_total = n;
+  else if(key == "total-bytes-per-second" && parse_int(value, 0, LONG_MAX, n))
+    config.rates.bytes_total = n;
+  else if(key == "tcp-nodelay" && parse_int(value, 0, 1, n))
+    config.sockets.nodelay = n;
+  else if(key == "tcp-fastopen" && parse_int(value, 0, 65535, n))
+    config.sockets.fastopen = n;
+  else if(key == "tcp-fastopen-connect" && parse_int(value, 0, 1, n))
+    config.sockets.fastopen_connect = n;
+  else if(key == "tcp-defer-accept" && parse_int(value, 0, 3600, n))
+    config.sockets.defer_accept = n;
+  else if(key == "tcp-quickack" && parse_int(value, 0, 1, n))
+    config.sockets.quickack = n;
+  else if(key == "tcp-keepalive" && parse_int(value, 0, 86400, n))
+    config.sockets.keepalive_idle = n;
+  else if(key == "tcp-keepalive-interval" && parse_int(value, 0, 86400, n))
+    config.sockets.keepalive_interval = n;
+  else if(key == "tcp-keepalive-count" && parse_int(value, 0, 127, n))
+    config.sockets.keepalive_count = n;
+  else if(key == "socket-rcvbuf" && parse_int(value, 0, INT_MAX / 2, n))
+    config.sockets.rcvbuf = n;
+  else if(key == "socket-sndbuf" && parse_int(value, 0, INT_MAX / 2, n))
+    config.sockets.sndbuf = n;
+  else if(key == "tcp-notsent-lowat" && parse_int(value, 0, INT_MAX, n))
+    config.sockets.notsent_lowat = n;
+  else if(key == "upgrade-socket")
+    config.upgrade_socket = value;
+  else if(key == "drain-timeout" && parse_int(value, 0, 86400, n))
+    config.drain_timeout = std::chrono::seconds(n);
+  else if(key == "admin-port" && parse_int(value, 0, 65535, n))
+    config.admin_port = static_cast<unsigned short>(n);
+  else if(key == "admin-address")
+    config.admin_address = value;
+  else if(key == "server-timing" && parse_int(value, 0, 1, n))
+    config.tracing.server_timing = n;
+  else if(key == "slow-request-ms" && parse_int(value, 0, 86400000, n))
+    config.tracing.slow_request = std::chrono::milliseconds(n);
+  else
+    {
+      error = "bad option " + key + " = " + value;
+      return false;
+    }
+  return true;
+}
+
+std::string trim_config(std::string const & s)
+{
+  auto first = s.find_first_not_of(" \t\r");
+  if(first == std::string::npos)
+    return "";
+  auto last = s.find_last_not_of(" \t\r");
+  return s.substr(first, last - first + 1);
+}
+
+bool load_config_file(proxy_config& config, std::string const & path, std::string& error)
+{
+  std::ifstream in(path);
+  if(! in)
+    {
+      error = "can't read config file " + path;
+      return false;
+    }
+  std::string line;
+  for(int lineno = 1; std::getline(in, line); lineno++)
+    {
+      line = trim_config(line.substr(0, line.find('#')));
+      if(line.empty())
+	continue;
+      auto eq = line.find('=');
+      if(eq == std::string::npos)
+	{
+	  error = path + ":" + std::to_string(lineno) + ": expected key = value";
+	  return false;
+	}
+      if(! set_config_option(config, trim_config(line.substr(0, eq)), trim_config(line.substr(eq + 1)), error))
+	{
+	  error = path + ":" + std::to_string(lineno) + ": " + error;
+	  return false;
+	}
+    }
+  return true;
+}
+
+// --config is read first wherever it appears so the other options override the file
+bool parse_command_line(proxy_config& config, int argc, char* argv[], std::string& error)
+{
+  std::vector<std::pair<std::string, std::string> > options;
+  for(int i = 1; i < argc; i++)
+    {
+      std::string arg = argv[i];
+      if(arg.compare(0, 2, "--") != 0 || i + 1 == argc)
+	{
+	  error = "bad argument " + arg;
+	  return false;
+	}
+      options.emplace_back(arg.substr(2), argv[++i]);
+    }
+
+  for(auto const & o : options)
+    {
+      if(o.first != "config")
+	continue;
+      if(! load_config_file(config, o.second, error))
+	return false;
+      // a daemon changes directory, SIGHUP has to find the file all the same
+      char cwd[PATH_MAX];
+      if(o.second.front() != '/' && getcwd(cwd, sizeof(cwd)))
+	config.config_file = std::string(cwd) + "/" + o.second;
+      else
+	config.config_file = o.second;
+    }
+  for(auto const & o : options)
+    if(o.first != "config" && ! set_config_option(config, o.first, o.second, error))
+      return false;
+  return true;
+}
+
+// The log levels a fresh start would have: the config file read again, then the
+// log options of the command line over it. False with error set if the file is bad.
+bool reload_log_settings(
+			 proxy_config const & config,
+			 int argc,
+			 char* argv[],
+			 log_settings& logging,
+			 std::string& error)
+{
+  proxy_config fresh;
+  if(! config.config_file.empty() && ! load_config_file(fresh, config.config_file, error))
+    return false;
+  for(int i = 1; i + 1 < argc; i += 2)
+    {
+      std::string arg = argv[i];
+      if(arg.compare(0, 6, "--log-") == 0)
+	set_log_option(fresh.logging, arg.substr(2), argv[i + 1]);
+    }
+  logging = fresh.logging;
+  return true;
+}
+
+// The CPUs the event loops get pinned to: the configured list or everything we may use,
+// narrowed to numa_node. Empty with error set if nothing is left.
+std::vector<int> worker_cpus(proxy_config const & config, std::string& error)
+{
+  auto allowed = allowed_cpus();
+  std::vector<int> cpus;
+  for(int cpu : config.cpus.empty() ? allowed : config.cpus)
+    if(allowed.empty() || std::find(allowed.begin(), allowed.end(), cpu) != allowed.end())
+      cpus.push_back(cpu);
+
+  if(config.numa_node >= 0)
+    {
+      auto node = numa_node_cpus(config.numa_node);
+      if(node.empty())
+	{
+	  error = "no CPUs found for NUMA node " + std::to_string(config.numa_node);
+	  return {};
+	}
+      std::vector<int> on_node;
+      for(int cpu : cpus)
+	if(std::find(node.begin(), node.end(), cpu) != node.end())
+	  on_node.push_back(cpu);
+      cpus.swap(on_node);
+    }
+
+  if(cpus.empty() && (! config.cpus.empty() || config.numa_node >= 0))
+    error = "none of the configured CPUs are available";
+  return cpus;
+}
+
+// Raise the soft descriptor limit to the hard one, the kernel's most per process if
+// that is unlimited; the soft 1024 of most installs is far below what a proxy holds
+void raise_descriptor_limit()
+{
+  struct rlimit rl;
+  if(getrlimit(RLIMIT_NOFILE, &rl) != 0 || rl.rlim_cur == rl.rlim_max)
+    return;
+  rl.rlim_cur = rl.rlim_max;
+  if(rl.rlim_max == RLIM_INFINITY)
+    {
+      std::ifstream nr_open("/proc/sys/fs/nr_open");
+      unsigned long most = 0;
+      if(! (nr_open >> most) || most == 0)
+	return;
+      rl.rlim_cur = most;
+    }
+  setrlimit(RLIMIT_NOFILE, &rl);
+}
+
+// Sessions that fit into the descriptor limit, raised by raise_descriptor_limit: a
+// tunnel can hold six (two sockets, two splice pipes), some are kept back for pooled
+// upstream connections and the rest
+std::size_t default_max_sessions()
+{
+  struct rlimit rl;
+  if(getrlimit(RLIMIT_NOFILE, &rl) != 0 || rl.rlim_cur == RLIM_INFINITY)
+    return 0;
+  std::size_t reserved = 512;
+  return rl.rlim_cur > reserved + 6 * 16 ? (rl.rlim_cur - reserved) / 6 : 16;
+}
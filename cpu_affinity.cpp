@@ -0,0 +1,79 @@
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+// CPUs this process is allowed to run on in ascending order, empty if that's unknown
+std::vector<int> allowed_cpus()
+{
+  std::vector<int> cpus;
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if(sched_getaffinity(0, sizeof(set), &set) == 0)
+    for(int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+      if(CPU_ISSET(cpu, &set))
+	cpus.push_back(cpu);
+#endif
+  return cpus;
+}
+
+// Keep the calling thread on cpu, false if it can't be pinned
+bool pin_to_cpu(int cpu)
+{
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+  (void)cpu;
+  return false;
+#endif
+}
+
+// Parse a kernel style cpu list such as "0-3,8,10-11", false if it is malformed
+bool parse_cpu_list(std::string const & list, std::vector<int>& cpus)
+{
+  std::vector<int> result;
+  std::istringstream in(list);
+  std::string range;
+  while(std::getline(in, range, ','))
+    {
+      char* end = nullptr;
+      long first = std::strtol(range.c_str(), &end, 10);
+      long last = first;
+      if(end == range.c_str() || first < 0)
+	return false;
+      if(*end == '-')
+	{
+	  char const* start = end + 1;
+	  last = std::strtol(start, &end, 10);
+	  if(end == start || last < first)
+	    return false;
+	}
+      if((*end != '\0' && *end != '\n') || last >= 65536)
+	return false;
+      for(long cpu = first; cpu <= last; cpu++)
+	result.push_back(static_cast<int>(cpu));
+    }
+  if(result.empty())
+    return false;
+  cpus.swap(result);
+  return true;
+}
+
+// CPUs of NUMA node as sysfs lists them, empty if there is no such node
+std::vector<int> numa_node_cpus(int node)
+{
+  std::vector<int> cpus;
+  std::ifstream in("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+  std::string list;
+  if(in && std::getline(in, list))
+    parse_cpu_list(list, cpus);
+  return cpus;
+}
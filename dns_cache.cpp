@@ -0,0 +1,181 @@
+#include <boost/asio.hpp>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "dns_client.cpp"
+
+// Process-wide cache of resolved host names shared by every session.
+// Entries live for their TTL clamped into [min_ttl, max_ttl]; concurrent lookups of
+// the same name wait for one resolution; names that keep being asked for are
+// resolved again in the background shortly before they expire.
+class dns_cache
+{
+public:
+  typedef std::vector<boost::asio::ip::tcp::endpoint> endpoints;
+
+dns_cache(
+	  boost::asio::io_context& ioc,
+	  dns_client& client,
+	  std::chrono::seconds min_ttl,
+	  std::chrono::seconds max_ttl,
+	  std::size_t max_entries)
+  : ioc_{ioc}
+  , client_{client}
+  , min_ttl_{min_ttl}
+  , max_ttl_{max_ttl}
+  , max_entries_{max_entries}
+{
+}
+
+// Resolve host and hand handler (error_code, endpoints) with port filled in.
+// The handler runs on its associated executor (e.g. a session strand), never inline.
+template<class Handler>
+void async_resolve(std::string const & host, std::string const & port, Handler handler)
+{
+  auto executor = boost::asio::get_associated_executor(handler, ioc_.get_executor());
+  waiter complete =
+    [executor, handler, port, this](boost::system::error_code ec, endpoints eps) mutable
+    {
+      if(! ec && ! set_port(eps, port))
+	ec = boost::asio::error::service_not_found;
+      boost::asio::post(executor, std::bind(handler, ec, eps));
+    };
+
+  std::unique_lock<proxy_mutex> lock(dns_mutex);
+
+  auto now = std::chrono::steady_clock::now();
+  auto it = entries_.find(host);
+  if(it != entries_.end() && now < it->second.expires)
+    {
+      auto& e = it->second;
+      e.hits++;
+      bool refresh = ! e.ec && ! e.refreshing && now >= e.refresh_at && e.hits >= PREFETCH_MIN_HITS;
+      if(refresh)
+	e.refreshing = true;
+      auto ec = e.ec;
+      auto eps = e.eps;
+      lock.unlock();
+
+      if(refresh)
+	do_lookup(host);
+      return complete(ec, eps);
+    }
+
+  // somebody is resolving this name already, wait for that answer
+  auto& waiters = pending_[host];
+  waiters.push_back(complete);
+  if(waiters.size() > 1)
+    return;
+  lock.unlock();
+
+  do_lookup(host);
+}
+
+private:
+  typedef std::function<void(boost::system::error_code, endpoints)> waiter;
+
+  // a name must have been used this often in its current TTL to be prefetched
+  static constexpr unsigned PREFETCH_MIN_HITS = 2;
+
+struct entry
+{
+  boost::system::error_code ec;
+  endpoints eps;
+  std::chrono::steady_clock::time_point expires;
+  std::chrono::steady_clock::time_point refresh_at;	// prefetch once a hit comes after this
+  unsigned hits;
+  bool refreshing;
+};
+
+void do_lookup(std::string const & host)
+{
+  client_.async_resolve(
+			host,
+			[this, host](boost::system::error_code ec, endpoints eps, std::chrono::seconds ttl)
+			{
+			  on_lookup(host, ec, eps, ttl);
+			});
+}
+
+void on_lookup(
+	       std::string const & host,
+	       boost::system::error_code ec,
+	       endpoints const & eps,
+	       std::chrono::seconds ttl)
+{
+  std::vector<waiter> waiters;
+  {
+    std::lock_guard<proxy_mutex> lock(dns_mutex);
+
+    ttl = std::max(min_ttl_, std::min(max_ttl_, ttl));
+    // failures are remembered for the floor only, successes for their clamped TTL
+    if(ec)
+      ttl = min_ttl_;
+
+    auto now = std::chrono::steady_clock::now();
+    auto live = entries_.find(host);
+    // a failed prefetch leaves the answer we have, it is good until it expires
+    if(ec && live != entries_.end() && ! live->second.ec && now < live->second.expires)
+      live->second.refreshing = false;
+    else
+      {
+	if(entries_.size() >= max_entries_ && live == entries_.end())
+	  evict(now);
+	auto& e = entries_[host];
+	e.ec = ec;
+	e.eps = eps;
+	e.expires = now + ttl;
+	e.refresh_at = now + ttl * 9 / 10;
+	e.hits = 0;
+	e.refreshing = false;
+      }
+
+    auto it = pending_.find(host);
+    if(it != pending_.end())
+      {
+	waiters.swap(it->second);
+	pending_.erase(it);
+      }
+  }
+
+  for(auto& w : waiters)
+    w(ec, eps);
+}
+
+// drop expired entries, or an arbitrary one if nothing has expired
+void evict(std::chrono::steady_clock::time_point now)
+{
+  for(auto it = entries_.begin(); it != entries_.end(); )
+    it = now >= it->second.expires ? entries_.erase(it) : std::next(it);
+  if(entries_.size() >= max_entries_)
+    entries_.erase(entries_.begin());
+}
+
+bool set_port(endpoints& eps, std::string const & port)
+{
+  char* end = nullptr;
+  unsigned long p = std::strtoul(port.c_str(), &end, 10);
+  if(port.empty() || *end != '\0' || p > 65535)
+    return false;
+  for(auto& ep : eps)
+    ep.port(static_cast<unsigned short>(p));
+  return true;
+}
+
+private:
+  boost::asio::io_context& ioc_;
+  dns_client& client_;
+  std::unordered_map<std::string, entry> entries_;
+  // lookups in flight and the requests waiting for them
+  std::unordered_map<std::string, std::vector<waiter> > pending_;
+  std::chrono::seconds min_ttl_;
+  std::chrono::seconds max_ttl_;
+  std::size_t max_entries_;
+  proxy_mutex dns_mutex{"dns_cache"};
+};
@@ -0,0 +1,766 @@
+#include <boost/asio.hpp>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <ifaddrs.h>
+#include <netinet/in.h>
+#include <unistd.h>
+
+// Asynchronous DNS stub resolver running on the io_context instead of getaddrinfo threads.
+// Name servers, search list, ndots, timeout and attempts come from resolv.conf, fixed names
+// from the hosts file. A and AAAA questions go out in parallel over UDP; a truncated answer
+// is asked again over TCP.
+class dns_client
+{
+public:
+  typedef std::vector<boost::asio::ip::tcp::endpoint> endpoints;
+  // endpoints carry port 0, ttl is the smallest TTL of the records used
+  typedef std::function<void(boost::system::error_code, endpoints, std::chrono::seconds)> handler;
+
+// port is where the name servers listen, 53 but for a stand-in
+dns_client(
+	   boost::asio::io_context& ioc,
+	   std::string const & resolv_conf_path,
+	   std::string const & hosts_path,
+	   unsigned short port = DNS_PORT)
+  : ioc_{ioc}
+  , port_{port}
+  , timeout_{std::chrono::seconds(5)}
+  , attempts_{2}
+  , ndots_{1}
+  , ipv6_configured_{has_global_ipv6_address()}
+{
+  load_resolv_conf(resolv_conf_path);
+  load_hosts(hosts_path);
+}
+
+void async_resolve(std::string const & host, handler h)
+{
+  std::string name = host;
+  std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+  bool absolute = ! name.empty() && name.back() == '.';
+  if(absolute)
+    name.pop_back();
+
+  // literal addresses and hosts file entries need no question on the wire
+  boost::system::error_code ec;
+  auto literal = boost::asio::ip::make_address(name, ec);
+  if(! ec)
+    return complete_now(h, endpoints{boost::asio::ip::tcp::endpoint(literal, 0)}, std::chrono::seconds::max());
+  auto it = hosts_.find(name);
+  if(it != hosts_.end())
+    return complete_now(h, it->second, std::chrono::seconds::max());
+
+  if(name.empty() || name.size() > 253 || servers_.empty())
+    {
+      boost::asio::post(ioc_, std::bind(h, boost::asio::error::host_not_found, endpoints(), std::chrono::seconds(0)));
+      return;
+    }
+
+  std::make_shared<lookup>(*this, search_names(name, absolute), h)->run();
+}
+
+// AAAA questions are asked only if a global IPv6 address was found, like
+// AI_ADDRCONFIG does; this says otherwise
+void ask_ipv6(bool ask)
+{
+  ipv6_configured_ = ask;
+}
+
+private:
+  static constexpr std::uint16_t TYPE_A = 1;
+  static constexpr std::uint16_t TYPE_CNAME = 5;
+  static constexpr std::uint16_t TYPE_AAAA = 28;
+  static constexpr std::uint16_t CLASS_IN = 1;
+  static constexpr unsigned short DNS_PORT = 53;
+  static constexpr std::size_t UDP_MESSAGE_SIZE = 512;
+
+  typedef boost::asio::strand<boost::asio::io_context::executor_type> strand;
+  typedef std::function<void(boost::system::error_code, std::vector<boost::asio::ip::address>, std::chrono::seconds)> answer_handler;
+
+void complete_now(handler const & h, endpoints eps, std::chrono::seconds ttl)
+{
+  boost::asio::post(ioc_, std::bind(h, boost::system::error_code(), eps, ttl));
+}
+
+// The names to ask for in turn until one exists, as resolv.conf(5) has it: a name
+// with at least ndots dots is tried as it is first, one with fewer after the search
+// domains; one that ended in a dot only as it is
+std::vector<std::string> search_names(std::string const & name, bool absolute)
+{
+  if(absolute)
+    return {name};
+  std::vector<std::string> names;
+  bool as_is_first = std::size_t(std::count(name.begin(), name.end(), '.')) >= ndots_;
+  if(as_is_first)
+    names.push_back(name);
+  for(auto const & domain : search_)
+    if(name.size() + 1 + domain.size() <= 253)
+      names.push_back(name + "." + domain);
+  if(! as_is_first)
+    names.push_back(name);
+  return names;
+}
+
+// One question (A or AAAA) for one name, retried over every name server in turn
+class query : public std::enable_shared_from_this<query>
+{
+public:
+  query(dns_client& client, strand& s, std::string const & name, std::uint16_t type, answer_handler h)
+    : client_(client)
+    , strand_(s)
+    , udp_sock_{client.ioc_}
+    , tcp_sock_{client.ioc_}
+    , timer_{client.ioc_}
+    , name_(name)
+    , type_(type)
+    , handler_(h)
+    , attempt_{0}
+    , timed_out_{false}
+  {
+  }
+
+  void
+  run()
+  {
+    do_send_udp();
+  }
+
+private:
+  boost::asio::ip::udp::endpoint
+  server()
+  {
+    return client_.servers_[attempt_ % client_.servers_.size()];
+  }
+
+  void
+  do_send_udp()
+  {
+    request_ = build_query(name_, type_, id_);
+    timed_out_ = false;
+
+    boost::system::error_code ec;
+    udp_sock_.close(ec);
+    udp_sock_.open(server().protocol(), ec);
+    if(! ec)
+      udp_sock_.connect(server(), ec);
+    if(ec)
+      return on_attempt_failed(ec);
+
+    start_timer();
+    udp_sock_.async_send(
+			 boost::asio::buffer(request_),
+			 boost::asio::bind_executor(
+						    strand_,
+						    std::bind(
+							      &query::on_send_udp,
+							      shared_from_this(),
+							      std::placeholders::_1)));
+  }
+
+  void
+  on_send_udp(boost::system::error_code ec)
+  {
+    if(ec)
+      return on_attempt_failed(ec);
+    do_recv_udp();
+  }
+
+  void
+  do_recv_udp()
+  {
+    response_.resize(UDP_MESSAGE_SIZE);
+    udp_sock_.async_receive(
+			    boost::asio::buffer(response_),
+			    boost::asio::bind_executor(
+						       strand_,
+						       std::bind(
+								 &query::on_recv_udp,
+								 shared_from_this(),
+								 std::placeholders::_1,
+								 std::placeholders::_2)));
+  }
+
+  void
+  on_recv_udp(boost::system::error_code ec, std::size_t bytes_transferred)
+  {
+    if(ec)
+      return on_attempt_failed(ec);
+    response_.resize(bytes_transferred);
+
+    // anything that isn't the answer to our question is ignored, the timer still runs
+    if(! is_answer_to(response_, id_, name_, type_))
+      return do_recv_udp();
+
+    if(is_truncated(response_))
+      {
+	timer_.cancel();
+	udp_sock_.close(ec);
+	return do_connect_tcp();
+      }
+    on_response();
+  }
+
+  void
+  do_connect_tcp()
+  {
+    timed_out_ = false;
+    start_timer();
+    boost::asio::ip::tcp::endpoint ep(server().address(), server().port());
+    tcp_sock_.async_connect(
+			    ep,
+			    boost::asio::bind_executor(
+						       strand_,
+						       std::bind(
+								 &query::on_connect_tcp,
+								 shared_from_this(),
+								 std::placeholders::_1)));
+  }
+
+  void
+  on_connect_tcp(boost::system::error_code ec)
+  {
+    if(ec)
+      return on_attempt_failed(ec);
+
+    // over TCP every message is prefixed with its length
+    tcp_request_.clear();
+    tcp_request_.push_back(static_cast<std::uint8_t>(request_.size() >> 8));
+    tcp_request_.push_back(static_cast<std::uint8_t>(request_.size() & 0xff));
+    tcp_request_.insert(tcp_request_.end(), request_.begin(), request_.end());
+    boost::asio::async_write(
+			     tcp_sock_,
+			     boost::asio::buffer(tcp_request_),
+			     boost::asio::bind_executor(
+							strand_,
+							std::bind(
+								  &query::on_send_tcp,
+								  shared_from_this(),
+								  std::placeholders::_1)));
+  }
+
+  void
+  on_send_tcp(boost::system::error_code ec)
+  {
+    if(ec)
+      return on_attempt_failed(ec);
+    boost::asio::async_read(
+			    tcp_sock_,
+			    boost::asio::buffer(tcp_length_),
+			    boost::asio::bind_executor(
+						       strand_,
+						       std::bind(
+								 &query::on_recv_tcp_length,
+								 shared_from_this(),
+								 std::placeholders::_1)));
+  }
+
+  void
+  on_recv_tcp_length(boost::system::error_code ec)
+  {
+    if(ec)
+      return on_attempt_failed(ec);
+    response_.resize((std::size_t(tcp_length_[0]) << 8) | tcp_length_[1]);
+    boost::asio::async_read(
+			    tcp_sock_,
+			    boost::asio::buffer(response_),
+			    boost::asio::bind_executor(
+						       strand_,
+						       std::bind(
+								 &query::on_recv_tcp,
+								 shared_from_this(),
+								 std::placeholders::_1)));
+  }
+
+  void
+  on_recv_tcp(boost::system::error_code ec)
+  {
+    if(ec)
+      return on_attempt_failed(ec);
+    if(! is_answer_to(response_, id_, name_, type_))
+      return on_attempt_failed(boost::asio::error::invalid_argument);
+    on_response();
+  }
+
+  void
+  on_response()
+  {
+    timer_.cancel();
+    boost::system::error_code ec;
+    udp_sock_.close(ec);
+    tcp_sock_.close(ec);
+
+    std::vector<boost::asio::ip::address> addresses;
+    std::chrono::seconds ttl(0);
+    int rcode = parse_answer(response_, name_, type_, addresses, ttl);
+
+    // SERVFAIL and REFUSED are the server's problem, the next one may know better
+    if(rcode == 2 || rcode == 5)
+      return on_attempt_failed(boost::asio::error::host_not_found_try_again);
+    if(rcode == 3)
+      return handler_(boost::asio::error::host_not_found, addresses, ttl);
+    if(rcode != 0)
+      return handler_(boost::asio::error::no_recovery, addresses, ttl);
+    if(addresses.empty())
+      return handler_(boost::asio::error::no_data, addresses, ttl);
+    handler_(boost::system::error_code(), addresses, ttl);
+  }
+
+  void
+  start_timer()
+  {
+    timer_.expires_after(client_.timeout_);
+    timer_.async_wait(
+		      boost::asio::bind_executor(
+						 strand_,
+						 std::bind(
+							   &query::on_timer,
+							   shared_from_this(),
+							   std::placeholders::_1,
+							   attempt_)));
+  }
+
+  void
+  on_timer(boost::system::error_code ec, std::size_t attempt)
+  {
+    // a timer which fired while its attempt was completing must not hit the next one
+    if(ec || attempt != attempt_)
+      return;
+    // closing the sockets aborts the pending operation, which moves to the next attempt
+    timed_out_ = true;
+    udp_sock_.close(ec);
+    tcp_sock_.close(ec);
+  }
+
+  void
+  on_attempt_failed(boost::system::error_code ec)
+  {
+    timer_.cancel();
+    boost::system::error_code ignored;
+    udp_sock_.close(ignored);
+    tcp_sock_.close(ignored);
+
+    if(timed_out_)
+      ec = boost::asio::error::timed_out;
+    if(++attempt_ < client_.attempts_ * client_.servers_.size())
+      return do_send_udp();
+    handler_(ec, std::vector<boost::asio::ip::address>(), std::chrono::seconds(0));
+  }
+
+private:
+  dns_client& client_;
+  strand& strand_;
+  boost::asio::ip::udp::socket udp_sock_;
+  boost::asio::ip::tcp::socket tcp_sock_;
+  boost::asio::steady_timer timer_;
+  std::string name_;
+  std::uint16_t type_;
+  std::uint16_t id_;
+  answer_handler handler_;
+  std::vector<std::uint8_t> request_;
+  std::vector<std::uint8_t> tcp_request_;
+  std::vector<std::uint8_t> response_;
+  std::array<std::uint8_t, 2> tcp_length_;
+  std::size_t attempt_;
+  bool timed_out_;
+};
+
+// Both questions for each name of the search list until one exists; everything,
+// the start included, runs on one strand
+class lookup : public std::enable_shared_from_this<lookup>
+{
+public:
+  lookup(dns_client& client, std::vector<std::string> names, handler h)
+    : client_(client)
+    , strand_{client.ioc_.get_executor()}
+    , names_(std::move(names))
+    , next_{0}
+    , handler_(h)
+    , outstanding_{0}
+  {
+  }
+
+  void
+  run()
+  {
+    boost::asio::post(strand_, std::bind(&lookup::do_ask, shared_from_this()));
+  }
+
+private:
+  void
+  do_ask()
+  {
+    auto self = shared_from_this();
+    auto const & name = names_[next_];
+    v6_.clear();
+    v4_.clear();
+    ttl_ = std::chrono::seconds::max();
+    ec_ = {};
+    outstanding_ = client_.ipv6_configured_ ? 2 : 1;
+    if(client_.ipv6_configured_)
+      std::make_shared<query>(client_, strand_, name, TYPE_AAAA,
+			      [self](boost::system::error_code ec, std::vector<boost::asio::ip::address> a, std::chrono::seconds ttl)
+			      {
+				self->on_answer(ec, a, ttl, self->v6_);
+			      })->run();
+    std::make_shared<query>(client_, strand_, name, TYPE_A,
+			    [self](boost::system::error_code ec, std::vector<boost::asio::ip::address> a, std::chrono::seconds ttl)
+			    {
+			      self->on_answer(ec, a, ttl, self->v4_);
+			    })->run();
+  }
+
+  void
+  on_answer(
+	    boost::system::error_code ec,
+	    std::vector<boost::asio::ip::address> const & addresses,
+	    std::chrono::seconds ttl,
+	    endpoints& eps)
+  {
+    if(ec)
+      {
+	// NXDOMAIN says the most, a missing record type the least
+	if(! ec_ || ec == boost::asio::error::host_not_found || ec_ == boost::asio::error::no_data)
+	  ec_ = ec;
+      }
+    else
+      {
+	for(auto const & a : addresses)
+	  eps.push_back(boost::asio::ip::tcp::endpoint(a, 0));
+	ttl_ = std::min(ttl_, ttl);
+      }
+
+    if(--outstanding_ > 0)
+      return;
+
+    // IPv6 first as getaddrinfo orders them, then IPv4
+    endpoints eps_all(v6_);
+    eps_all.insert(eps_all.end(), v4_.begin(), v4_.end());
+    if(! eps_all.empty())
+      return handler_(boost::system::error_code(), eps_all, ttl_);
+    if(ec_ == boost::asio::error::no_data)
+      ec_ = boost::asio::error::host_not_found;
+    // the name doesn't exist, the next of the search list may; any other failure
+    // would only repeat for every one of them
+    if(ec_ == boost::asio::error::host_not_found && ++next_ < names_.size())
+      return do_ask();
+    handler_(ec_, eps_all, std::chrono::seconds(0));
+  }
+
+private:
+  dns_client& client_;
+  strand strand_;
+  std::vector<std::string> names_;
+  std::size_t next_;	// of names_, asked now
+  handler handler_;
+  int outstanding_;
+  endpoints v6_;
+  endpoints v4_;
+  std::chrono::seconds ttl_;
+  boost::system::error_code ec_;
+};
+
+// header, then the question: labels of name, type, class IN
+static std::vector<std::uint8_t>
+build_query(std::string const & name, std::uint16_t type, std::uint16_t& id)
+{
+  thread_local std::mt19937 rng{std::random_device{}()};
+  id = static_cast<std::uint16_t>(rng());
+
+  std::vector<std::uint8_t> msg = {
+    static_cast<std::uint8_t>(id >> 8), static_cast<std::uint8_t>(id & 0xff),
+    0x01, 0x00,		// standard query, recursion desired
+    0x00, 0x01,		// one question
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+  };
+  std::stringstream ss(name);
+  std::string label;
+  while(std::getline(ss, label, '.'))
+    {
+      label = label.substr(0, 63);
+      msg.push_back(static_cast<std::uint8_t>(label.size()));
+      msg.insert(msg.end(), label.begin(), label.end());
+    }
+  msg.push_back(0);
+  msg.push_back(static_cast<std::uint8_t>(type >> 8));
+  msg.push_back(static_cast<std::uint8_t>(type & 0xff));
+  msg.push_back(0);
+  msg.push_back(CLASS_IN);
+  return msg;
+}
+
+static std::uint16_t
+read16(std::vector<std::uint8_t> const & msg, std::size_t pos)
+{
+  return static_cast<std::uint16_t>((msg[pos] << 8) | msg[pos + 1]);
+}
+
+static std::uint32_t
+read32(std::vector<std::uint8_t> const & msg, std::size_t pos)
+{
+  return (std::uint32_t(read16(msg, pos)) << 16) | read16(msg, pos + 2);
+}
+
+// Read a possibly compressed name at pos into name (lower case, no trailing dot).
+// pos moves past the name as stored in place; false on a malformed message.
+static bool
+read_name(std::vector<std::uint8_t> const & msg, std::size_t& pos, std::string& name)
+{
+  name.clear();
+  std::size_t p = pos;
+  bool jumped = false;
+  for(int hops = 0; hops < 64; hops++)
+    {
+      if(p >= msg.size())
+	return false;
+      std::uint8_t len = msg[p];
+      if((len & 0xc0) == 0xc0)
+	{
+	  if(p + 1 >= msg.size())
+	    return false;
+	  if(! jumped)
+	    pos = p + 2;
+	  jumped = true;
+	  p = read16(msg, p) & 0x3fff;
+	  continue;
+	}
+      if(len == 0)
+	{
+	  if(! jumped)
+	    pos = p + 1;
+	  return true;
+	}
+      if(p + 1 + len > msg.size())
+	return false;
+      if(! name.empty())
+	name += '.';
+      for(std::size_t i = p + 1; i < p + 1 + len; i++)
+	name += static_cast<char>(::tolower(msg[i]));
+      p += 1 + len;
+    }
+  return false;
+}
+
+static bool
+is_answer_to(std::vector<std::uint8_t> const & msg, std::uint16_t id, std::string const & name, std::uint16_t type)
+{
+  if(msg.size() < 12 || read16(msg, 0) != id || ! (msg[2] & 0x80) || read16(msg, 4) != 1)
+    return false;
+  std::size_t pos = 12;
+  std::string qname;
+  if(! read_name(msg, pos, qname) || pos + 4 > msg.size())
+    return false;
+  return qname == name && read16(msg, pos) == type && read16(msg, pos + 2) == CLASS_IN;
+}
+
+static bool
+is_truncated(std::vector<std::uint8_t> const & msg)
+{
+  return msg[2] & 0x02;
+}
+
+// Collect the addresses of name, following CNAMEs inside the answer section.
+// Returns the RCODE, ttl is the smallest TTL along the chain.
+static int
+parse_answer(
+	     std::vector<std::uint8_t> const & msg,
+	     std::string const & name,
+	     std::uint16_t type,
+	     std::vector<boost::asio::ip::address>& addresses,
+	     std::chrono::seconds& ttl)
+{
+  int rcode = msg[3] & 0x0f;
+  std::size_t ancount = read16(msg, 6);
+  std::size_t pos = 12;
+  std::string owner;
+  read_name(msg, pos, owner);
+  pos += 4;
+
+  struct record { std::string owner; std::uint16_t type; std::uint32_t ttl; std::size_t rdata; std::size_t rdlength; };
+  std::vector<record> records;
+  for(std::size_t i = 0; i < ancount; i++)
+    {
+      record r;
+      if(! read_name(msg, pos, r.owner) || pos + 10 > msg.size())
+	break;
+      r.type = read16(msg, pos);
+      r.ttl = read32(msg, pos + 4);
+      r.rdlength = read16(msg, pos + 8);
+      r.rdata = pos + 10;
+      pos = r.rdata + r.rdlength;
+      if(pos > msg.size())
+	break;
+      if(read16(msg, r.rdata - 8) == CLASS_IN)
+	records.push_back(r);
+    }
+
+  std::uint32_t min_ttl = UINT32_MAX;
+  std::string current = name;
+  for(int hops = 0; hops < 8; hops++)
+    {
+      bool aliased = false;
+      for(auto const & r : records)
+	{
+	  if(r.owner != current || r.type != TYPE_CNAME)
+	    continue;
+	  std::size_t p = r.rdata;
+	  std::string target;
+	  if(! read_name(msg, p, target))
+	    break;
+	  min_ttl = std::min(min_ttl, r.ttl);
+	  current = target;
+	  aliased = true;
+	  break;
+	}
+      if(! aliased)
+	break;
+    }
+
+  for(auto const & r : records)
+    {
+      if(r.owner != current || r.type != type)
+	continue;
+      if(type == TYPE_A && r.rdlength == 4)
+	{
+	  boost::asio::ip::address_v4::bytes_type b;
+	  std::copy(msg.begin() + r.rdata, msg.begin() + r.rdata + 4, b.begin());
+	  addresses.push_back(boost::asio::ip::address_v4(b));
+	}
+      else if(type == TYPE_AAAA && r.rdlength == 16)
+	{
+	  boost::asio::ip::address_v6::bytes_type b;
+	  std::copy(msg.begin() + r.rdata, msg.begin() + r.rdata + 16, b.begin());
+	  addresses.push_back(boost::asio::ip::address_v6(b));
+	}
+      else
+	continue;
+      min_ttl = std::min(min_ttl, r.ttl);
+    }
+
+  ttl = std::chrono::seconds(addresses.empty() ? 0 : min_ttl);
+  return rcode;
+}
+
+// nameserver, search and domain lines, options timeout:N, attempts:N and ndots:N;
+// 127.0.0.1 if no server is listed. The last of search and domain wins, without
+// either the search list is the domain of the host name.
+void load_resolv_conf(std::string const & path)
+{
+  bool searching = false;
+  std::ifstream in(path);
+  std::string line;
+  while(std::getline(in, line))
+    {
+      std::stringstream ss(line);
+      std::string keyword, value;
+      ss >> keyword;
+      if(keyword == "nameserver" && ss >> value)
+	{
+	  boost::system::error_code ec;
+	  auto address = boost::asio::ip::make_address(value, ec);
+	  if(! ec)
+	    servers_.push_back(boost::asio::ip::udp::endpoint(address, port_));
+	}
+      else if(keyword == "search" || keyword == "domain")
+	{
+	  searching = true;
+	  search_.clear();
+	  while(ss >> value && search_.size() < 6)
+	    add_search_domain(value);
+	}
+      else if(keyword == "options")
+	{
+	  while(ss >> value)
+	    {
+	      if(value.compare(0, 8, "timeout:") == 0)
+		timeout_ = std::chrono::seconds(std::max(1, std::atoi(value.c_str() + 8)));
+	      else if(value.compare(0, 9, "attempts:") == 0)
+		attempts_ = std::max(1, std::atoi(value.c_str() + 9));
+	      else if(value.compare(0, 6, "ndots:") == 0)
+		ndots_ = std::min(15, std::max(0, std::atoi(value.c_str() + 6)));
+	    }
+	}
+    }
+  if(servers_.empty())
+    servers_.push_back(boost::asio::ip::udp::endpoint(boost::asio::ip::address_v4::loopback(), port_));
+  if(! searching)
+    {
+      char host[256] = {};
+      if(::gethostname(host, sizeof(host) - 1) == 0 && std::strchr(host, '.'))
+	add_search_domain(std::strchr(host, '.') + 1);
+    }
+}
+
+void add_search_domain(std::string domain)
+{
+  std::transform(domain.begin(), domain.end(), domain.begin(), ::tolower);
+  if(! domain.empty() && domain.back() == '.')
+    domain.pop_back();
+  if(! domain.empty())
+    search_.push_back(domain);
+}
+
+// "address name alias..." lines, # starts a comment
+void load_hosts(std::string const & path)
+{
+  std::ifstream in(path);
+  std::string line;
+  while(std::getline(in, line))
+    {
+      line = line.substr(0, line.find('#'));
+      std::stringstream ss(line);
+      std::string value, name;
+      if(! (ss >> value))
+	continue;
+      boost::system::error_code ec;
+      auto address = boost::asio::ip::make_address(value, ec);
+      if(ec)
+	continue;
+      while(ss >> name)
+	{
+	  std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+	  hosts_[name].push_back(boost::asio::ip::tcp::endpoint(address, 0));
+	}
+    }
+}
+
+// like AI_ADDRCONFIG: no AAAA questions on hosts which couldn't reach an IPv6 address anyway
+static bool
+has_global_ipv6_address()
+{
+  struct ifaddrs* ifs;
+  if(getifaddrs(&ifs) != 0)
+    return true;
+  bool found = false;
+  for(struct ifaddrs* i = ifs; i != nullptr && ! found; i = i->ifa_next)
+    {
+      if(i->ifa_addr == nullptr || i->ifa_addr->sa_family != AF_INET6)
+	continue;
+      auto sin6 = reinterpret_cast<struct sockaddr_in6*>(i->ifa_addr);
+      found = ! IN6_IS_ADDR_LOOPBACK(&sin6->sin6_addr) && ! IN6_IS_ADDR_LINKLOCAL(&sin6->sin6_addr);
+    }
+  freeifaddrs(ifs);
+  return found;
+}
+
+private:
+  boost::asio::io_context& ioc_;
+  unsigned short port_;
+  std::vector<boost::asio::ip::udp::endpoint> servers_;
+  std::vector<std::string> search_;	// domains tried after or before a name, see search_names
+  std::unordered_map<std::string, endpoints> hosts_;
+  std::chrono::seconds timeout_;
+  std::size_t attempts_;
+  std::size_t ndots_;
+  bool ipv6_configured_;
+};
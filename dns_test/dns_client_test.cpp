@@ -0,0 +1,79 @@
+// dns_client against stand_in.py: parallel A and AAAA questions, the next server
+// after a SERVFAIL or a timeout, a timeout of every server, a truncated UDP answer
+// asked again over TCP and the search list.
+//
+//   dns_client_test RESOLV_CONF PORT
+#include <boost/asio.hpp>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "../dns_client.cpp"
+
+struct test_case
+{
+  std::string host;
+  std::string addresses;	// expected, IPv6 first, or ""
+  boost::system::error_code ec;	// expected
+  std::chrono::milliseconds at_least;
+  std::chrono::milliseconds at_most;
+};
+
+int
+main(int argc, char* argv[])
+{
+  if(argc != 3)
+    {
+      std::cerr << "usage: dns_client_test RESOLV_CONF PORT" << std::endl;
+      return EXIT_FAILURE;
+    }
+  using std::chrono::milliseconds;
+  std::vector<test_case> cases = {
+    // the stand-in holds each question back 300ms
+    {"dual.test", "2001:db8::1 192.0.2.1", {}, milliseconds(300), milliseconds(550)},
+    {"big.test", "192.0.2.7", {}, milliseconds(0), milliseconds(900)},
+    // the first server never answers: one timeout, then the second
+    {"flaky.test", "192.0.2.8", {}, milliseconds(1000), milliseconds(1900)},
+    {"silent.test", "", boost::asio::error::timed_out, milliseconds(2000), milliseconds(2900)},
+    {"nothere.test", "", boost::asio::error::host_not_found, milliseconds(0), milliseconds(900)},
+    // fewer dots than ndots:2, the search domain first
+    {"intranet", "192.0.2.10", {}, milliseconds(0), milliseconds(900)},
+    {"svc.ns", "192.0.2.11", {}, milliseconds(0), milliseconds(900)},
+    {"svc.ns.", "192.0.2.12", {}, milliseconds(0), milliseconds(900)},
+    {"www.example.test", "192.0.2.13", {}, milliseconds(0), milliseconds(900)},
+  };
+
+  boost::asio::io_context ioc;
+  dns_client client{ioc, argv[1], "/dev/null", static_cast<unsigned short>(std::atoi(argv[2]))};
+  client.ask_ipv6(true);
+
+  int failed = 0;
+  std::size_t next = 0;
+  std::chrono::steady_clock::time_point start;
+  std::function<void()> run_next = [&]()
+    {
+      if(next == cases.size())
+	return;
+      start = std::chrono::steady_clock::now();
+      client.async_resolve(
+			   cases[next].host,
+			   [&](boost::system::error_code ec, dns_client::endpoints eps, std::chrono::seconds)
+			   {
+			     auto const & c = cases[next++];
+			     auto took = std::chrono::duration_cast<milliseconds>(std::chrono::steady_clock::now() - start);
+			     std::string addresses;
+			     for(auto const & ep : eps)
+			       addresses += (addresses.empty() ? "" : " ") + ep.address().to_string();
+			     bool ok = ec == c.ec && addresses == c.addresses && took >= c.at_least && took <= c.at_most;
+			     failed += ! ok;
+			     std::cout << (ok ? "ok   " : "FAIL ") << c.host << ": " << (ec ? ec.message() : addresses)
+				       << " in " << took.count() << "ms" << std::endl;
+			     run_next();
+			   });
+    };
+  run_next();
+  ioc.run();
+  std::cout << cases.size() - failed << " of " << cases.size() << " passed" << std::endl;
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,15 @@
+#!/bin/bash
+# Builds dns_client_test, starts the stand-in name server and runs the test against it.
+#
+#   dns_test/run.sh [PORT]
+
+cd "$(dirname "$0")" || exit 1
+PORT=${1:-15353}
+${CXX:-clang++} -std=c++17 ${CXXFLAGS} -o dns_client_test dns_client_test.cpp -lboost_system -lpthread || exit 1
+python3 stand_in.py "$PORT" &
+server=$!
+sleep 0.5
+./dns_client_test resolv.conf "$PORT"
+status=$?
+kill "$server"
+exit $status
@@ -0,0 +1,94 @@
+#!/usr/bin/env python3
+# A name server for dns_client_test, see resolv.conf next to it. 127.0.0.2 answers
+# SERVFAIL, or nothing for flaky.test; 127.0.0.1 answers from RECORDS, over UDP and TCP.
+#
+#   stand_in.py PORT
+
+import socket
+import struct
+import sys
+import threading
+import time
+
+RECORDS = {
+    # both questions are held back, asked one after the other they take twice as long
+    ("dual.test", 1): ["192.0.2.1"],
+    ("dual.test", 28): ["2001:db8::1"],
+    ("big.test", 1): ["192.0.2.7"],	# truncated over UDP, whole over TCP
+    ("flaky.test", 1): ["192.0.2.8"],
+    ("intranet.corp.test", 1): ["192.0.2.10"],
+    ("svc.ns.corp.test", 1): ["192.0.2.11"],
+    ("svc.ns", 1): ["192.0.2.12"],
+    ("www.example.test", 1): ["192.0.2.13"],
+}
+NAMES = {name for name, _ in RECORDS}
+DELAYED = {"dual.test"}
+TRUNCATED = {"big.test"}
+SILENT = {"silent.test"}	# never answered, by either server
+DELAY = 0.3
+
+
+def parse_question(msg):
+    labels, pos = [], 12
+    while msg[pos]:
+        labels.append(msg[pos + 1:pos + 1 + msg[pos]].decode().lower())
+        pos += 1 + msg[pos]
+    qtype, = struct.unpack("!H", msg[pos + 1:pos + 3])
+    return ".".join(labels), qtype, msg[12:pos + 5]
+
+
+def answer(msg, good, tcp):
+    name, qtype, question = parse_question(msg)
+    if name in SILENT or (not good and name == "flaky.test"):
+        return None
+    if not good:
+        return msg[:2] + struct.pack("!HHHHH", 0x8182, 1, 0, 0, 0) + question
+    if name in DELAYED:
+        time.sleep(DELAY)
+    addresses = RECORDS.get((name, qtype), [])
+    flags = 0x8180 if name in NAMES else 0x8183	# NOERROR or NXDOMAIN
+    if name in TRUNCATED and not tcp:
+        flags |= 0x0200
+        addresses = []
+    records = b""
+    for a in addresses:
+        family = socket.AF_INET if qtype == 1 else socket.AF_INET6
+        data = socket.inet_pton(family, a)
+        records += struct.pack("!HHHIH", 0xc00c, qtype, 1, 60, len(data)) + data
+    return msg[:2] + struct.pack("!HHHHH", flags, 1, len(addresses), 0, 0) + question + records
+
+
+def serve_udp(address, port, good):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind((address, port))
+    while True:
+        msg, peer = sock.recvfrom(512)
+        def reply(msg=msg, peer=peer):
+            out = answer(msg, good, False)
+            if out:
+                sock.sendto(out, peer)
+        threading.Thread(target=reply, daemon=True).start()
+
+
+def serve_tcp(address, port, good):
+    listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    listener.bind((address, port))
+    listener.listen(16)
+    while True:
+        conn, _ = listener.accept()
+        def reply(conn=conn):
+            with conn:
+                length, = struct.unpack("!H", conn.recv(2, socket.MSG_WAITALL))
+                out = answer(conn.recv(length, socket.MSG_WAITALL), good, True)
+                if out:
+                    conn.sendall(struct.pack("!H", len(out)) + out)
+        threading.Thread(target=reply, daemon=True).start()
+
+
+port = int(sys.argv[1])
+for address, good in (("127.0.0.2", False), ("127.0.0.1", True)):
+    for serve in (serve_udp, serve_tcp):
+        threading.Thread(target=serve, args=(address, port, good), daemon=True).start()
+while True:
+    time.sleep(3600)
@@ -0,0 +1,215 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "lock_profile.cpp"
+#include "event_log.cpp"
+
+// Prints the binary event log of a proxy run with --binary-log as the lines the
+// text log has, or as one JSON object per line. Reads the file as it is, the proxy
+// may go on writing it; events the ring already wrapped over are gone.
+
+char const* const event_names[] = {
+  "",
+  "request",
+  "pipelined",
+  "not_in_cache",
+  "cache_valid",
+  "cache_needs_validation",
+  "cache_expired",
+  "etag",
+  "requesting",
+  "received",
+  "revalidated",
+  "cached",
+  "not_cacheable",
+  "evicted",
+  "responding",
+  "tunnel_ok",
+  "tunnel_response",
+  "tunnel_closed",
+  "timing"
+};
+
+struct event_file
+{
+  event_log_header const * header;
+  char const * strings;
+  event_record const * events;
+
+  // "" for 0, an id of an epoch of the string region gone by, one beyond what
+  // was written or one pointing past the region
+  boost::string_view
+  string(std::uint32_t id) const
+  {
+    auto state = header->strings_state.load();
+    if(! event_string_current(id, state))
+      return {};
+    auto at = event_string_offset(id);
+    std::uint32_t length;
+    if(at + sizeof(length) > std::uint32_t(state))
+      return {};
+    std::memcpy(&length, strings + at, sizeof(length));
+    if(at + sizeof(length) + length > header->strings_size)
+      return {};
+    return boost::string_view(strings + at + sizeof(length), length);
+  }
+};
+
+std::string
+json_string(boost::string_view s)
+{
+  std::string out = "\"";
+  for(char c : s)
+    {
+      if(c == '"' || c == '\\')
+	out += std::string("\\") + c;
+      else if(static_cast<unsigned char>(c) < 0x20)
+	{
+	  char escaped[8];
+	  std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+	  out += escaped;
+	}
+      else
+	out += c;
+    }
+  return out + "\"";
+}
+
+std::string
+json_event(event_file const & file, event_record const & r, std::int64_t ns)
+{
+  auto code = event_code(r.code);
+  auto a = file.string(r.a);
+  auto b = file.string(r.b);
+  std::string out = "{\"time_ns\":" + std::to_string(ns) +
+    ",\"session\":" + std::to_string(r.session) +
+    ",\"sub\":" + std::to_string(r.sub) +
+    ",\"event\":" + json_string(r.code < sizeof(event_names) / sizeof(event_names[0]) ? event_names[r.code] : "unknown");
+  auto version = std::string(",\"version\":\"HTTP/") + (r.version == 11 ? "1.1" : "1") + "\"";
+  auto method = [&r]() { return ",\"method\":" + json_string(boost::beast::http::to_string(boost::beast::http::verb(r.small))); };
+  switch(code)
+    {
+    case event_code::request:
+      out += method() + ",\"target\":" + json_string(a) + version + ",\"client\":" + json_string(b);
+      break;
+    case event_code::pipelined:
+      out += method() + ",\"target\":" + json_string(a);
+      break;
+    case event_code::cache_expired:
+      out += ",\"expired\":" + std::to_string(r.a);
+      break;
+    case event_code::etag:
+      out += ",\"etag\":" + json_string(a);
+      break;
+    case event_code::requesting:
+      out += method() + ",\"target\":" + json_string(a) + version + ",\"host\":" + json_string(b);
+      break;
+    case event_code::received:
+      out += version + ",\"status\":" + std::to_string(r.small) + ",\"host\":" + json_string(b);
+      break;
+    case event_code::revalidated:
+      out += ",\"status\":" + std::to_string(r.small);
+      break;
+    case event_code::not_cacheable:
+      out += ",\"reason\":" + json_string(r.small < 4 ? not_cacheable_reasons[r.small] : "?");
+      break;
+    case event_code::evicted:
+      out += ",\"key\":" + json_string(a);
+      break;
+    case event_code::responding:
+      out += version + ",\"status\":" + std::to_string(r.small);
+      break;
+    case event_code::timing:
+      out += ",\"phase\":" + json_string(r.small < std::uint16_t(timing_phase::count) ? timing_phases[r.small].name : "?") +
+	",\"us\":" + std::to_string(r.a);
+      break;
+    default:
+      break;
+    }
+  return out + "}";
+}
+
+int main(int argc, char* argv[])
+{
+  bool json = argc == 3 && std::string(argv[1]) == "--json";
+  if(argc != 2 && ! json)
+    {
+      std::cerr << "usage: event-decoder [--json] FILE\n";
+      return EXIT_FAILURE;
+    }
+  char const* path = argv[argc - 1];
+  int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if(fd < 0 || ::fstat(fd, &st) != 0 || std::size_t(st.st_size) < sizeof(event_log_header))
+    {
+      std::cerr << path << ": " << (fd < 0 ? std::strerror(errno) : "not an event log") << std::endl;
+      return EXIT_FAILURE;
+    }
+  void* p = ::mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if(p == MAP_FAILED)
+    {
+      std::cerr << path << ": " << std::strerror(errno) << std::endl;
+      return EXIT_FAILURE;
+    }
+  auto header = static_cast<event_log_header const *>(p);
+  if(std::memcmp(header->magic, "PXYEVT2", 8) != 0 ||
+     header->record_size != sizeof(event_record) ||
+     header->events_offset + header->events_capacity * sizeof(event_record) > std::size_t(st.st_size))
+    {
+      std::cerr << path << ": not an event log of this version" << std::endl;
+      return EXIT_FAILURE;
+    }
+  event_file file{
+    header,
+    static_cast<char const *>(p) + header->strings_offset,
+    reinterpret_cast<event_record const *>(static_cast<char const *>(p) + header->events_offset)};
+
+  // a slot holds an event once its seq names it, threads write their blocks
+  // interleaved so the order is by time
+  std::vector<event_record> events;
+  auto const capacity = header->events_capacity;
+  for(std::uint64_t i = 0; i < capacity; i++)
+    {
+      auto seq = __atomic_load_n(&file.events[i].seq, __ATOMIC_ACQUIRE);
+      if(seq == 0 || ((seq - 1) & (capacity - 1)) != i)
+	continue;
+      events.push_back(file.events[i]);
+    }
+  std::stable_sort(
+		   events.begin(),
+		   events.end(),
+		   [](event_record const & x, event_record const & y)
+		   {
+		     return x.ticks < y.ticks;
+		   });
+
+  for(std::size_t i = 0; i < events.size(); i++)
+    {
+      auto const & r = events[i];
+      auto ns = event_clock::to_wall_ns(*header, r.ticks);
+      if(json)
+	{
+	  std::cout << json_event(file, r, ns) << "\n";
+	  continue;
+	}
+      auto id = std::to_string(r.session) + (r.sub ? "." + std::to_string(r.sub) : std::string()) + ": ";
+      auto line = format_event(id, r, file.string(r.a), file.string(r.b), time_t(ns / 1000000000));
+      // the phases of a request, written one after the other, make one line as in the text log
+      while(r.code == std::uint8_t(event_code::timing) && i + 1 < events.size() &&
+	    events[i + 1].code == r.code && events[i + 1].session == r.session && events[i + 1].sub == r.sub)
+	{
+	  i++;
+	  line += " " + timing_text(events[i].small, events[i].a);
+	}
+      std::cout << line << "\n";
+    }
+  return EXIT_SUCCESS;
+}
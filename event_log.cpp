@@ -0,0 +1,570 @@
+#include <boost/asio.hpp>
+#include <boost/beast/http/verb.hpp>
+#include <boost/utility/string_view.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "request_timing.cpp"
+
+// What a session does with a request, one fixed size record each in the binary
+// event log. The lines they stand for are in format_event.
+enum class event_code : std::uint8_t
+{
+  request = 1,	// small: method, a: target, b: client address
+  pipelined,	// small: method, a: target
+  not_in_cache,
+  cache_valid,
+  cache_needs_validation,
+  cache_expired,	// a: the time it expired, as the cache keeps it
+  etag,	// a: the ETag sent along to revalidate
+  requesting,	// small: method, a: target, b: host
+  received,	// small: status, b: host
+  revalidated,	// small: status
+  cached,
+  not_cacheable,	// small: one of not_cacheable_reasons
+  evicted,	// a: cache key
+  responding,	// small: status
+  tunnel_ok,
+  tunnel_response,
+  tunnel_closed,
+  timing	// small: a timing_phase, a: its microseconds
+};
+
+char const* const not_cacheable_reasons[] = {
+  "PRIVATE",
+  "NO-STORE",
+  "no Cache-Control and Expires",
+  "VARY *"
+};
+
+// 32 bytes, several to a cache line. Strings are ids into the file's string region.
+struct event_record
+{
+  std::uint64_t ticks;	// event_clock::now()
+  std::uint32_t seq;	// low bits of the slot number plus one, written last; 0 never written
+  std::uint32_t session;
+  std::uint32_t sub;	// pipelined request of the session, 0 for its own
+  std::uint8_t code;	// event_code
+  std::uint8_t version;	// HTTP version, 11 for 1.1
+  std::uint16_t small;
+  std::uint32_t a;
+  std::uint32_t b;
+};
+static_assert(sizeof(event_record) == 32, "event records are 32 bytes");
+
+// Layout of the file: this header in its first page, then the strings, then the
+// ring of events. All in native byte order, it is read back on the same machine.
+struct event_log_header
+{
+  char magic[8];	// "PXYEVT2"
+  std::uint32_t record_size;
+  std::uint32_t header_size;
+  std::uint64_t strings_offset;
+  std::uint64_t strings_size;
+  std::uint64_t events_offset;
+  std::uint64_t events_capacity;	// records, a power of two
+  // the string region's epoch in the high 32 bits, its bytes in use in the low
+  // ones. Once full the region starts over in the next epoch.
+  std::atomic<std::uint64_t> strings_state;
+  std::atomic<std::uint64_t> next_slot;	// events ever reserved
+  // two readings of the tick clock together with the wall clock, the first from
+  // when the file was made, the second refreshed while the log is written
+  std::uint64_t anchor_ticks[2];
+  std::int64_t anchor_ns[2];	// since the epoch
+};
+
+// A string id is the low 8 bits of the region's epoch, then the string's offset
+// in 4 byte units plus one; 0 is no string. Ids of another epoch are stale, the
+// strings they named are gone. The region is at most what 24 bits of offset reach.
+std::uint64_t const event_strings_max = std::uint64_t(4) << 24;
+
+inline std::uint32_t
+event_string_id(std::uint32_t epoch, std::uint64_t offset)
+{
+  return (epoch & 0xff) << 24 | std::uint32_t(offset / 4 + 1);
+}
+
+inline bool
+event_string_current(std::uint32_t id, std::uint64_t strings_state)
+{
+  return id != 0 && id >> 24 == (std::uint32_t(strings_state >> 32) & 0xff);
+}
+
+inline std::uint64_t
+event_string_offset(std::uint32_t id)
+{
+  return std::uint64_t((id & 0xffffff) - 1) * 4;
+}
+
+// Cheap timestamps: the CPU's time stamp counter where there is one, else the
+// monotonic clock in ns. The anchors in the header convert them to wall clock time.
+struct event_clock
+{
+  static std::uint64_t
+  now()
+  {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return std::uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+#endif
+  }
+
+  static std::int64_t
+  wall_ns()
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return std::int64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+  }
+
+  // Wall clock time of ticks by the anchors of a header
+  static std::int64_t
+  to_wall_ns(event_log_header const & h, std::uint64_t ticks)
+  {
+    double span = double(h.anchor_ticks[1]) - double(h.anchor_ticks[0]);
+    double ns_per_tick = span > 0 ? (h.anchor_ns[1] - h.anchor_ns[0]) / span : 1;
+    return h.anchor_ns[0] + std::int64_t((double(ticks) - double(h.anchor_ticks[0])) * ns_per_tick);
+  }
+};
+
+// "Mon Oct 19 02:54:30 2026 GMT", the way the text log prints times
+inline std::string
+ctime_string(time_t t)
+{
+  char ctime_buffer[100];
+  ctime_r(&t, ctime_buffer);
+  std::string s(ctime_buffer);
+  s.pop_back();
+  return s + " GMT";
+}
+
+// the same for the current time, which the text log shifts to GMT first
+inline std::string
+gmt_string(time_t t)
+{
+  struct tm gmt_buffer;
+  return ctime_string(mktime(gmtime_r(&t, &gmt_buffer)));
+}
+
+// "ttfb=5.310ms", one phase of a request's timing line
+inline std::string
+timing_text(std::uint16_t phase, std::uint32_t us)
+{
+  return std::string(phase < std::uint16_t(timing_phase::count) ? timing_phases[phase].name : "?") + "=" + timing_ms(us) + "ms";
+}
+
+// The text log line of an event, id being "session: " or "session.sub: " and when
+// the time it happened. The proxy writes these when there is no binary event log,
+// the decoder prints the same from one.
+inline std::string
+format_event(
+	     std::string const & id,
+	     event_record const & r,
+	     boost::string_view a,
+	     boost::string_view b,
+	     time_t when)
+{
+  auto version = std::string("HTTP/") + (r.version == 11 ? "1.1" : "1");
+  auto method = [&r]() { return std::string(boost::beast::http::to_string(boost::beast::http::verb(r.small))); };
+  switch(event_code(r.code))
+    {
+    case event_code::request:
+      return id + method() + " " + std::string(a) + " " + version + " from " + std::string(b) + " @ " + gmt_string(when);
+    case event_code::pipelined:
+      return id + method() + " " + std::string(a) + " pipelined";
+    case event_code::not_in_cache:
+      return id + "not in cache";
+    case event_code::cache_valid:
+      return id + "in cache, valid";
+    case event_code::cache_needs_validation:
+      return id + "in cache, requires validation";
+    case event_code::cache_expired:
+      return id + "in cache, but expired at " + ctime_string(r.a);
+    case event_code::etag:
+      return id + "NOTE ETag: " + std::string(a);
+    case event_code::requesting:
+      return id + "Requesting " + method() + " " + std::string(a) + " " + version + " from " + std::string(b);
+    case event_code::received:
+      return id + "Received " + version + " " + std::to_string(r.small) + " from " + std::string(b);
+    case event_code::revalidated:
+      return id + "Received revalidation " + std::to_string(r.small) + " from SERVER";
+    case event_code::cached:
+      return id + "NOTE cache the response";
+    case event_code::not_cacheable:
+      return id + "not cacheable because " + (r.small < 4 ? not_cacheable_reasons[r.small] : "?");
+    case event_code::evicted:
+      return "NOTE evicted " + std::string(a);
+    case event_code::responding:
+      return id + "Responding " + version + " " + std::to_string(r.small);
+    case event_code::tunnel_ok:
+      return id + "Successfully send 200-OK to client";
+    case event_code::tunnel_response:
+      return id + "Responding RESPONSE";
+    case event_code::tunnel_closed:
+      return id + "Tunnel closed";
+    case event_code::timing:
+      return id + "Timing " + timing_text(r.small, r.a);
+    }
+  return id + "event " + std::to_string(r.code);
+}
+
+// Which of a and b of an event's record are string ids
+inline bool
+event_a_is_string(event_code code)
+{
+  switch(code)
+    {
+    case event_code::request:
+    case event_code::pipelined:
+    case event_code::etag:
+    case event_code::requesting:
+    case event_code::evicted:
+      return true;
+    default:
+      return false;
+    }
+}
+
+inline bool
+event_b_is_string(event_code code)
+{
+  return code == event_code::request || code == event_code::requesting || code == event_code::received;
+}
+
+// The binary event log: a file mapped into memory, a header, a region of strings
+// each written once and a ring of event records. A thread writes an event into a
+// slot of a block it reserved, no locks and no system calls; a string is interned
+// once, later events refer to it by id. Several processes may write one file, a
+// process taking over from another during an upgrade carries on in its file.
+class event_log
+{
+public:
+  event_log()
+    : header_{nullptr}
+    , size_{0}
+    , timer_{nullptr}
+  {
+  }
+
+  event_log(event_log const &) = delete;
+  event_log& operator=(event_log const &) = delete;
+
+  ~event_log()
+  {
+    if(header_)
+      {
+	calibrate();
+	::munmap(header_, size_);
+      }
+  }
+
+  bool
+  enabled() const
+  {
+    return header_ != nullptr;
+  }
+
+  // Map path, size bytes of it. fresh starts it over, else a file of the same
+  // size already holding a log is carried on. False with error set if it can't be.
+  bool
+  open(std::string const & path, std::size_t size, bool fresh, std::string& error)
+  {
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    struct stat st;
+    if(fd < 0 || ::fstat(fd, &st) != 0)
+      {
+	error = path + ": " + std::strerror(errno);
+	if(fd >= 0)
+	  ::close(fd);
+	return false;
+      }
+    // one page of header, a quarter for strings up to what ids reach, the rest for
+    // as many events as the largest power of two that fits
+    std::size_t const page = 4096;
+    std::size_t strings = std::min<std::size_t>((size - page) / 4 & ~std::size_t(3), event_strings_max);
+    std::size_t capacity = 1;
+    while((capacity * 2) * sizeof(event_record) <= size - page - strings)
+      capacity *= 2;
+    std::size_t total = page + strings + capacity * sizeof(event_record);
+    fresh = fresh || std::size_t(st.st_size) != total;
+    if(fresh && (::ftruncate(fd, 0) != 0 || ::ftruncate(fd, total) != 0))
+      {
+	error = path + ": " + std::strerror(errno);
+	::close(fd);
+	return false;
+      }
+    void* p = ::mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if(p == MAP_FAILED)
+      {
+	error = path + ": " + std::strerror(errno);
+	return false;
+      }
+    header_ = static_cast<event_log_header*>(p);
+    size_ = total;
+    if(fresh || std::memcmp(header_->magic, "PXYEVT2", 8) != 0)
+      {
+	std::memcpy(header_->magic, "PXYEVT2", 8);
+	header_->record_size = sizeof(event_record);
+	header_->header_size = sizeof(event_log_header);
+	header_->strings_offset = page;
+	header_->strings_size = strings;
+	header_->events_offset = page + strings;
+	header_->events_capacity = capacity;
+	header_->strings_state = 0;
+	header_->next_slot = 0;
+	header_->anchor_ticks[0] = event_clock::now();
+	header_->anchor_ns[0] = event_clock::wall_ns();
+	// a first rate for the ticks, refreshed by run()
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	calibrate();
+      }
+    return true;
+  }
+
+  // Refresh the second anchor every interval on ioc, the longer the two are apart
+  // the better the decoder gets the times
+  void
+  run(boost::asio::io_context& ioc, std::chrono::seconds interval)
+  {
+    if(! header_)
+      return;
+    timer_.reset(new boost::asio::steady_timer(ioc));
+    interval_ = interval;
+    do_calibrate();
+  }
+
+  // Stop refreshing, before the io_context of run() goes
+  void
+  stop()
+  {
+    timer_.reset();
+    if(header_)
+      calibrate();
+  }
+
+  // Id of s in the string region, 0 for none or if s is larger than the region.
+  // A string this thread interned before costs a hash and a lookup. A full region
+  // starts over in the next epoch, forgetting the strings of the last.
+  std::uint32_t
+  intern(boost::string_view s)
+  {
+    if(s.empty())
+      return 0;
+    auto hash = std::hash<std::string_view>()(std::string_view(s.data(), s.size()));
+    auto state = header_->strings_state.load(std::memory_order_acquire);
+    auto& seen = thread_strings();
+    // another thread, or process, started the region over: what this thread saw is gone
+    if(! seen.empty() && ! event_string_current(seen.begin()->second, state))
+      seen.clear();
+    auto found = seen.find(hash);
+    if(found != seen.end() && string_at(found->second) == s)
+      return found->second;
+
+    std::uint32_t id;
+    {
+      std::lock_guard<proxy_mutex> lock(strings_mutex_);
+      if(! strings_.empty() && ! event_string_current(strings_.begin()->second, state))
+	strings_.clear();
+      auto shared = strings_.find(hash);
+      if(shared != strings_.end() && string_at(shared->second) == s)
+	id = shared->second;
+      else
+	{
+	  bool restarted;
+	  id = append_string(s, restarted);
+	  if(id == 0)
+	    return 0;
+	  if(restarted)
+	    strings_.clear();
+	  strings_[hash] = id;
+	}
+    }
+    // bounded: a thread forgets what it saw once it saw a lot, or when the
+    // region started over under it
+    if(seen.size() >= 65536 || (! seen.empty() && seen.begin()->second >> 24 != id >> 24))
+      seen.clear();
+    seen[hash] = id;
+    return id;
+  }
+
+  // Times the string region started over, and strings that didn't fit even then
+  std::uint64_t
+  string_restarts() const
+  {
+    return string_restarts_.load(std::memory_order_relaxed);
+  }
+
+  std::uint64_t
+  strings_dropped() const
+  {
+    return strings_dropped_.load(std::memory_order_relaxed);
+  }
+
+  void
+  write(
+	event_code code,
+	std::uint32_t session,
+	std::uint32_t sub,
+	std::uint8_t version,
+	std::uint16_t small,
+	std::uint32_t a,
+	std::uint32_t b)
+  {
+    auto& block = thread_block();
+    if(block.next == block.end)
+      {
+	block.next = header_->next_slot.fetch_add(block_slots, std::memory_order_relaxed);
+	block.end = block.next + block_slots;
+      }
+    auto slot = block.next++;
+    auto& r = events()[slot & (header_->events_capacity - 1)];
+    // a reader may come by any time, it trusts a record whose seq matches its slot
+    __atomic_store_n(&r.seq, 0, __ATOMIC_RELAXED);
+    r.ticks = event_clock::now();
+    r.session = session;
+    r.sub = sub;
+    r.code = std::uint8_t(code);
+    r.version = version;
+    r.small = small;
+    r.a = a;
+    r.b = b;
+    __atomic_store_n(&r.seq, std::uint32_t(slot + 1), __ATOMIC_RELEASE);
+  }
+
+private:
+  // slots a thread reserves at a time, a thread touches the shared counter once per block
+  static constexpr std::uint64_t block_slots = 64;
+
+  struct block
+  {
+    std::uint64_t next = 0;
+    std::uint64_t end = 0;
+  };
+
+  static block&
+  thread_block()
+  {
+    thread_local block b;
+    return b;
+  }
+
+  // hash to id, all of one epoch
+  static std::unordered_map<std::size_t, std::uint32_t>&
+  thread_strings()
+  {
+    thread_local std::unordered_map<std::size_t, std::uint32_t> seen;
+    return seen;
+  }
+
+  event_record*
+  events()
+  {
+    return reinterpret_cast<event_record*>(reinterpret_cast<char*>(header_) + header_->events_offset);
+  }
+
+  char*
+  strings()
+  {
+    return reinterpret_cast<char*>(header_) + header_->strings_offset;
+  }
+
+  // A string is its length in 4 bytes and its bytes, padded to 4 bytes. Read
+  // while another process may be starting the region over: what the length
+  // claims is checked against the region.
+  boost::string_view
+  string_at(std::uint32_t id)
+  {
+    auto at = event_string_offset(id);
+    std::uint32_t length;
+    std::memcpy(&length, strings() + at, sizeof(length));
+    if(at + sizeof(length) + length > header_->strings_size)
+      return {};
+    return boost::string_view(strings() + at + sizeof(length), length);
+  }
+
+  // Appends s, starting the region over in the next epoch if s doesn't fit in
+  // what is left; restarted tells. 0 if s doesn't fit in the whole region.
+  std::uint32_t
+  append_string(boost::string_view s, bool& restarted)
+  {
+    std::uint32_t length = s.size();
+    std::uint64_t need = (sizeof(length) + std::uint64_t(s.size()) + 3) & ~std::uint64_t(3);
+    restarted = false;
+    if(need > header_->strings_size)
+      {
+	strings_dropped_.fetch_add(1, std::memory_order_relaxed);
+	return 0;
+      }
+    auto state = header_->strings_state.load(std::memory_order_relaxed);
+    std::uint32_t epoch;
+    std::uint64_t at;
+    do
+      {
+	epoch = std::uint32_t(state >> 32);
+	at = std::uint32_t(state);
+	restarted = at + need > header_->strings_size;
+	if(restarted)
+	  {
+	    epoch++;
+	    at = 0;
+	  }
+      }
+    while(! header_->strings_state.compare_exchange_weak(state, std::uint64_t(epoch) << 32 | (at + need), std::memory_order_acq_rel));
+    if(restarted)
+      string_restarts_.fetch_add(1, std::memory_order_relaxed);
+    std::memcpy(strings() + at, &length, sizeof(length));
+    std::memcpy(strings() + at + sizeof(length), s.data(), length);
+    return event_string_id(epoch, at);
+  }
+
+  void
+  calibrate()
+  {
+    header_->anchor_ticks[1] = event_clock::now();
+    header_->anchor_ns[1] = event_clock::wall_ns();
+  }
+
+  void
+  do_calibrate()
+  {
+    calibrate();
+    timer_->expires_after(interval_);
+    timer_->async_wait(
+		       [this](boost::system::error_code ec)
+		       {
+			 if(! ec)
+			   do_calibrate();
+		       });
+  }
+
+  event_log_header* header_;
+  std::size_t size_;
+  proxy_mutex strings_mutex_{"event_log_strings"};	// taken only for strings no thread of ours has seen
+  std::unordered_map<std::size_t, std::uint32_t> strings_;	// hash to id, of one epoch
+  std::atomic<std::uint64_t> string_restarts_{0};
+  std::atomic<std::uint64_t> strings_dropped_{0};
+  std::unique_ptr<boost::asio::steady_timer> timer_;
+  std::chrono::seconds interval_;
+};
@@ -0,0 +1,256 @@
+#include <boost/asio.hpp>
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Blocks of a few sizes kept per thread once freed and handed out again instead of
+// going back to malloc: session objects, their buffers. A block freed on another
+// thread than it came from simply joins that thread's lists.
+class recycler
+{
+public:
+  // blocks up to 64 kB are kept, at most 4 MB of each size per thread
+  static constexpr std::size_t min_block = 64;
+  static constexpr std::size_t max_block = 65536;
+  static constexpr std::size_t max_kept = 4 << 20;
+
+  static void*
+  allocate(std::size_t size)
+  {
+    auto c = size_class(size);
+    if(c == classes)
+      return ::operator new(size);
+    auto& free = lists().free[c];
+    if(free.empty())
+      return ::operator new(min_block << c);
+    void* p = free.back();
+    free.pop_back();
+    return p;
+  }
+
+  static void
+  deallocate(void* p, std::size_t size)
+  {
+    auto c = size_class(size);
+    if(c == classes)
+      return ::operator delete(p);
+    auto& free = lists().free[c];
+    if(free.size() * (min_block << c) >= max_kept)
+      return ::operator delete(p);
+    free.push_back(p);
+  }
+
+private:
+  static constexpr std::size_t classes = 11;	// 64 bytes to 64 kB in powers of two
+
+  struct thread_lists
+  {
+    ~thread_lists()
+    {
+      for(auto& free : this->free)
+	for(void* p : free)
+	  ::operator delete(p);
+    }
+
+    std::array<std::vector<void*>, classes> free;
+  };
+
+  static thread_lists&
+  lists()
+  {
+    thread_local thread_lists l;
+    return l;
+  }
+
+  // index into the free lists, classes for sizes beyond max_block
+  static std::size_t
+  size_class(std::size_t size)
+  {
+    std::size_t c = 0;
+    while(c < classes && (min_block << c) < size)
+      c++;
+    return c;
+  }
+};
+
+// std::allocator with the recycler behind it
+template<class T>
+class recycling_allocator
+{
+public:
+  typedef T value_type;
+
+  recycling_allocator() noexcept = default;
+
+  template<class U>
+  recycling_allocator(recycling_allocator<U> const &) noexcept
+  {
+  }
+
+  T*
+  allocate(std::size_t n)
+  {
+    return static_cast<T*>(recycler::allocate(n * sizeof(T)));
+  }
+
+  void
+  deallocate(T* p, std::size_t n) noexcept
+  {
+    recycler::deallocate(p, n * sizeof(T));
+  }
+
+  template<class U>
+  bool operator==(recycling_allocator<U> const &) const noexcept { return true; }
+  template<class U>
+  bool operator!=(recycling_allocator<U> const &) const noexcept { return false; }
+};
+
+// Memory for the handlers of one session's asynchronous operations. A session only
+// has a few in flight at a time, each takes one of the blocks here and leaves it for
+// the next, so after its first request a session allocates nothing for its handlers.
+// Not thread safe: only for handlers run on the session's own loop.
+class handler_memory
+{
+public:
+  handler_memory() = default;
+  handler_memory(handler_memory const &) = delete;
+  handler_memory& operator=(handler_memory const &) = delete;
+
+  ~handler_memory()
+  {
+    for(auto& b : blocks_)
+      if(b.data)
+	recycler::deallocate(b.data, b.size);
+  }
+
+  void*
+  allocate(std::size_t size)
+  {
+    block* spare = nullptr;
+    for(auto& b : blocks_)
+      {
+	if(b.in_use)
+	  continue;
+	if(b.size >= size)
+	  {
+	    b.in_use = true;
+	    return b.data;
+	  }
+	if(! spare || b.size < spare->size)
+	  spare = &b;
+      }
+    // every block busy: more operations in flight than ever before
+    if(! spare)
+      return ::operator new(size);
+    if(spare->data)
+      recycler::deallocate(spare->data, spare->size);
+    spare->size = std::max<std::size_t>(size, 256);
+    spare->data = recycler::allocate(spare->size);
+    spare->in_use = true;
+    return spare->data;
+  }
+
+  void
+  deallocate(void* p)
+  {
+    for(auto& b : blocks_)
+      if(b.data == p)
+	{
+	  b.in_use = false;
+	  return;
+	}
+    ::operator delete(p);
+  }
+
+private:
+  struct block
+  {
+    void* data = nullptr;
+    std::size_t size = 0;
+    bool in_use = false;
+  };
+  std::array<block, 6> blocks_;
+};
+
+// The associated allocator of a handler bound to a handler_memory
+template<class T>
+class handler_allocator
+{
+public:
+  typedef T value_type;
+
+  explicit
+  handler_allocator(handler_memory& memory) noexcept
+    : memory_(&memory)
+  {
+  }
+
+  template<class U>
+  handler_allocator(handler_allocator<U> const & other) noexcept
+    : memory_(other.memory_)
+  {
+  }
+
+  T*
+  allocate(std::size_t n)
+  {
+    return static_cast<T*>(memory_->allocate(n * sizeof(T)));
+  }
+
+  void
+  deallocate(T* p, std::size_t) noexcept
+  {
+    memory_->deallocate(p);
+  }
+
+  template<class U>
+  bool operator==(handler_allocator<U> const & other) const noexcept { return memory_ == other.memory_; }
+  template<class U>
+  bool operator!=(handler_allocator<U> const & other) const noexcept { return memory_ != other.memory_; }
+
+private:
+  template<class> friend class handler_allocator;
+  handler_memory* memory_;
+};
+
+// A handler whose operations allocate from memory, which has to outlive them
+template<class Handler>
+class alloc_handler
+{
+public:
+  typedef handler_allocator<Handler> allocator_type;
+
+  alloc_handler(handler_memory& memory, Handler handler)
+    : memory_(memory)
+    , handler_(std::move(handler))
+  {
+  }
+
+  allocator_type
+  get_allocator() const noexcept
+  {
+    return allocator_type(memory_);
+  }
+
+  template<class... Args>
+  void
+  operator()(Args&&... args)
+  {
+    handler_(std::forward<Args>(args)...);
+  }
+
+private:
+  handler_memory& memory_;
+  Handler handler_;
+};
+
+template<class Handler>
+alloc_handler<typename std::decay<Handler>::type>
+make_alloc_handler(handler_memory& memory, Handler&& handler)
+{
+  return alloc_handler<typename std::decay<Handler>::type>(memory, std::forward<Handler>(handler));
+}
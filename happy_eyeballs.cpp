@@ -0,0 +1,222 @@
+#include <boost/asio.hpp>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <vector>
+
+// Happy eyeballs (RFC 8305) connect: addresses are interleaved by family and tried
+// in parallel, a new attempt starting every attempt_delay or as soon as the previous
+// one fails. Every attempt gets attempt_timeout. The first connected socket wins and
+// is moved into the caller's socket, all other attempts are cancelled. prepare, if
+// set, gets every socket after it is opened and before it connects.
+class connect_race : public std::enable_shared_from_this<connect_race>
+{
+public:
+  typedef std::vector<boost::asio::ip::tcp::endpoint> endpoints;
+  typedef std::function<void(boost::system::error_code)> handler;
+  typedef std::function<void(boost::asio::ip::tcp::socket&)> preparer;
+
+  connect_race(
+	       boost::asio::io_context& ioc,
+	       boost::asio::ip::tcp::socket& target,
+	       endpoints const & eps,
+	       std::chrono::milliseconds attempt_delay,
+	       std::chrono::milliseconds attempt_timeout,
+	       preparer prepare,
+	       handler h)
+    : ioc_(ioc)
+    , strand_{ioc.get_executor()}
+    , target_(target)
+    , eps_(interleave(eps))
+    , delay_timer_{ioc}
+    , attempt_delay_{attempt_delay}
+    , attempt_timeout_{attempt_timeout}
+    , prepare_(prepare)
+    , handler_(h)
+    , started_{0}
+    , failed_{0}
+    , done_{false}
+  {
+  }
+
+  void
+  run()
+  {
+    if(eps_.empty())
+      return finish(boost::asio::error::host_not_found);
+    boost::asio::dispatch(
+			  strand_,
+			  std::bind(
+				    &connect_race::do_start_attempt,
+				    shared_from_this()));
+  }
+
+private:
+  struct attempt
+  {
+    attempt(boost::asio::io_context& ioc) : sock{ioc}, timer{ioc} {}
+    boost::asio::ip::tcp::socket sock;
+    boost::asio::steady_timer timer;
+  };
+
+  // alternate address families, keeping the resolver's order inside each family
+  static endpoints
+  interleave(endpoints const & eps)
+  {
+    endpoints first, second, result;
+    for(auto const & ep : eps)
+      (ep.protocol() == eps.front().protocol() ? first : second).push_back(ep);
+    for(std::size_t i = 0; i < first.size() || i < second.size(); i++)
+      {
+	if(i < first.size())
+	  result.push_back(first[i]);
+	if(i < second.size())
+	  result.push_back(second[i]);
+      }
+    return result;
+  }
+
+  void
+  do_start_attempt()
+  {
+    if(done_ || started_ == eps_.size())
+      return;
+
+    std::size_t i = started_++;
+    attempts_.push_back(std::unique_ptr<attempt>(new attempt(ioc_)));
+    auto& a = *attempts_.back();
+
+    // async_connect keeps a socket that is already open
+    boost::system::error_code ec;
+    a.sock.open(eps_[i].protocol(), ec);
+    if(! ec && prepare_)
+      prepare_(a.sock);
+
+    a.timer.expires_after(attempt_timeout_);
+    a.timer.async_wait(
+		       boost::asio::bind_executor(
+						  strand_,
+						  std::bind(
+							    &connect_race::on_attempt_timeout,
+							    shared_from_this(),
+							    std::placeholders::_1,
+							    i)));
+    a.sock.async_connect(
+			 eps_[i],
+			 boost::asio::bind_executor(
+						    strand_,
+						    std::bind(
+							      &connect_race::on_attempt,
+							      shared_from_this(),
+							      std::placeholders::_1,
+							      i)));
+
+    // the next address gets its chance after attempt_delay even if this one hangs
+    delay_timer_.expires_after(attempt_delay_);
+    delay_timer_.async_wait(
+			    boost::asio::bind_executor(
+						       strand_,
+						       std::bind(
+								 &connect_race::on_delay,
+								 shared_from_this(),
+								 std::placeholders::_1)));
+  }
+
+  void
+  on_delay(boost::system::error_code ec)
+  {
+    if(ec)
+      return;
+    do_start_attempt();
+  }
+
+  void
+  on_attempt_timeout(boost::system::error_code ec, std::size_t i)
+  {
+    if(ec || done_)
+      return;
+    // closing the socket completes its connect with operation_aborted
+    attempts_[i]->sock.close(ec);
+  }
+
+  void
+  on_attempt(boost::system::error_code ec, std::size_t i)
+  {
+    if(done_)
+      return;
+
+    attempts_[i]->timer.cancel();
+    if(! ec)
+      {
+	target_ = std::move(attempts_[i]->sock);
+	return finish(ec);
+      }
+
+    last_ec_ = ec == boost::asio::error::operation_aborted ? boost::asio::error::timed_out : ec;
+    failed_++;
+    if(started_ < eps_.size())
+      {
+	// don't wait out the delay behind an address that already failed
+	delay_timer_.cancel();
+	return do_start_attempt();
+      }
+    if(failed_ == eps_.size())
+      finish(last_ec_);
+  }
+
+  void
+  finish(boost::system::error_code ec)
+  {
+    done_ = true;
+    boost::system::error_code ignored;
+    delay_timer_.cancel();
+    for(auto& a : attempts_)
+      {
+	a->timer.cancel();
+	a->sock.close(ignored);
+      }
+    handler_(ec);
+  }
+
+private:
+  boost::asio::io_context& ioc_;
+  boost::asio::strand<boost::asio::io_context::executor_type> strand_;
+  boost::asio::ip::tcp::socket& target_;
+  endpoints eps_;
+  std::vector<std::unique_ptr<attempt> > attempts_;
+  boost::asio::steady_timer delay_timer_;
+  std::chrono::milliseconds attempt_delay_;
+  std::chrono::milliseconds attempt_timeout_;
+  preparer prepare_;
+  handler handler_;
+  std::size_t started_;
+  std::size_t failed_;
+  bool done_;
+  boost::system::error_code last_ec_;
+};
+
+// Race connections to eps into sock; handler(error_code) runs on its associated executor
+template<class Handler>
+void
+async_connect_race(
+		   boost::asio::io_context& ioc,
+		   boost::asio::ip::tcp::socket& sock,
+		   connect_race::endpoints const & eps,
+		   std::chrono::milliseconds attempt_delay,
+		   std::chrono::milliseconds attempt_timeout,
+		   connect_race::preparer prepare,
+		   Handler handler)
+{
+  auto executor = boost::asio::get_associated_executor(handler, ioc.get_executor());
+  std::make_shared<connect_race>(
+				 ioc,
+				 sock,
+				 eps,
+				 attempt_delay,
+				 attempt_timeout,
+				 prepare,
+				 [executor, handler](boost::system::error_code ec)
+				 {
+				   boost::asio::post(executor, std::bind(handler, ec));
+				 })->run();
+}
@@ -0,0 +1,485 @@
+#include <boost/asio.hpp>
+#include <boost/beast/http.hpp>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Hot upgrade: a new binary started with the same upgrade socket path connects to the
+// running proxy, which sends it every listening socket and its cache over SCM_RIGHTS:
+//
+//   old -> new  "PROXY-HANDOFF 1 <listeners> <cache bytes>\n", then one byte per
+//               listening socket and one for the cache segment, each carrying the fd
+//   new -> old  'R' once it accepts on them
+//   old -> new  'D' after it stopped accepting and gave up the upgrade socket path
+//
+// The old process then drains its sessions. Both accept on the same sockets in
+// between, a connection is never refused.
+
+// How long the new side waits for each read from the old one before it gives up
+// and starts on its own
+constexpr int handoff_timeout_seconds = 5;
+
+// Whether the process at the other end of the unix socket sock ran as root, as
+// this process or as uid when it connected, or listened; the handoff gives away
+// every listening socket and the cache, to nobody else
+bool trusted_peer(int sock, uid_t uid)
+{
+  struct ucred cred;
+  socklen_t length = sizeof(cred);
+  if(::getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &length) != 0)
+    return false;
+  return cred.uid == 0 || cred.uid == ::geteuid() || cred.uid == uid;
+}
+
+// One byte carrying fd
+bool send_fd(int sock, int fd)
+{
+  char byte = 'F';
+  struct iovec iov = {&byte, 1};
+  char control[CMSG_SPACE(sizeof(int))] = {};
+  struct msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  std::memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+  ssize_t n;
+  do
+    n = ::sendmsg(sock, &msg, MSG_NOSIGNAL);
+  while(n < 0 && errno == EINTR);
+  return n == 1;
+}
+
+// The fd sent along with the next byte, -1 if there is none
+int receive_fd(int sock)
+{
+  char byte;
+  struct iovec iov = {&byte, 1};
+  char control[CMSG_SPACE(sizeof(int))] = {};
+  struct msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  ssize_t n;
+  do
+    n = ::recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+  while(n < 0 && errno == EINTR);
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  if(n != 1 || ! cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+    return -1;
+  int fd;
+  std::memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+  return fd;
+}
+
+bool write_all(int sock, std::string const & data)
+{
+  std::size_t done = 0;
+  while(done < data.size())
+    {
+      ssize_t n = ::send(sock, data.data() + done, data.size() - done, MSG_NOSIGNAL);
+      if(n < 0 && errno == EINTR)
+	continue;
+      if(n <= 0)
+	return false;
+      done += n;
+    }
+  return true;
+}
+
+// Every cached response in HTTP wire format, from the least to the most recently used:
+// key length, key, expiry, response length, response. The key of a variant is the
+// URL followed by its variant key.
+std::string serialize_cache(response_cache& cache)
+{
+  std::string data;
+  auto append = [&data](void const* p, std::size_t n)
+    {
+      data.append(static_cast<char const*>(p), n);
+    };
+  cache.for_each(
+		 [&append](std::string const & url, cache_entry const & entry)
+		 {
+		   for(auto v = entry.variants.rbegin(); v != entry.variants.rend(); ++v)
+		     {
+		       std::ostringstream res;
+		       res << *v->second.res;
+		       auto wire = res.str();
+		       auto key = url + v->first;
+		       std::uint32_t key_size = key.size();
+		       std::int64_t expires = v->second.expires;
+		       std::uint64_t wire_size = wire.size();
+		       append(&key_size, sizeof(key_size));
+		       append(key.data(), key.size());
+		       append(&expires, sizeof(expires));
+		       append(&wire_size, sizeof(wire_size));
+		       append(wire.data(), wire.size());
+		     }
+		 });
+  return data;
+}
+
+// The cache in an anonymous shared memory segment, -1 if it is empty or there is no
+// segment to be had
+int export_cache(response_cache& cache, std::size_t& size)
+{
+  auto data = serialize_cache(cache);
+  size = data.size();
+  if(data.empty())
+    return -1;
+
+  // the name only lives until the segment is open, the successor gets the fd
+  auto name = "/proxy-cache-" + std::to_string(::getpid());
+  int fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  if(fd < 0)
+    return -1;
+  ::shm_unlink(name.c_str());
+  void* p = MAP_FAILED;
+  if(::ftruncate(fd, data.size()) == 0)
+    p = ::mmap(nullptr, data.size(), PROT_WRITE, MAP_SHARED, fd, 0);
+  if(p == MAP_FAILED)
+    {
+      ::close(fd);
+      return -1;
+    }
+  std::memcpy(p, data.data(), data.size());
+  ::munmap(p, data.size());
+  return fd;
+}
+
+// Store what export_cache left in the segment, returns the number of responses
+std::size_t import_cache(int fd, std::size_t size, response_cache& cache)
+{
+  namespace http = boost::beast::http;
+  void* p = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  if(p == MAP_FAILED)
+    return 0;
+
+  char const* data = static_cast<char const*>(p);
+  std::size_t at = 0;
+  std::size_t stored = 0;
+  auto take = [&](void* to, std::size_t n)
+    {
+      if(size - at < n)
+	return false;
+      std::memcpy(to, data + at, n);
+      at += n;
+      return true;
+    };
+  for(;;)
+    {
+      std::uint32_t key_size;
+      std::int64_t expires;
+      std::uint64_t wire_size;
+      std::string key;
+      if(! take(&key_size, sizeof(key_size)) || size - at < key_size)
+	break;
+      key.assign(data + at, key_size);
+      at += key_size;
+      if(! take(&expires, sizeof(expires)) || ! take(&wire_size, sizeof(wire_size)) || size - at < wire_size)
+	break;
+
+      http::response_parser<http::dynamic_body> parser;
+      parser.eager(true);
+      parser.body_limit(wire_size);
+      boost::asio::const_buffer wire(data + at, wire_size);
+      at += wire_size;
+      boost::system::error_code ec;
+      while(! ec && ! parser.is_done() && wire.size() > 0)
+	wire += parser.put(wire, ec);
+      // a header-only entry naming a Vary response's variants, as a process
+      // before one slot per URL kept them; the variants carry their Vary
+      if(! ec && parser.is_header_done() && ! parser.is_done() && parser.get().has_content_length())
+	continue;
+      // a body that runs until the connection closes
+      if(! ec && ! parser.is_done())
+	parser.put_eof(ec);
+      if(ec)
+	continue;
+      cached_response r{std::make_shared<http::response<http::dynamic_body> >(parser.release()), static_cast<time_t>(expires)};
+      auto names = vary_names((*r.res)[http::field::vary]);
+      auto variant = key.find(' ');
+      if(names.empty() != (variant == std::string::npos))
+	continue;
+      cache.update(
+		   key.substr(0, variant),
+		   [&](cache_entry& entry)
+		   {
+		     entry.store(std::move(names), variant == std::string::npos ? std::string() : key.substr(variant), std::move(r));
+		   });
+      stored++;
+    }
+  ::munmap(p, size);
+  return stored;
+}
+
+// Old side: waits on the upgrade socket for a successor and hands everything over.
+// note gets what happens for the log.
+class handoff_server : public std::enable_shared_from_this<handoff_server>
+{
+public:
+  typedef boost::asio::local::stream_protocol protocol;
+
+  handoff_server(
+		 boost::asio::io_context& ioc,
+		 std::string const & path,
+		 response_cache& cache,
+		 std::function<std::vector<int>()> listening_fds,
+		 std::function<void()> handed_over,
+		 std::function<void(std::string const &)> note)
+    : acceptor_{ioc}
+    , successor_{ioc}
+    , path_(path)
+    , cache_(cache)
+    , listening_fds_(listening_fds)
+    , handed_over_(handed_over)
+    , note_(note)
+  {
+  }
+
+  bool
+  run(boost::system::error_code& ec)
+  {
+    // a socket file left behind by a process that didn't hand over
+    ::unlink(path_.c_str());
+    acceptor_.open(protocol(), ec);
+    if(! ec)
+      {
+	// only our own user may even connect
+	auto mask = ::umask(0177);
+	acceptor_.bind(protocol::endpoint(path_), ec);
+	::umask(mask);
+      }
+    if(! ec)
+      acceptor_.listen(1, ec);
+    if(ec)
+      return false;
+    do_accept();
+    return true;
+  }
+
+private:
+  void
+  do_accept()
+  {
+    acceptor_.async_accept(
+			   successor_,
+			   std::bind(
+				     &handoff_server::on_accept,
+				     shared_from_this(),
+				     std::placeholders::_1));
+  }
+
+  void
+  on_accept(boost::system::error_code ec)
+  {
+    if(ec)
+      return;
+
+    if(! trusted_peer(successor_.native_handle(), ::geteuid()))
+      return abandon("a process of another user connected");
+    note_("new process connected for an upgrade, handing over");
+    auto fds = listening_fds_();
+    std::size_t cache_size = 0;
+    int cache_fd = export_cache(cache_, cache_size);
+    if(cache_fd < 0)
+      cache_size = 0;
+
+    // a few bytes into an empty socket buffer, this doesn't block
+    int sock = successor_.native_handle();
+    bool sent = write_all(sock, "PROXY-HANDOFF 1 " + std::to_string(fds.size()) + " " + std::to_string(cache_size) + "\n");
+    for(int fd : fds)
+      sent = sent && send_fd(sock, fd);
+    if(cache_fd >= 0)
+      {
+	sent = sent && send_fd(sock, cache_fd);
+	::close(cache_fd);
+      }
+    if(! sent)
+      return abandon("sending the sockets failed");
+
+    boost::asio::async_read(
+			    successor_,
+			    boost::asio::buffer(&reply_, 1),
+			    std::bind(
+				      &handoff_server::on_ready,
+				      shared_from_this(),
+				      std::placeholders::_1));
+  }
+
+  void
+  on_ready(boost::system::error_code ec)
+  {
+    if(ec || reply_ != 'R')
+      return abandon("the new process went away");
+
+    // the path belongs to the successor from now on
+    acceptor_.close(ec);
+    ::unlink(path_.c_str());
+    handed_over_();
+    reply_ = 'D';
+    boost::asio::write(successor_, boost::asio::buffer(&reply_, 1), ec);
+    successor_.close(ec);
+  }
+
+  // keep serving and wait for the next try
+  void
+  abandon(char const* why)
+  {
+    note_(std::string("upgrade abandoned, ") + why);
+    boost::system::error_code ec;
+    successor_.close(ec);
+    do_accept();
+  }
+
+  protocol::acceptor acceptor_;
+  protocol::socket successor_;
+  std::string path_;
+  response_cache& cache_;
+  std::function<std::vector<int>()> listening_fds_;
+  std::function<void()> handed_over_;
+  std::function<void(std::string const &)> note_;
+  char reply_;
+};
+
+// New side: take over from the process serving on the upgrade socket path, which
+// runs as root, as this process or as uid. Returns the connection to it, or -1 with
+// nothing handed over if no such process answered, or not all of the handoff in
+// time. The cache segment is -1 if the cache was empty.
+int take_over(
+	      std::string const & path,
+	      uid_t uid,
+	      std::vector<int>& listening_fds,
+	      int& cache_fd,
+	      std::size_t& cache_size)
+{
+  cache_fd = -1;
+  cache_size = 0;
+  struct sockaddr_un addr = {};
+  if(path.size() >= sizeof(addr.sun_path))
+    return -1;
+  addr.sun_family = AF_UNIX;
+  std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+  int sock = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if(sock < 0)
+    return -1;
+  if(::connect(sock, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0 ||
+     ! trusted_peer(sock, uid))
+    {
+      ::close(sock);
+      return -1;
+    }
+  // a process hung mid upgrade must not keep this one from starting
+  struct timeval timeout = {handoff_timeout_seconds, 0};
+  ::setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  std::string header;
+  char c;
+  while(header.size() < 128 && ::read(sock, &c, 1) == 1 && c != '\n')
+    header += c;
+  std::istringstream in(header);
+  std::string magic;
+  int version = 0;
+  std::size_t listeners = 0;
+  in >> magic >> version >> listeners >> cache_size;
+  if(magic != "PROXY-HANDOFF" || version != 1 || ! in)
+    {
+      ::close(sock);
+      return -1;
+    }
+
+  std::vector<int> received;
+  for(std::size_t i = 0; i < listeners; i++)
+    {
+      int fd = receive_fd(sock);
+      if(fd < 0)
+	break;
+      received.push_back(fd);
+    }
+  if(received.size() == listeners && cache_size > 0)
+    cache_fd = receive_fd(sock);
+  // half a handoff is none: give back what came and start fresh
+  if(received.size() != listeners || (cache_size > 0 && cache_fd < 0))
+    {
+      for(int fd : received)
+	::close(fd);
+      cache_fd = -1;
+      cache_size = 0;
+      ::close(sock);
+      return -1;
+    }
+  listening_fds.insert(listening_fds.end(), received.begin(), received.end());
+  return sock;
+}
+
+// Tell the old process we accept on its sockets and wait until it stopped doing so,
+// or for the handoff timeout
+void finish_take_over(int sock)
+{
+  char c = 'R';
+  if(::write(sock, &c, 1) == 1)
+    while(::read(sock, &c, 1) < 0 && errno == EINTR)
+      ;
+  ::close(sock);
+}
+
+// Waits for the sessions to end once accepting stopped, at most deadline, then calls
+// done with the number of sessions still there
+class drain_monitor : public std::enable_shared_from_this<drain_monitor>
+{
+public:
+  drain_monitor(
+		boost::asio::io_context& ioc,
+		std::function<std::size_t()> active,
+		std::chrono::seconds deadline,
+		std::function<void(std::size_t)> done)
+    : timer_{ioc}
+    , active_(active)
+    , deadline_{std::chrono::steady_clock::now() + deadline}
+    , done_(done)
+  {
+  }
+
+  void
+  run()
+  {
+    auto left = active_();
+    if(left == 0 || std::chrono::steady_clock::now() >= deadline_)
+      return done_(left);
+    timer_.expires_after(std::chrono::milliseconds(100));
+    timer_.async_wait(
+		      [self = shared_from_this()](boost::system::error_code ec)
+		      {
+			if(! ec)
+			  self->run();
+		      });
+  }
+
+private:
+  boost::asio::steady_timer timer_;
+  std::function<std::size_t()> active_;
+  std::chrono::steady_clock::time_point deadline_;
+  std::function<void(std::size_t)> done_;
+};
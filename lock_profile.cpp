@@ -0,0 +1,272 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Built with -DPROFILE_LOCKS every proxy_mutex counts its acquisitions, the ones
+// that had to wait, how long they waited and how long the lock was held, summed
+// up per site: the mutexes of one name, e.g. the buckets of every client's rate
+// limit. Without it a proxy_mutex is a std::mutex and its name is dropped.
+#ifdef PROFILE_LOCKS
+
+// Nanoseconds by powers of two, bucket i counting [2^i, 2^(i+1)), 0 in the first
+struct lock_histogram
+{
+  static constexpr int buckets = 40;	// 2^40 ns is 18 minutes, anything longer lands there
+
+  static int
+  bucket(std::uint64_t ns)
+  {
+    return ns ? std::min(buckets - 1, 63 - __builtin_clzll(ns)) : 0;
+  }
+
+  void
+  record(std::uint64_t ns)
+  {
+    counts[bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+    sum_ns.fetch_add(ns, std::memory_order_relaxed);
+    auto max = max_ns.load(std::memory_order_relaxed);
+    while(ns > max && ! max_ns.compare_exchange_weak(max, ns, std::memory_order_relaxed))
+      ;
+  }
+
+  // the upper end of the bucket the q quantile falls into, at most the longest
+  // recorded; 0 if nothing was recorded
+  std::uint64_t
+  quantile(double q) const
+  {
+    std::uint64_t total = 0;
+    for(auto const & c : counts)
+      total += c.load(std::memory_order_relaxed);
+    if(total == 0)
+      return 0;
+    auto rank = std::uint64_t(q * total);
+    std::uint64_t seen = 0;
+    int b = 0;
+    for(; b < buckets - 1 && seen + counts[b].load(std::memory_order_relaxed) <= rank; b++)
+      seen += counts[b].load(std::memory_order_relaxed);
+    return std::min((std::uint64_t(1) << (b + 1)) - 1, max_ns.load(std::memory_order_relaxed));
+  }
+
+  std::atomic<std::uint64_t> counts[buckets] = {};
+  std::atomic<std::uint64_t> sum_ns{0};
+  std::atomic<std::uint64_t> max_ns{0};
+};
+
+struct lock_site
+{
+  explicit
+  lock_site(char const* site_name)
+    : name{site_name}
+  {
+  }
+
+  char const* name;
+  std::atomic<std::uint64_t> acquisitions{0};
+  std::atomic<std::uint64_t> contended{0};
+  lock_histogram wait;	// of the contended acquisitions
+  lock_histogram hold;
+};
+
+// The sites, each made by the first mutex of its name and kept for the process.
+// Mutexes are made during static initialization too, hence the function statics.
+class lock_sites
+{
+public:
+  static lock_site&
+  get(char const* name)
+  {
+    std::lock_guard<std::mutex> lock(mutex());
+    for(auto& site : sites())
+      if(std::strcmp(site.name, name) == 0)
+	return site;
+    sites().emplace_back(name);
+    return sites().back();
+  }
+
+  template<class Function>
+  static void
+  for_each(Function f)
+  {
+    std::lock_guard<std::mutex> lock(mutex());
+    for(auto const & site : sites())
+      f(site);
+  }
+
+private:
+  static std::mutex&
+  mutex()
+  {
+    static std::mutex m;
+    return m;
+  }
+
+  // a deque never moves what it holds
+  static std::deque<lock_site>&
+  sites()
+  {
+    static std::deque<lock_site> s;
+    return s;
+  }
+};
+
+// A std::mutex that tells its site about itself. try_lock first: only what
+// fails it waits and gets timed, an uncontended lock costs two clock readings.
+class proxy_mutex
+{
+public:
+  typedef std::chrono::steady_clock clock;
+
+  explicit
+  proxy_mutex(char const* site)
+    : site_(lock_sites::get(site))
+  {
+  }
+
+  proxy_mutex(proxy_mutex const &) = delete;
+  proxy_mutex& operator=(proxy_mutex const &) = delete;
+
+  void
+  lock()
+  {
+    if(mutex_.try_lock())
+      held_since_ = clock::now();
+    else
+      {
+	auto start = clock::now();
+	mutex_.lock();
+	held_since_ = clock::now();
+	site_.contended.fetch_add(1, std::memory_order_relaxed);
+	site_.wait.record(nanoseconds(held_since_ - start));
+      }
+    site_.acquisitions.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  bool
+  try_lock()
+  {
+    if(! mutex_.try_lock())
+      return false;
+    held_since_ = clock::now();
+    site_.acquisitions.fetch_add(1, std::memory_order_relaxed);
+    return true;
+  }
+
+  void
+  unlock()
+  {
+    auto held = clock::now() - held_since_;
+    mutex_.unlock();
+    site_.hold.record(nanoseconds(held));
+  }
+
+private:
+  static std::uint64_t
+  nanoseconds(clock::duration d)
+  {
+    return std::uint64_t(std::max<std::int64_t>(0, std::chrono::duration_cast<std::chrono::nanoseconds>(d).count()));
+  }
+
+  std::mutex mutex_;
+  lock_site& site_;
+  clock::time_point held_since_;	// written by the holder only
+};
+
+// "1.5us", a duration of the lock report
+inline std::string
+lock_duration(std::uint64_t ns)
+{
+  char buffer[32];
+  if(ns < 1000)
+    std::snprintf(buffer, sizeof(buffer), "%lluns", static_cast<unsigned long long>(ns));
+  else if(ns < 1000000)
+    std::snprintf(buffer, sizeof(buffer), "%.1fus", ns / 1e3);
+  else
+    std::snprintf(buffer, sizeof(buffer), "%.1fms", ns / 1e6);
+  return buffer;
+}
+
+// A line per site, for the log
+inline std::vector<std::string>
+lock_profile_report()
+{
+  std::vector<std::string> lines;
+  lock_sites::for_each(
+		       [&lines](lock_site const & site)
+		       {
+			 auto acquisitions = site.acquisitions.load(std::memory_order_relaxed);
+			 auto contended = site.contended.load(std::memory_order_relaxed);
+			 char share[16];
+			 std::snprintf(share, sizeof(share), "%.2f%%", acquisitions ? 100.0 * contended / acquisitions : 0.0);
+			 lines.push_back(
+					 std::string("lock ") + site.name + ": " + std::to_string(acquisitions) + " acquired, " +
+					 std::to_string(contended) + " contended (" + share + "), wait p50 " +
+					 lock_duration(site.wait.quantile(0.5)) + " p99 " + lock_duration(site.wait.quantile(0.99)) +
+					 " max " + lock_duration(site.wait.max_ns.load(std::memory_order_relaxed)) + ", hold p50 " +
+					 lock_duration(site.hold.quantile(0.5)) + " p99 " + lock_duration(site.hold.quantile(0.99)) +
+					 " max " + lock_duration(site.hold.max_ns.load(std::memory_order_relaxed)));
+		       });
+  return lines;
+}
+
+// The same in the Prometheus text format, buckets at every other power of two
+// from 128ns to 34s
+inline std::string
+lock_profile_prometheus()
+{
+  std::string counters[2] = {
+    "# HELP proxy_lock_acquisitions_total Acquisitions of the mutexes of a site\n# TYPE proxy_lock_acquisitions_total counter\n",
+    "# HELP proxy_lock_contended_total Acquisitions that had to wait\n# TYPE proxy_lock_contended_total counter\n"};
+  std::string histograms[2] = {
+    "# HELP proxy_lock_wait_seconds Waiting for a contended lock\n# TYPE proxy_lock_wait_seconds histogram\n",
+    "# HELP proxy_lock_hold_seconds Holding a lock\n# TYPE proxy_lock_hold_seconds histogram\n"};
+  lock_sites::for_each(
+		       [&counters, &histograms](lock_site const & site)
+		       {
+			 auto label = std::string("lock=\"") + site.name + "\"";
+			 counters[0] += "proxy_lock_acquisitions_total{" + label + "} " + std::to_string(site.acquisitions.load(std::memory_order_relaxed)) + "\n";
+			 counters[1] += "proxy_lock_contended_total{" + label + "} " + std::to_string(site.contended.load(std::memory_order_relaxed)) + "\n";
+			 char const* names[2] = {"proxy_lock_wait_seconds", "proxy_lock_hold_seconds"};
+			 lock_histogram const * h[2] = {&site.wait, &site.hold};
+			 for(int k = 0; k < 2; k++)
+			   {
+			     std::uint64_t below = 0;
+			     int b = 0;
+			     for(int power = 7; power <= 35; power += 2)
+			       {
+				 for(; b < power && b < lock_histogram::buckets; b++)
+				   below += h[k]->counts[b].load(std::memory_order_relaxed);
+				 char le[32];
+				 std::snprintf(le, sizeof(le), "%.6g", double(std::uint64_t(1) << power) / 1e9);
+				 histograms[k] += std::string(names[k]) + "_bucket{" + label + ",le=\"" + le + "\"} " + std::to_string(below) + "\n";
+			       }
+			     for(; b < lock_histogram::buckets; b++)
+			       below += h[k]->counts[b].load(std::memory_order_relaxed);
+			     char sum[32];
+			     std::snprintf(sum, sizeof(sum), "%.6g", h[k]->sum_ns.load(std::memory_order_relaxed) / 1e9);
+			     histograms[k] += std::string(names[k]) + "_bucket{" + label + ",le=\"+Inf\"} " + std::to_string(below) + "\n" +
+			       names[k] + "_sum{" + label + "} " + sum + "\n" +
+			       names[k] + "_count{" + label + "} " + std::to_string(below) + "\n";
+			   }
+		       });
+  return counters[0] + counters[1] + histograms[0] + histograms[1];
+}
+
+#else
+
+class proxy_mutex : public std::mutex
+{
+public:
+  explicit
+  proxy_mutex(char const*)
+  {
+  }
+};
+
+#endif
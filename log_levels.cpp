@@ -0,0 +1,91 @@
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// What a log line is about, each has a level and a sampling rate of its own
+enum class log_category : std::uint8_t
+{
+  access,	// requests and responses
+  cache,	// lookups, validation, storing and evicting
+  tunnel,	// CONNECT
+  errors,	// failures, timeouts and other notes
+  count
+};
+
+// A category logs the lines at its level and the more severe ones
+enum class log_level : std::uint8_t
+{
+  off,
+  error,
+  info,
+  debug
+};
+
+char const* const log_category_names[] = {"access", "cache", "tunnel", "errors"};
+char const* const log_level_names[] = {"off", "error", "info", "debug"};
+
+inline bool
+parse_log_level(std::string const & name, log_level& level)
+{
+  for(int i = 0; i <= int(log_level::debug); i++)
+    if(name == log_level_names[i])
+      {
+	level = log_level(i);
+	return true;
+      }
+  return false;
+}
+
+// Levels and sampling as configured, see log_levels::apply
+struct log_settings
+{
+  log_level level[int(log_category::count)] = {log_level::debug, log_level::debug, log_level::debug, log_level::debug};
+  unsigned sample[int(log_category::count)] = {1, 1, 1, 1};	// one in N lines below error
+};
+
+// Which lines are logged, asked before a line is formatted. Changed at runtime
+// by apply() from any thread; a line being decided meanwhile goes either way.
+class log_levels
+{
+public:
+  log_levels()
+  {
+    apply(log_settings());
+  }
+
+  void
+  apply(log_settings const & settings)
+  {
+    for(int i = 0; i < int(log_category::count); i++)
+      {
+	level_[i].store(std::uint8_t(settings.level[i]), std::memory_order_relaxed);
+	sample_[i].store(settings.sample[i] ? settings.sample[i] : 1, std::memory_order_relaxed);
+      }
+  }
+
+  // Errors of an enabled category always, anything less one time in its sample
+  bool
+  enabled(log_category category, log_level level)
+  {
+    auto c = int(category);
+    if(std::uint8_t(level) > level_[c].load(std::memory_order_relaxed))
+      return false;
+    auto sample = sample_[c].load(std::memory_order_relaxed);
+    return level <= log_level::error || sample == 1 || next_random() % sample == 0;
+  }
+
+private:
+  // xorshift, good enough to pick lines and nothing to share between threads
+  static std::uint32_t
+  next_random()
+  {
+    thread_local std::uint32_t state = 0x9e3779b9u ^ std::uint32_t(reinterpret_cast<std::uintptr_t>(&state));
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+  }
+
+  std::atomic<std::uint8_t> level_[int(log_category::count)];
+  std::atomic<unsigned> sample_[int(log_category::count)];
+};
@@ -20,7 +20,7 @@ LRUCache(std::size_t n)
 // get the stored value by key
 boost::optional<T> get(K const & key)
 {
-  std::lock_guard<std::mutex> lock(cache_mutex);
+  std::lock_guard<proxy_mutex> lock(cache_mutex);
  
     if(is_in_cache(key))
     {
@@ -31,13 +31,51 @@ boost::optional<T> get(K const & key)
     return boost::optional<T>();
 }
 
+// call f(value) on the value stored by key and mark it used, under the lock so
+// f only copies what it needs; false if key isn't stored
+template<class F>
+bool visit(K const & key, F f)
+{
+  std::lock_guard<proxy_mutex> lock(cache_mutex);
+  if(! is_in_cache(key))
+    return false;
+  move_element_to_front(key);
+  f(std::get<1>(storage_list.front()));
+  return true;
+}
+
+// call f(value) on the value stored by key, a default constructed one stored
+// first if there is none; returns what store() does
+template<class F>
+std::pair<bool, K> update(K const & key, F f)
+{
+  std::lock_guard<proxy_mutex> lock(cache_mutex);
+  if(is_in_cache(key))
+    {
+      move_element_to_front(key);
+      f(std::get<1>(storage_list.front()));
+      return std::make_pair<bool, K>(true, K());
+    }
+  K last_element_key = K();
+  if(is_full())
+    {
+      last_element_key = std::get<0>(storage_list.back());
+      storage_list.pop_back();
+      lookup_map.erase(last_element_key);
+    }
+  storage_list.emplace_front(key, T());
+  lookup_map[key] = storage_list.begin();
+  f(std::get<1>(storage_list.front()));
+  return std::make_pair<bool, K>(false, K(last_element_key));
+}
+
 // store key value pair, return a pair <is_updated, key_erased>
 // key_erased is the key of the item that has been erased due to LRU strategy
 // if key_erased = "", no item has been removed, which indicates that the cache is not full before storing
 std::pair<bool, K> store(K const & key, T const & value)
 {   
     // if key is already in the cache, update the associate value. In the ranking list move the key to the front.
-  std::lock_guard<std::mutex> lock(cache_mutex);
+  std::lock_guard<proxy_mutex> lock(cache_mutex);
  
   if(is_in_cache(key))
     {
@@ -76,8 +114,25 @@ std::pair<bool, K> store(K const & key, T const & value)
     }
 }
 
-// display the key of cache items in the order of storage_list 
-void display() 
+// call f(key, value) for every item from the least to the most recently used,
+// storing them again in that order rebuilds the same ranking
+template<class F>
+void for_each(F f)
+{
+  std::lock_guard<proxy_mutex> lock(cache_mutex);
+  for(auto it = storage_list.rbegin(); it != storage_list.rend(); ++it)
+    f(std::get<0>(*it), std::get<1>(*it));
+}
+
+// number of items stored
+std::size_t size()
+{
+  std::lock_guard<proxy_mutex> lock(cache_mutex);
+  return lookup_map.size();
+}
+
+// display the key of cache items in the order of storage_list
+void display()
 { 
     auto it = storage_list.begin();
     int order = 0;
@@ -128,7 +183,7 @@ private:
     // provide O(1) lookup 
     unordered_map<K, typename list<std::pair<K, T> >::iterator > lookup_map;
     std::size_t csize; //maximum capacity of cache 
-  std::mutex cache_mutex;
+  proxy_mutex cache_mutex{"cache"};
 }; 
 
 /*
@@ -0,0 +1,294 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <dirent.h>
+
+// What is counted, each with its name and labels in the exposition
+enum class metric : std::uint8_t
+{
+  requests_get,
+  requests_post,
+  requests_connect,
+  requests_other,
+  responses_1xx,
+  responses_2xx,
+  responses_3xx,
+  responses_4xx,
+  responses_5xx,
+  cache_hits,
+  cache_misses,
+  revalidated_not_modified,
+  revalidated_modified,
+  cache_evictions,
+  response_bytes,	// bodies of the responses to clients
+  upstream_bytes,	// responses read from origins
+  tunnel_bytes,	// both directions
+  upstream_connects,
+  upstream_reuses,	// a pooled or kept connection instead
+  count
+};
+
+struct metric_name
+{
+  char const* name;
+  char const* labels;
+  char const* help;
+};
+
+metric_name const metric_names[] = {
+  {"proxy_requests_total", "method=\"GET\"", "Requests by method"},
+  {"proxy_requests_total", "method=\"POST\"", ""},
+  {"proxy_requests_total", "method=\"CONNECT\"", ""},
+  {"proxy_requests_total", "method=\"other\"", ""},
+  {"proxy_responses_total", "code=\"1xx\"", "Responses to clients by status class"},
+  {"proxy_responses_total", "code=\"2xx\"", ""},
+  {"proxy_responses_total", "code=\"3xx\"", ""},
+  {"proxy_responses_total", "code=\"4xx\"", ""},
+  {"proxy_responses_total", "code=\"5xx\"", ""},
+  {"proxy_cache_lookups_total", "result=\"hit\"", "Cache lookups of GET requests"},
+  {"proxy_cache_lookups_total", "result=\"miss\"", ""},
+  {"proxy_cache_revalidations_total", "result=\"not_modified\"", "Revalidations of cached responses"},
+  {"proxy_cache_revalidations_total", "result=\"modified\"", ""},
+  {"proxy_cache_evictions_total", "", "Cached responses evicted to make room"},
+  {"proxy_bytes_total", "direction=\"response\"", "Bytes relayed"},
+  {"proxy_bytes_total", "direction=\"upstream\"", ""},
+  {"proxy_bytes_total", "direction=\"tunnel\"", ""},
+  {"proxy_upstream_connections_total", "how=\"connected\"", "Connections to origins a request got"},
+  {"proxy_upstream_connections_total", "how=\"reused\"", ""}
+};
+static_assert(sizeof(metric_names) / sizeof(metric_names[0]) == std::size_t(metric::count), "a name for every metric");
+
+// What is timed
+enum class latency : std::uint8_t
+{
+  request,	// request read until its response goes out
+  upstream_connect,
+  dns,
+  phase_wait,	// the phases of request_timing the two above don't cover
+  phase_cache,
+  phase_send,
+  phase_ttfb,
+  phase_transfer,
+  phase_write,
+  count
+};
+
+metric_name const latency_names[] = {
+  {"proxy_request_duration_seconds", "", "From a request to its response going out"},
+  {"proxy_upstream_connect_seconds", "", "Connecting to an origin, after name resolution"},
+  {"proxy_dns_resolve_seconds", "", "Resolving an origin's name, cached or not"},
+  {"proxy_request_phase_seconds", "phase=\"wait\"", "Phases of requests, see request_timing"},
+  {"proxy_request_phase_seconds", "phase=\"cache\"", ""},
+  {"proxy_request_phase_seconds", "phase=\"send\"", ""},
+  {"proxy_request_phase_seconds", "phase=\"ttfb\"", ""},
+  {"proxy_request_phase_seconds", "phase=\"transfer\"", ""},
+  {"proxy_request_phase_seconds", "phase=\"write\"", ""}
+};
+static_assert(sizeof(latency_names) / sizeof(latency_names[0]) == std::size_t(latency::count), "a name for every latency");
+
+// Microseconds in log-linear buckets, HDR style: exact below 16, above that 8
+// buckets to every power of two, so a percentile is off by 12.5% at most
+struct latency_histogram
+{
+  static constexpr int linear = 16;
+  static constexpr int sub_buckets = 8;
+  static constexpr int max_power = 36;	// 2^36 us is 19 hours, anything longer lands there
+  static constexpr int buckets = linear + (max_power - 4) * sub_buckets;
+
+  static int
+  bucket(std::uint64_t us)
+  {
+    if(us < linear)
+      return int(us);
+    int power = 63 - __builtin_clzll(us);
+    if(power >= max_power)
+      return buckets - 1;
+    return linear + (power - 4) * sub_buckets + int((us >> (power - 3)) & (sub_buckets - 1));
+  }
+
+  // the largest value of bucket i, in microseconds
+  static std::uint64_t
+  upper(int i)
+  {
+    if(i < linear)
+      return i;
+    int power = (i - linear) / sub_buckets + 4;
+    std::uint64_t sub = (i - linear) % sub_buckets;
+    return ((sub_buckets + sub + 1) << (power - 3)) - 1;
+  }
+
+  std::atomic<std::uint64_t> counts[buckets] = {};
+  std::atomic<std::uint64_t> sum_us{0};
+};
+
+// A thread's counters: only that thread writes them, so a plain load and store
+// does, the reader merging them sees each count whole
+struct metrics_shard
+{
+  std::atomic<std::uint64_t> counters[std::size_t(metric::count)] = {};
+  latency_histogram histograms[std::size_t(latency::count)];
+};
+
+// Counters and latency histograms of every thread, merged when read. Recording
+// takes no lock: a thread writes its own shard, found through a thread_local.
+class metrics
+{
+public:
+  void
+  add(metric m, std::uint64_t n = 1)
+  {
+    bump(my_shard().counters[std::size_t(m)], n);
+  }
+
+  void
+  record(latency l, std::chrono::steady_clock::duration d)
+  {
+    auto us = std::uint64_t(std::max<std::int64_t>(0, std::chrono::duration_cast<std::chrono::microseconds>(d).count()));
+    auto& h = my_shard().histograms[std::size_t(l)];
+    bump(h.counts[latency_histogram::bucket(us)], 1);
+    bump(h.sum_us, us);
+  }
+
+  // Everything in the Prometheus text format, gauges being lines the caller adds
+  std::string
+  prometheus(std::string const & gauges)
+  {
+    std::vector<std::uint64_t> counters(std::size_t(metric::count));
+    std::vector<std::vector<std::uint64_t> > histograms(std::size_t(latency::count), std::vector<std::uint64_t>(latency_histogram::buckets));
+    std::vector<std::uint64_t> sums(std::size_t(latency::count));
+    {
+      std::lock_guard<proxy_mutex> lock(shards_mutex_);
+      for(auto const & shard : shards_)
+	{
+	  for(std::size_t m = 0; m < counters.size(); m++)
+	    counters[m] += shard->counters[m].load(std::memory_order_relaxed);
+	  for(std::size_t l = 0; l < histograms.size(); l++)
+	    {
+	      for(int i = 0; i < latency_histogram::buckets; i++)
+		histograms[l][i] += shard->histograms[l].counts[i].load(std::memory_order_relaxed);
+	      sums[l] += shard->histograms[l].sum_us.load(std::memory_order_relaxed);
+	    }
+	}
+    }
+
+    std::string out;
+    for(std::size_t m = 0; m < counters.size(); m++)
+      {
+	auto const & n = metric_names[m];
+	if(*n.help)
+	  out += std::string("# HELP ") + n.name + " " + n.help + "\n# TYPE " + n.name + " counter\n";
+	out += std::string(n.name) + (*n.labels ? std::string("{") + n.labels + "}" : "") + " " + std::to_string(counters[m]) + "\n";
+      }
+    std::string quantiles;
+    for(std::size_t l = 0; l < histograms.size(); l++)
+      {
+	// a family's lines go together, its quantiles after all its histograms
+	if(*latency_names[l].help)
+	  {
+	    out += quantiles;
+	    quantiles.clear();
+	  }
+	out += histogram_text(latency_names[l], histograms[l], sums[l], quantiles);
+      }
+    return out + quantiles + gauges;
+  }
+
+private:
+  static void
+  bump(std::atomic<std::uint64_t>& counter, std::uint64_t n)
+  {
+    counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+
+  static std::string
+  seconds(std::uint64_t us)
+  {
+    char buffer[32];
+    std::snprintf(buffer, sizeof(buffer), "%.6g", us / 1e6);
+    return buffer;
+  }
+
+  // Cumulative buckets at the powers of two from 16us to 128s, then the
+  // percentiles from the fine buckets, added to quantiles as a gauge of their
+  // own. Histograms of one name follow each other, the first has the help.
+  static std::string
+  histogram_text(
+		 metric_name const & n,
+		 std::vector<std::uint64_t> const & counts,
+		 std::uint64_t sum_us,
+		 std::string& quantiles)
+  {
+    std::string name = n.name;
+    std::string labels = *n.labels ? std::string(n.labels) + "," : "";
+    std::string out = *n.help ? "# HELP " + name + " " + n.help + "\n# TYPE " + name + " histogram\n" : "";
+    std::uint64_t total = 0;
+    for(auto c : counts)
+      total += c;
+    std::uint64_t below = 0;
+    int i = 0;
+    for(int power = 4; power <= 27; power++)
+      {
+	for(; i < latency_histogram::buckets && latency_histogram::upper(i) < (std::uint64_t(1) << power); i++)
+	  below += counts[i];
+	out += name + "_bucket{" + labels + "le=\"" + seconds(std::uint64_t(1) << power) + "\"} " + std::to_string(below) + "\n";
+      }
+    out += name + "_bucket{" + labels + "le=\"+Inf\"} " + std::to_string(total) + "\n";
+    auto selector = *n.labels ? std::string("{") + n.labels + "}" : "";
+    out += name + "_sum" + selector + " " + seconds(sum_us) + "\n";
+    out += name + "_count" + selector + " " + std::to_string(total) + "\n";
+
+    if(*n.help)
+      quantiles += "# TYPE " + name + "_quantile gauge\n";
+    for(double q : {0.5, 0.9, 0.99, 0.999})
+      {
+	std::uint64_t rank = std::uint64_t(q * total);
+	std::uint64_t seen = 0;
+	int b = 0;
+	for(; b < latency_histogram::buckets - 1 && seen + counts[b] <= rank; b++)
+	  seen += counts[b];
+	char label[16];
+	std::snprintf(label, sizeof(label), "%g", q);
+	quantiles += name + "_quantile{" + labels + "quantile=\"" + label + "\"} " + (total ? seconds(latency_histogram::upper(b)) : "0") + "\n";
+      }
+    return out;
+  }
+
+  metrics_shard&
+  my_shard()
+  {
+    thread_local metrics_shard* shard = nullptr;
+    if(! shard)
+      {
+	// once per thread, the shards stay with the process
+	std::lock_guard<proxy_mutex> lock(shards_mutex_);
+	shards_.emplace_back(new metrics_shard());
+	shard = shards_.back().get();
+      }
+    return *shard;
+  }
+
+  proxy_mutex shards_mutex_{"metrics_shards"};	// taken by threads only to add their shard, and to read
+  std::vector<std::unique_ptr<metrics_shard> > shards_;
+};
+
+// Descriptors the process has open, 0 if /proc doesn't tell
+inline std::size_t
+open_fds()
+{
+  DIR* dir = opendir("/proc/self/fd");
+  if(! dir)
+    return 0;
+  std::size_t n = 0;
+  while(auto entry = readdir(dir))
+    if(entry->d_name[0] != '.')
+      n++;
+  closedir(dir);
+  // not counting the one reading the directory
+  return n ? n - 1 : 0;
+}
@@ -0,0 +1,36 @@
+// USDT probes, the SystemTap kind bpftrace and perf attach to in a running proxy.
+// Built with <sys/sdt.h> (systemtap-sdt-dev) each probe is a nop in the code and
+// a note in the ELF naming it and where its arguments are; attaching turns the nop
+// into a trap. Unattached a probe costs the nop and its arguments being at hand,
+// so they are what the code already has: numbers, pointers and lengths. Without
+// the header, or with -DNO_PROBES, they are nothing at all.
+//
+// The probes, provider proxy, see bpftrace/ for scripts using them:
+//   accept(session, client fd)
+//   request(session, sub, method, target, target length)	sub: pipelined request, 0 for the session's own
+//   cache_lookup(session, sub, hit)
+//   connect_start(session, sub, host)	resolving, host NUL terminated
+//   connect_end(session, sub, error)	0 when connected
+//   first_byte(session, sub)	of the origin's response
+//   response(session, sub, status, body bytes)	going out to the client
+//   tunnel_chunk(session, from fd, to fd, bytes)	relayed by a CONNECT tunnel
+//   evicted(key, key length)
+//   session_close(session, sub)
+#if defined(__has_include) && ! defined(NO_PROBES)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PROXY_PROBES
+#endif
+#endif
+
+#ifdef PROXY_PROBES
+#define PROXY_PROBE2(name, a, b) DTRACE_PROBE2(proxy, name, a, b)
+#define PROXY_PROBE3(name, a, b, c) DTRACE_PROBE3(proxy, name, a, b, c)
+#define PROXY_PROBE4(name, a, b, c, d) DTRACE_PROBE4(proxy, name, a, b, c, d)
+#define PROXY_PROBE5(name, a, b, c, d, e) DTRACE_PROBE5(proxy, name, a, b, c, d, e)
+#else
+#define PROXY_PROBE2(name, a, b) do {} while(0)
+#define PROXY_PROBE3(name, a, b, c) do {} while(0)
+#define PROXY_PROBE4(name, a, b, c, d) do {} while(0)
+#define PROXY_PROBE5(name, a, b, c, d, e) do {} while(0)
+#endif
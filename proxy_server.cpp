@@ -11,64 +11,261 @@
 #include <memory>
 #include <thread>
 #include <string>
+#include <vector>
+#include <algorithm>
+#include <list>
+#include <variant>
 #include <boost/array.hpp>
 #include <ctime>
+#include <csignal>
 #include <mutex>
+#include <atomic>
 #include <boost/optional.hpp>
 #include <boost/regex.hpp>
 #include <unistd.h>
 #include <syslog.h>
+#include "alloc_count.cpp"
+#include "lock_profile.cpp"
+#include "probes.cpp"
+#include "async_log.cpp"
+#include "event_log.cpp"
+#include "handler_memory.cpp"
 #include "lru_cache.cpp"
+#include "response_cache.cpp"
+#include "upstream_pool.cpp"
+#include "dns_cache.cpp"
+#include "happy_eyeballs.cpp"
+#include "tunnel_relay.cpp"
+#include "timer_wheel.cpp"
+#include "admission_control.cpp"
+#include "hot_upgrade.cpp"
+#include "metrics.cpp"
+#include "admin_server.cpp"
+#include "config.cpp"
 
 #define LOG_FILE_PATH "logs/proxy.log"
 #define CACHE_LINES 4
+#define PROXY_UID 1001	// the proxy runs as once its files are open
+#define UPSTREAM_MAX_IDLE_PER_ORIGIN 8
+#define UPSTREAM_MAX_IDLE_TOTAL 256
+#define UPSTREAM_IDLE_TIMEOUT std::chrono::seconds(30)
+#define DNS_MIN_TTL std::chrono::seconds(5)
+#define DNS_MAX_TTL std::chrono::seconds(3600)
+#define DNS_RESOLV_CONF "/etc/resolv.conf"
+#define DNS_HOSTS_FILE "/etc/hosts"
+#define DNS_MAX_ENTRIES 4096
+#define CONNECT_ATTEMPT_DELAY std::chrono::milliseconds(250)
+#define CONNECT_ATTEMPT_TIMEOUT std::chrono::milliseconds(3000)
+#define TUNNEL_SPLICE true	// Linux only, relay CONNECT tunnels with splice(2) instead of copying
+#define TUNNEL_BUFFER_MIN 4096	// per buffer, a copying tunnel direction holds two
+#define TUNNEL_BUFFER_MAX 262144
+#define TIMER_WHEEL_TICK std::chrono::milliseconds(100)	// resolution of all session timeouts
+#define LOOP_LAG_PROBE_INTERVAL std::chrono::milliseconds(50)
+#define ACCEPT_RETRY_DELAY std::chrono::milliseconds(100)	// after accept failed, e.g. out of descriptors
+#define BANDWIDTH_QUANTUM 16384	// most bytes a rate limited flow may write per scheduling round
+#define BANDWIDTH_TICK std::chrono::milliseconds(10)	// between rounds while flows wait for bytes
+#define RESPONSE_WRITE_CHUNK 65536	// bytes a rate limited response asks for per write
+#define PIPELINE_DEPTH 16	// pipelined requests fetched ahead of the one being answered
+#define LOG_RING_BYTES 262144	// per thread, lines beyond it are dropped until the writer catches up
+#define LOG_FLUSH_BYTES 65536	// most the log writer hands to one write(2)
+#define LOG_FLUSH_INTERVAL std::chrono::milliseconds(100)
+#define EVENT_LOG_CALIBRATE_INTERVAL std::chrono::seconds(1)	// how often the binary log pairs tick and wall clock
 
 namespace beast = boost::beast;
 namespace http = boost::beast::http;
 namespace net = boost::asio;
 using tcp = boost::asio::ip::tcp;
 
-std::mutex log_mutex;
-std::fstream log_;
+// lines are handed to the log's writer thread, nobody logging waits for the disk
+async_log logger{LOG_RING_BYTES, LOG_FLUSH_BYTES, LOG_FLUSH_INTERVAL};
 void log(const std::string& s){
-  std::lock_guard<std::mutex> lock(log_mutex);
-  log_ << s << std::endl;
+  logger.write(s.data(), s.size());
 }
 
+// what sessions do, when binary records are asked for; see session::event
+event_log binary_events;
+
+// which lines are logged, set from the config and again on SIGHUP
+log_levels log_filter;
+
+// counters and latencies of every thread, served on the admin port
+metrics proxy_metrics;
+
+// The line is only put together if its category logs its level
+#define LOG(category, level, line)					\
+  do									\
+    {									\
+      if(log_filter.enabled(log_category::category, log_level::level)) \
+	log(line);							\
+    }									\
+  while(0)
+
+// Whether a session event is logged: request and response lines are access
+// info, the rest of a request's way through the proxy is debug
+bool
+event_logged(event_code code)
+{
+  switch(code)
+    {
+    case event_code::request:
+    case event_code::pipelined:
+    case event_code::responding:
+    case event_code::timing:
+      return log_filter.enabled(log_category::access, log_level::info);
+    case event_code::requesting:
+    case event_code::received:
+      return log_filter.enabled(log_category::access, log_level::debug);
+    case event_code::not_in_cache:
+    case event_code::cache_valid:
+    case event_code::cache_needs_validation:
+    case event_code::cache_expired:
+    case event_code::revalidated:
+      return log_filter.enabled(log_category::cache, log_level::info);
+    case event_code::tunnel_ok:
+    case event_code::tunnel_closed:
+      return log_filter.enabled(log_category::tunnel, log_level::info);
+    case event_code::tunnel_response:
+      return log_filter.enabled(log_category::tunnel, log_level::debug);
+    default:
+      return log_filter.enabled(log_category::cache, log_level::debug);
+    }
+}
+
+// session::event for code if it is logged, its arguments are only evaluated then
+#define LOG_EVENT(code, ...)						\
+  do									\
+    {									\
+      if(event_logged(event_code::code))				\
+	event(event_code::code, ##__VA_ARGS__);				\
+    }									\
+  while(0)
+
 void
-fail(beast::error_code ec, char const* where, const std::string id_)
+fail(beast::error_code ec, char const* where, std::string const & id_)
 {
-  log(id_ + "Error [" +  std::string(where) + "]: " + ec.message().c_str());
+  LOG(errors, error, id_ + "Error [" +  std::string(where) + "]: " + ec.message().c_str());
 }
 
+// the listening sockets went to a new process, sessions end after their current request
+std::atomic<bool> draining{false};
+
 
 // Handles an HTTP proxy connection
+// the flat_buffers and request header fields of sessions, their memory recycled per thread
+typedef boost::beast::basic_flat_buffer<recycling_allocator<char> > session_buffer;
+typedef http::request<http::string_body, http::basic_fields<recycling_allocator<char> > > session_request;
+typedef http::request_parser<http::string_body, recycling_allocator<char> > session_request_parser;
+
 class session : public std::enable_shared_from_this<session>
 {
 private:
+  handler_memory handler_memory_;	// first in, last out: operations still in flight use it
   tcp::socket srv_sock_;
   tcp::socket cli_sock_;
-  boost::asio::strand<
-    boost::asio::io_context::executor_type> strand_;
-  boost::beast::flat_buffer srv_http_buffer_;
-  boost::beast::flat_buffer cli_http_buffer_;
-  http::request<http::string_body> req_;
-  http::response<http::dynamic_body> res_;
-  tcp::resolver resolver_;
-  boost::asio::streambuf srv_use_write_buf;
-  boost::asio::streambuf cli_use_write_buf;
-
-  http::response<http::empty_body> res_200_OK;
-  http::response<http::dynamic_body> res_400_BAD_REQUEST;
-  http::response<http::dynamic_body> res_502_BAD_GATEWAY;
-  http::response<http::dynamic_body> cached_res;
-  http::request<http::string_body> cached_res_validation_req;
-  boost::beast::flat_buffer validation_buffer_;
-  http::response<http::dynamic_body> validation_res;
-  time_t cached_res_expired_time;
-  size_t const read_buf_size;
-  LRUCache<std::string, std::pair<http::response<http::dynamic_body>, time_t>>& lru_cache_;
+  net::io_context& ioc_;
+  // the loop that accepted the session runs on one thread, no strand needed
+  net::io_context::executor_type executor_;
+  session_buffer cli_http_buffer_;
+  session_request req_;
+  http::response<http::dynamic_body> res_;	// to the client, emptied once it is written
+  std::shared_ptr<http::response<http::dynamic_body> const> shared_res_;	// or a cached one, written as it is
+
+  // What a request needs only while in one phase lives in phase_, assigning the
+  // next phase frees it. An idle keep-alive connection holds none of it.
+  struct tunnel_phase
+  {
+    http::response<http::empty_body> res_200_OK;
+    std::function<std::size_t()> bytes;	// relayed by both directions so far
+    std::size_t bytes_seen = 0;
+  };
+  struct forward_phase
+  {
+    session_buffer buffer;	// the origin's response
+  };
+  struct cache_hit_phase
+  {
+    std::shared_ptr<http::response<http::dynamic_body> const> res;	// shared with the cache
+    time_t expires;
+  };
+  struct revalidate_phase
+  {
+    cache_hit_phase cached;
+    session_request req;	// the conditional GET
+    session_buffer buffer;
+    http::response<http::dynamic_body> res;
+  };
+  std::variant<std::monostate, tunnel_phase, forward_phase, cache_hit_phase, revalidate_phase> phase_;
+  response_cache& lru_cache_;
+  std::string cache_key_;	// req_.target() looked up, keeps its capacity across requests
+  std::string variant_key_;	// and the variant, see variant_key
+  upstream_pool& upstream_pool_;
+  dns_cache& dns_cache_;
+  std::string srv_origin_;	// "host:port" srv_sock_ is connected to, "" if none
+  bool srv_sock_reusable_;	// last response on srv_sock_ was read completely with keep-alive
+  bool srv_sock_reused_;	// srv_sock_ sat idle before this request and hasn't answered yet
   std::string id_;
+  std::uint32_t sid_;	// the session number of id_, in the binary event log
+  std::uint32_t sub_;	// and the pipelined request's, 0 for the session's own
+  timer_wheel& wheel_;
+  session_timeouts const & timeouts_;
+  socket_options const & sockets_;
+  request_tracing const & tracing_;
+  timer_wheel::timer deadline_;	// of the current phase, re-armed as the session moves on
+  bool timed_out_;	// a deadline closed the sockets, late completions must not carry on
+  boost::optional<session_request_parser> req_parser_;
+  void (session::*on_request_)(boost::system::error_code, std::size_t);
+  boost::optional<http::response_parser<http::dynamic_body> > res_parser_;
+  session_buffer* res_buffer_;
+  http::response<http::dynamic_body>* res_target_;
+  void (session::*on_response_)(boost::system::error_code, std::size_t);
+  std::size_t res_bytes_;
+  admission_control::ticket ticket_;	// our slot among the concurrent sessions
+  rate_limits& rate_limits_;
+  std::shared_ptr<rate_limits::client> client_limits_;	// null if nothing is rate limited
+  timer_wheel::timer throttle_;	// holds a request back while over the request rate
+  std::unique_ptr<bandwidth_flow> to_client_flow_;	// null unless bytes are rate limited
+  std::unique_ptr<bandwidth_flow> to_server_flow_;
+  boost::optional<http::response_serializer<http::dynamic_body> > res_serializer_;
+  std::size_t res_granted_;
+  bandwidth_scheduler& bandwidth_;
+
+  // The response to a pipelined request, filled in by the session fetching it
+  struct pipeline_slot
+  {
+    std::string id;	// of that session
+    std::uint32_t sub = 0;
+    http::response<http::dynamic_body> res;
+    std::string header;	// of res, serialized for a gathered write
+    bool ready = false;
+    bool failed = false;
+  };
+  std::list<std::shared_ptr<pipeline_slot> > pipeline_;	// in request order, empty costs nothing
+  std::size_t pipeline_writing_;	// slots at the front of pipeline_ being written
+  bool pipeline_waiting_;	// for the front slot to be filled
+  unsigned long pipelined_count_;
+  std::vector<boost::asio::const_buffer> pipeline_buffers_;
+  // set in a session fetching a pipelined request for its parent, which owns the client
+  std::shared_ptr<pipeline_slot> slot_;
+  std::shared_ptr<session> parent_;
+  void (session::*after_connect_)();	// the cache was already looked into
+  request_timing timing_;	// of req_, where its time goes
+#ifdef COUNT_ALLOCATIONS
+  std::size_t allocations_mark_;	// allocations() when the current request started
+#endif
+#ifdef COROUTINE_SESSION
+  // What the session coroutine keeps across its yields, the rest is in the members above
+  struct coroutine_frame : boost::asio::coroutine
+  {
+    std::pair<std::string, std::string> origin;	// host and port of req_
+    dns_cache::endpoints endpoints;
+    std::chrono::milliseconds wait{0};	// for the request rate
+    std::size_t granted = 0;	// of the response to the client, rate limited
+    bool fetch = false;	// req_ goes to the origin, it isn't answered from the cache
+    bool first = true;	// request on the connection
+    int directions = 0;	// of the tunnel still relaying
+  };
+  coroutine_frame frame_;
+#endif
   //std::mutex& cache_mutex_;
 
 
@@ -78,37 +275,194 @@ public:
 	  tcp::socket server_socket,
 	  tcp::socket client_socket,
 	  net::io_context& ioc,
-	  LRUCache<std::string, std::pair<http::response<http::dynamic_body>, time_t>>& lru_cache, unsigned long id)
+	  response_cache& lru_cache,
+	  upstream_pool& upstream_pool,
+	  dns_cache& dns_cache,
+	  timer_wheel& wheel,
+	  session_timeouts const & timeouts,
+	  socket_options const & sockets,
+	  request_tracing const & tracing,
+	  admission_control::ticket ticket,
+	  rate_limits& rate_limits,
+	  bandwidth_scheduler& bandwidth,
+	  unsigned long id)
     : srv_sock_(std::move(server_socket))
     , cli_sock_(std::move(client_socket))
-    , strand_{ioc.get_executor()}
-    , resolver_{ioc}
-    , read_buf_size{8192}
+    , ioc_{ioc}
+    , executor_{ioc.get_executor()}
     , lru_cache_{lru_cache}
+    , upstream_pool_{upstream_pool}
+    , dns_cache_{dns_cache}
+    , srv_sock_reusable_{false}
+    , srv_sock_reused_{false}
     , id_(std::to_string(id) + ": ")
+    , sid_(id)
+    , sub_{0}
+    , wheel_{wheel}
+    , timeouts_{timeouts}
+    , sockets_{sockets}
+    , tracing_{tracing}
+    , timed_out_{false}
+    , on_request_{nullptr}
+    , res_buffer_{nullptr}
+    , res_target_{nullptr}
+    , on_response_{nullptr}
+    , res_bytes_{0}
+    , ticket_(std::move(ticket))
+    , rate_limits_(rate_limits)
+    , res_granted_{0}
+    , bandwidth_(bandwidth)
+    , pipeline_writing_{0}
+    , pipeline_waiting_{false}
+    , pipelined_count_{0}
+    , after_connect_{nullptr}
+  {
+#ifdef COUNT_ALLOCATIONS
+    allocations_mark_ = allocations();
+#endif
+    // a pipelined request shares the buckets of its parent
+    if(! cli_sock_.is_open() || (! rate_limits.limits_requests() && ! rate_limits.limits_bytes()))
+      return;
+    boost::system::error_code ec;
+    client_limits_ = rate_limits.for_client(cli_sock_.remote_endpoint(ec).address());
+    if(rate_limits.limits_bytes())
+      {
+	to_client_flow_.reset(new bandwidth_flow(bandwidth, client_limits_));
+	to_server_flow_.reset(new bandwidth_flow(bandwidth, client_limits_));
+      }
+  }
+
+  ~session()
   {
+    PROXY_PROBE2(session_close, sid_, sub_);
+    abandon_pipelined();
   }
 
   void
   run()
   {
+    PROXY_PROBE2(accept, sid_, cli_sock_.native_handle());
+#ifdef COROUTINE_SESSION
+    (*this)();
+#else
     do_recv_req_connect_server();
+#endif
+  }
+
+  // A handler run on the session's loop, its operations allocate from handler_memory_
+  template<class Handler>
+  auto
+  on_loop(Handler&& handler)
+  {
+    return boost::asio::bind_executor(executor_, make_alloc_handler(handler_memory_, std::forward<Handler>(handler)));
   }
 
   void
   do_recv_req_connect_server()
   {   
-    req_ = std::move(http::request<http::string_body>());
+    // Receive req_ from client, the header deadline runs from the moment it connected
+    on_request_ = &session::on_recv_req_connect_server;
+    do_read_request_header();
+  }
+
+  // Read the next request into req_: the header under the header deadline,
+  // then whatever body it announces under the body deadline
+  void
+  do_read_request_header()
+  {
+    req_parser_.emplace();
+    arm_deadline(timeouts_.header, "header timeout");
+    http::async_read_header(cli_sock_, cli_http_buffer_, *req_parser_,
+			    on_loop(
+				    std::bind(
+					      &session::on_read_request_header,
+					      shared_from_this(),
+					      std::placeholders::_1,
+					      std::placeholders::_2)));
+  }
+
+  void
+  on_read_request_header(
+			 boost::system::error_code ec,
+			 std::size_t bytes_transferred)
+  {
+    if(timed_out_)
+      return;
+    if(ec || req_parser_->is_done())
+      return finish_request(ec, bytes_transferred);
+
+    arm_deadline(timeouts_.body, "body timeout");
+    http::async_read(cli_sock_, cli_http_buffer_, *req_parser_,
+		     on_loop(
+			     std::bind(
+				       &session::on_read_request_body,
+				       shared_from_this(),
+				       std::placeholders::_1,
+				       std::placeholders::_2)));
+  }
 
-    // Receive req_ from server
-    http::async_read(cli_sock_, cli_http_buffer_, req_,
-		     boost::asio::bind_executor(
-						strand_,
-						std::bind(
-							  &session::on_recv_req_connect_server,
-							  shared_from_this(),
-							  std::placeholders::_1,
-							  std::placeholders::_2)));
+  void
+  on_read_request_body(
+		       boost::system::error_code ec,
+		       std::size_t bytes_transferred)
+  {
+    if(timed_out_)
+      return;
+    finish_request(ec, bytes_transferred);
+  }
+
+  void
+  finish_request(
+		 boost::system::error_code ec,
+		 std::size_t bytes_transferred)
+  {
+    deadline_.cancel();
+    req_ = req_parser_->release();
+    req_parser_.reset();
+    (this->*on_request_)(ec, bytes_transferred);
+  }
+
+  // Close both sides unless the current phase is over within after, 0 means no limit.
+  // Arming again replaces the previous phase's deadline.
+  void
+  arm_deadline(std::chrono::seconds after, char const* what)
+  {
+    if(after.count() == 0)
+      return deadline_.cancel();
+    // deadline_ goes with the session, the wheel never calls a dead one
+    wheel_.schedule(
+		    deadline_,
+		    after,
+		    [this, what]()
+		    {
+		      on_deadline(what);
+		    });
+  }
+
+  void
+  on_deadline(char const* what)
+  {
+    // a tunnel is only idle if neither direction moved anything since the last look
+    auto tunnel = std::get_if<tunnel_phase>(&phase_);
+    if(tunnel && tunnel->bytes)
+      {
+	auto bytes = tunnel->bytes();
+	if(bytes != tunnel->bytes_seen)
+	  {
+	    tunnel->bytes_seen = bytes;
+	    return arm_deadline(timeouts_.idle, what);
+	  }
+      }
+
+    LOG(errors, info, id_ + "NOTE " + what + ", closing");
+    note_tunnel_bytes();
+    timed_out_ = true;
+    srv_sock_reusable_ = false;
+    release_srv_sock();
+    boost::system::error_code ec;
+    cli_sock_.close(ec);
+    // the resolver may hold on to us a while longer
+    abandon_pipelined();
   }
 
   void
@@ -118,26 +472,7 @@ public:
   {
     boost::ignore_unused(bytes_transferred);
 
-    //ID: REQUEST from IP @ TIME
-    // TIME is now in GMT timezone
-    log_mutex.lock();
-    float version = (req_.version() == 11)? 1.1:1.0;
-    auto cli_addr = cli_sock_.remote_endpoint().address();
-    time_t now  = time(nullptr);
-    struct tm gmt_buffer;
-    time_t now_in_gmt = mktime(gmtime_r(&now, &gmt_buffer));
-    char ctime_buffer[100];
-    ctime_r(&now_in_gmt, ctime_buffer);
-    auto now_in_gmt_string = std::string(ctime_buffer);
-    now_in_gmt_string.pop_back();
-    now_in_gmt_string += " GMT";
-    
-    log_ << id_ << req_.method() << " " << req_.target()
-    	 << " "<< "HTTP/" << version << " from "
-    << cli_addr << " @ " << now_in_gmt_string << std::endl;
-    
-    log_mutex.unlock();
-	
+    log_request();
 	
     // Client closed the connection
     if(ec == http::error::end_of_stream)
@@ -145,33 +480,449 @@ public:
     if(ec)
       return fail(ec, "on_recv_req_connect_server", id_);
         
-    // Ensure the http::method is correct, request is in correct format.(Todo)
+    if(! method_supported())
+      return fail(ec, "handle_init_request: method not supported", id_);
+
+    note_request();
+    start_pipelined_requests();
+    do_admit_request();
+  }
+
+  void
+  log_request()
+  {
+    //ID: REQUEST from IP @ TIME
+    // TIME is now in GMT timezone
+    if(! event_logged(event_code::request))
+      return;
+    boost::system::error_code ec;
+    auto cli_addr = cli_sock_.remote_endpoint(ec).address().to_string();
+    event(event_code::request, std::uint16_t(req_.method()), req_.target(), cli_addr, req_.version());
+  }
+
+  // What the session does goes to the binary event log as a record if there is
+  // one, else to the log as the line format_event makes of it. a and b are the
+  // strings the event_code names, number its a when that isn't a string.
+  void
+  event(
+	event_code code,
+	std::uint16_t small = 0,
+	boost::string_view a = {},
+	boost::string_view b = {},
+	unsigned version = 11,
+	std::uint32_t number = 0)
+  {
+    event_as(id_, sub_, code, small, a, b, version, number);
+  }
+
+  void
+  event_as(
+	   std::string const & id,
+	   std::uint32_t sub,
+	   event_code code,
+	   std::uint16_t small,
+	   boost::string_view a,
+	   boost::string_view b,
+	   unsigned version,
+	   std::uint32_t number)
+  {
+    if(binary_events.enabled())
+      return binary_events.write(
+				 code,
+				 sid_,
+				 sub,
+				 version,
+				 small,
+				 event_a_is_string(code) ? binary_events.intern(a) : number,
+				 event_b_is_string(code) ? binary_events.intern(b) : 0);
+    event_record r{0, 0, sid_, sub, std::uint8_t(code), std::uint8_t(version), small, number, 0};
+    log(format_event(id, r, a, b, time(nullptr)));
+  }
+
+  // Ensure the http::method is correct, request is in correct format.(Todo)
+  bool
+  method_supported()
+  {
     switch(req_.method())
       {
-      case http::verb::get: break;
-      case http::verb::post: break;
-      case http::verb::connect: break;
+      case http::verb::get: return true;
+      case http::verb::post: return true;
+      case http::verb::connect: return true;
       default: 
-	//std::cout << req_.method() << std::endl;
-	return fail(ec, "handle_init_request: method not supported", id_);
+	return false;
       }
+  }
 
-    // Parse and get the host and port
-    auto remove_port_info = [](std::string req_host_string, http::verb method)
+  // req_ is under way: counted by its method, timed until its response goes out
+  void
+  note_request()
+  {
+    timing_.start();
+    PROXY_PROBE5(request, sid_, sub_, int(req_.method()), req_.target().data(), req_.target().size());
+    switch(req_.method())
       {
-	if(method == http::verb::connect && req_host_string.rfind(':') != std::string::npos)
-	  req_host_string.erase(req_host_string.rfind(':'));
-	return req_host_string;
-      };
+      case http::verb::get: return proxy_metrics.add(metric::requests_get);
+      case http::verb::post: return proxy_metrics.add(metric::requests_post);
+      case http::verb::connect: return proxy_metrics.add(metric::requests_connect);
+      default: return proxy_metrics.add(metric::requests_other);
+      }
+  }
 
-    auto const host = remove_port_info(std::string(req_.base()[http::field::host]), req_.method());
-    auto const port = req_.method() == http::verb::connect ? "443" : "80"; // 443 for https, 80 for http
+  // The response about to go out is res_, or a cached one shared with the cache
+  http::response<http::dynamic_body> const &
+  response_out() const
+  {
+    return shared_res_ ? *shared_res_ : res_;
+  }
 
-    resolver_.async_resolve(
+  // A cached response is served as the cache holds it, unless this one needs
+  // a header of its own or goes to a pipelined parent: then res_ gets a copy
+  void
+  serve_cached(std::shared_ptr<http::response<http::dynamic_body> const> res)
+  {
+    if(slot_ || tracing_.server_timing || draining)
+      res_ = *res;
+    else
+      shared_res_ = std::move(res);
+  }
+
+  // The response is about to go out, with the phases so far as its Server-Timing if asked for
+  void
+  note_response()
+  {
+    timing_.mark(timing_mark::responding);
+    if(! shared_res_)
+      {
+	if(tracing_.server_timing)
+	  res_.set("Server-Timing", timing_.server_timing());
+	// the connection ends after this response, the client must not send another
+	if(draining)
+	  res_.keep_alive(false);
+      }
+    auto const & res = response_out();
+    PROXY_PROBE4(response, sid_, sub_, res.result_int(), res.body().size());
+    record_phase(timing_phase::total, latency::request);
+    auto status_class = res.result_int() / 100;
+    if(status_class >= 1 && status_class <= 5)
+      proxy_metrics.add(metric(int(metric::responses_1xx) + status_class - 1));
+    proxy_metrics.add(metric::response_bytes, res.body().size());
+  }
+
+  // The name of the origin is resolved, the connect starts
+  void
+  note_resolved()
+  {
+    timing_.mark(timing_mark::resolved);
+    record_phase(timing_phase::dns, latency::dns);
+  }
+
+  void
+  note_connected()
+  {
+    timing_.mark(timing_mark::connected);
+    record_phase(timing_phase::connect, latency::upstream_connect);
+    proxy_metrics.add(metric::upstream_connects);
+  }
+
+  // The response is with the client, or the parent for a pipelined request: the
+  // phases go to the histograms and the access log, the timeline to the log if
+  // the request was slow
+  void
+  note_written()
+  {
+    if(! slot_)
+      timing_.mark(timing_mark::written);
+    record_phase(timing_phase::wait, latency::phase_wait);
+    record_phase(timing_phase::cache, latency::phase_cache);
+    record_phase(timing_phase::send, latency::phase_send);
+    record_phase(timing_phase::ttfb, latency::phase_ttfb);
+    record_phase(timing_phase::transfer, latency::phase_transfer);
+    record_phase(timing_phase::write, latency::phase_write);
+    if(event_logged(event_code::timing))
+      log_timing();
+
+    request_timing::clock::duration total;
+    if(tracing_.slow_request.count() == 0 || ! timing_.span(timing_phase::total, total) || total <= tracing_.slow_request)
+      return;
+    // at error level, sampling doesn't drop it
+    LOG(errors, error, id_ + "NOTE slow request " + timing_ms(request_timing::microseconds(total)) + "ms, " +
+	std::string(req_.method_string()) + " " + std::string(req_.target()) + ": " + timing_.timeline());
+  }
+
+  void
+  record_phase(timing_phase p, latency l)
+  {
+    request_timing::clock::duration d;
+    if(timing_.span(p, d))
+      proxy_metrics.record(l, d);
+  }
+
+  // The phases of req_, a timing event each in the binary event log, else one line
+  void
+  log_timing()
+  {
+    std::string line;
+    request_timing::clock::duration d;
+    for(int p = 0; p < int(timing_phase::count); p++)
+      {
+	if(! timing_.span(timing_phase(p), d))
+	  continue;
+	auto us = std::uint32_t(std::min<std::uint64_t>(request_timing::microseconds(d), UINT32_MAX));
+	if(binary_events.enabled())
+	  binary_events.write(event_code::timing, sid_, sub_, 11, p, us, 0);
+	else
+	  line += (line.empty() ? "" : " ") + timing_text(p, us);
+      }
+    if(! line.empty())
+      log(id_ + "Timing " + line);
+  }
+
+  // What the tunnel relayed, while both relays are still around; once
+  void
+  note_tunnel_bytes()
+  {
+    auto tunnel = std::get_if<tunnel_phase>(&phase_);
+    if(! tunnel || ! tunnel->bytes)
+      return;
+    proxy_metrics.add(metric::tunnel_bytes, tunnel->bytes());
+    tunnel->bytes = nullptr;
+  }
+
+  // Hold the request back until its client and the proxy are within their request rates
+  void
+  do_admit_request()
+  {
+    auto wait = client_limits_ ? rate_limits_.request_wait(*client_limits_) : std::chrono::milliseconds(0);
+    if(wait.count() == 0)
+      {
+	timing_.mark(timing_mark::admitted);
+	after_connect_ = nullptr;
+	return req_.method() == http::verb::get ? do_get_request() : do_connect_server();
+      }
+
+    // the throttle keeps the session alive, nothing else is pending meanwhile
+    auto self = shared_from_this();
+    wheel_.schedule(
+		    throttle_,
+		    wait,
+		    [self]()
+		    {
+		      self->do_admit_request();
+		    });
+  }
+
+  // GETs the client pipelined behind req_ which are already buffered complete are
+  // fetched right away, each by a session of its own sharing nothing with us but
+  // the slot its response goes to. Anything else stays buffered for later.
+  void
+  start_pipelined_requests()
+  {
+    if(slot_ || req_.method() != http::verb::get || ! req_.keep_alive())
+      return;
+    while(pipeline_.size() < PIPELINE_DEPTH)
+      {
+	session_request_parser parser;
+	auto used = parse_buffered_request(parser);
+	if(used == 0 || parser.get().method() != http::verb::get)
+	  return;
+	cli_http_buffer_.consume(used);
+
+	auto slot = std::make_shared<pipeline_slot>();
+	slot->id = id_.substr(0, id_.size() - 2) + "." + std::to_string(++pipelined_count_) + ": ";
+	slot->sub = pipelined_count_;
+	auto fetch = std::allocate_shared<session>(
+						   recycling_allocator<session>(),
+						   tcp::socket{ioc_},
+						   tcp::socket{ioc_},
+						   ioc_,
+						   lru_cache_,
+						   upstream_pool_,
+						   dns_cache_,
+						   wheel_,
+						   timeouts_,
+						   sockets_,
+						   tracing_,
+						   admission_control::ticket(),
+						   rate_limits_,
+						   bandwidth_,
+						   0);
+	fetch->id_ = slot->id;
+	fetch->sid_ = sid_;
+	fetch->sub_ = slot->sub;
+	fetch->req_ = parser.release();
+	fetch->slot_ = slot;
+	fetch->parent_ = shared_from_this();
+	fetch->client_limits_ = client_limits_;
+	pipeline_.push_back(slot);
+	if(event_logged(event_code::pipelined))
+	  fetch->event(event_code::pipelined, std::uint16_t(fetch->req_.method()), fetch->req_.target());
+	fetch->note_request();
+	bool last = ! fetch->req_.keep_alive();
+	fetch->do_admit_request();
+	if(last)
+	  return;
+      }
+  }
+
+  // Length of the complete request at the front of cli_http_buffer_, 0 if it
+  // isn't all there yet or is malformed
+  std::size_t
+  parse_buffered_request(session_request_parser& parser)
+  {
+    auto const data = cli_http_buffer_.data();
+    std::size_t used = 0;
+    parser.eager(true);
+    while(! parser.is_done())
+      {
+	boost::system::error_code ec;
+	auto n = parser.put(data + used, ec);
+	if(ec || n == 0)
+	  return 0;
+	used += n;
+      }
+    return used;
+  }
+
+  // A GET looks into the cache before it takes a connection, a fresh hit is
+  // answered without one
+  void
+  do_get_request()
+  {
+    if(! lookup_cache())
+      {
+	LOG_EVENT(not_in_cache);
+	after_connect_ = &session::do_http_send_req_to_server;
+      }
+    else if(need_validate())
+      after_connect_ = &session::do_cached_response_validate;
+    else
+      return do_send_cached_response();
+    do_connect_server();
+  }
+
+  // Hand the response to the parent, which writes it when its turn comes
+  void
+  deliver_pipelined()
+  {
+    release_srv_sock();
+    slot_->res = std::move(res_);
+    slot_->ready = true;
+    boost::asio::post(ioc_, std::bind(&session::on_pipelined_ready, parent_));
+  }
+
+  // A pipelined request that ends without a response breaks the pipeline
+  void
+  abandon_pipelined()
+  {
+    if(! slot_ || slot_->ready || slot_->failed)
+      return;
+    slot_->failed = true;
+    boost::asio::post(ioc_, std::bind(&session::on_pipelined_ready, parent_));
+  }
+
+  void
+  on_pipelined_ready()
+  {
+    if(! pipeline_waiting_)
+      return;
+    pipeline_waiting_ = false;
+    do_send_pipelined();
+  }
+
+  // After a response went out: the answers to pipelined requests follow in order,
+  // all that are ready at the front in one gathered write, then the next request
+  void
+  do_send_pipelined()
+  {
+    if(pipeline_.empty())
+      return do_http_recv_req_from_client();
+
+    auto& front = *pipeline_.front();
+    if(front.failed)
+      {
+	LOG(errors, info, front.id + "NOTE pipelined request failed, closing");
+	return do_close();
+      }
+    if(! front.ready)
+      {
+	pipeline_waiting_ = true;
+	return;
+      }
+    // rate limited or not delimited by Content-Length: one at a time the usual way
+    if(to_client_flow_ || ! can_gather(front.res))
+      {
+	res_ = std::move(front.res);
+	pipeline_.pop_front();
+	return do_http_send_res_to_client();
+      }
+
+    pipeline_buffers_.clear();
+    pipeline_writing_ = 0;
+    for(auto const & slot : pipeline_)
+      {
+	if(! slot->ready || ! can_gather(slot->res))
+	  break;
+	log_response(slot->id, slot->sub, slot->res);
+	std::ostringstream header;
+	header << slot->res.base();
+	slot->header = header.str();
+	pipeline_buffers_.push_back(boost::asio::buffer(slot->header));
+	for(auto const & b : slot->res.body().data())
+	  pipeline_buffers_.push_back(b);
+	pipeline_writing_++;
+      }
+    boost::asio::async_write(cli_sock_, pipeline_buffers_,
+			     on_loop(
+				     std::bind(
+					       &session::on_send_pipelined,
+					       shared_from_this(),
+					       std::placeholders::_1,
+					       std::placeholders::_2)));
+  }
+
+  // header and body can go out as they are
+  static bool
+  can_gather(http::response<http::dynamic_body> const & res)
+  {
+    return res.has_content_length() && ! res.chunked();
+  }
+
+  void
+  on_send_pipelined(
+		    boost::system::error_code ec,
+		    std::size_t bytes_transferred)
+  {
+    boost::ignore_unused(bytes_transferred);
+
+    if(ec)
+      return fail(ec, "on_send_pipelined", id_);
+    pipeline_.erase(pipeline_.begin(), std::next(pipeline_.begin(), pipeline_writing_));
+    pipeline_writing_ = 0;
+    do_send_pipelined();
+  }
+
+  // Get a connection to the origin of req_: keep the current one if it already
+  // talks to that origin, else take an idle one from the pool, else connect
+  void
+  do_connect_server()
+  {
+    // Parse and get the host and port, 443 for https, 80 for http unless Host names one
+    auto const origin = parse_origin(std::string(req_.base()[http::field::host]), req_.method());
+    auto const& host = std::get<0>(origin);
+    auto const& port = std::get<1>(origin);
+
+    if(reuse_connection(host + ":" + port))
+      return on_connect(beast::error_code());
+
+    arm_deadline(timeouts_.connect, "connect timeout");
+    timing_.mark(timing_mark::resolving);
+    PROXY_PROBE3(connect_start, sid_, sub_, host.c_str());
+    dns_cache_.async_resolve(
 			    host,
 			    port,
+			    // answered from the main loop's thread, not through handler_memory_
 			    boost::asio::bind_executor(
-						       strand_,
+						       executor_,
 						       std::bind(
 								 &session::on_resolve,
 								 shared_from_this(),
@@ -179,107 +930,238 @@ public:
 								 std::placeholders::_2)));
   }
 
+  // Keep srv_sock_ if it talks to origin_key already, else take an idle connection
+  // to it from the pool; false if a new one has to be connected
+  bool
+  reuse_connection(std::string const & origin_key)
+  {
+    if(req_.method() != http::verb::connect)
+      {
+	if(srv_sock_.is_open() && srv_origin_ == origin_key && srv_sock_reusable_)
+	  {
+	    srv_sock_reused_ = true;
+	    proxy_metrics.add(metric::upstream_reuses);
+	    return true;
+	  }
+
+	release_srv_sock();
+	auto pooled = upstream_pool_.checkout(origin_key);
+	if(pooled)
+	  {
+	    srv_sock_ = std::move(pooled.get());
+	    srv_origin_ = origin_key;
+	    srv_sock_reused_ = true;
+	    proxy_metrics.add(metric::upstream_reuses);
+	    return true;
+	  }
+      }
+    else
+      release_srv_sock();
+
+    srv_origin_ = origin_key;
+    return false;
+  }
+
+  // host and port of the origin named by a Host header or CONNECT target
+  std::pair<std::string, std::string>
+  parse_origin(std::string host, http::verb method)
+  {
+    std::string port = method == http::verb::connect ? "443" : "80";
+    auto colon = host.rfind(':');
+    // a colon inside [] belongs to an IPv6 literal
+    if(colon != std::string::npos && host.find(']', colon) == std::string::npos)
+      {
+	port = host.substr(colon + 1);
+	host.erase(colon);
+      }
+    if(host.size() > 1 && host.front() == '[' && host.back() == ']')
+      host = host.substr(1, host.size() - 2);
+    return std::make_pair(host, port);
+  }
+
+  // Hand srv_sock_ back to the pool if its last exchange left it reusable, close it otherwise
+  void
+  release_srv_sock()
+  {
+    if(srv_sock_.is_open())
+      {
+	if(srv_sock_reusable_)
+	  upstream_pool_.checkin(srv_origin_, std::move(srv_sock_));
+	else
+	  {
+	    boost::system::error_code ec;
+	    srv_sock_.shutdown(tcp::socket::shutdown_both, ec);
+	    srv_sock_.close(ec);
+	  }
+      }
+    srv_sock_reusable_ = false;
+    srv_sock_reused_ = false;
+    srv_origin_.clear();
+  }
+
+  // A pooled connection may have been closed by the origin while in flight to us;
+  // a GET which failed on one before any answer arrived is retried on a new connection
+  bool
+  retry_on_new_connection(beast::error_code ec)
+  {
+    if(! pooled_connection_failed(ec))
+      return false;
+    do_connect_server();
+    return true;
+  }
+
+  // Let go of srv_sock_ if ec is worth a retry on a new connection
+  bool
+  pooled_connection_failed(beast::error_code ec)
+  {
+    if(! srv_sock_reused_ || req_.method() != http::verb::get || timed_out_)
+      return false;
+    LOG(errors, info, id_ + "NOTE pooled connection failed (" + ec.message() + "), reconnecting");
+    release_srv_sock();
+    return true;
+  }
+
   void
   on_resolve(
 	     beast::error_code ec,
-	     tcp::resolver::results_type results)
+	     dns_cache::endpoints results)
   {
+    if(timed_out_)
+      return;
     if(ec)
-      return fail(ec, "on_resolve", id_);
+      {
+	PROXY_PROBE3(connect_end, sid_, sub_, ec.value());
+	return fail(ec, "on_resolve", id_);
+      }
+    note_resolved();
         
-    boost::asio::async_connect(
-			       srv_sock_,
-			       results.begin(),
-			       results.end(),
-			       boost::asio::bind_executor(
-							  strand_,
-							  std::bind(
-								    &session::on_connect,
-								    shared_from_this(),
-								    std::placeholders::_1)));
+    async_connect_race(
+		       ioc_,
+		       srv_sock_,
+		       results,
+		       CONNECT_ATTEMPT_DELAY,
+		       CONNECT_ATTEMPT_TIMEOUT,
+		       [&sockets = sockets_](tcp::socket& sock)
+		       {
+			 apply_upstream_options(sock, sockets);
+		       },
+		       on_loop(
+			       std::bind(
+					 &session::on_connect,
+					 shared_from_this(),
+					 std::placeholders::_1)));
   }
 
   void
   on_connect(beast::error_code ec)
   {
+    // the race still hands over a socket the deadline gave up on
+    if(timed_out_)
+      return release_srv_sock();
+    deadline_.cancel();
+    // not for a connection reused
+    bool connecting = timing_.has(timing_mark::resolved) && ! timing_.has(timing_mark::connected);
+    if(connecting)
+      PROXY_PROBE3(connect_end, sid_, sub_, ec.value());
     if(ec)
       return fail(ec, "on_connect", id_);
-        
+    if(connecting)
+      note_connected();
+
+    srv_sock_reusable_ = false;
+
+    if(after_connect_)
+      return (this->*after_connect_)();
     if(req_.method() == http::verb::connect)
       do_https_send_200_OK_res();
     else if(req_.method() == http::verb::post)
       do_http_send_req_to_server();
-    else if(req_.method() == http::verb::get)
-      do_check_in_cache();
   }
 
-  void
-  do_check_in_cache()
+  // Find req_ in the cache, a hit moves on to the cache_hit_phase
+  bool
+  lookup_cache()
   {
-    auto target = std::string(req_.target());
-    auto cached_res_optional = lru_cache_.get(target);
-	
-    if(! cached_res_optional)
-      {
-	log(id_ + "not in cache");
-	do_http_send_req_to_server();
-      }
-    else
+    normalize_accept_encoding();
+
+    // one entry per target, a response carrying Vary is one of its variants
+    // picked by the normalized request headers it names
+    boost::optional<cached_response> cached;
+    cache_key_.assign(req_.target().data(), req_.target().size());
+    lru_cache_.visit(
+		     cache_key_,
+		     [this, &cached](cache_entry const & entry)
+		     {
+		       variant_key(entry.vary, variant_key_);
+		       if(auto variant = entry.find(variant_key_))
+			 cached = *variant;
+		     });
+    timing_.mark(timing_mark::looked_up);
+    PROXY_PROBE3(cache_lookup, sid_, sub_, int(bool(cached)));
+
+    if(! cached)
       {
-	cached_res = std::get<0>(cached_res_optional.get());
-	cached_res_expired_time = std::get<1>(cached_res_optional.get());
-	do_check_cached_response_need_validate();
+	proxy_metrics.add(metric::cache_misses);
+	return false;
       }
+    proxy_metrics.add(metric::cache_hits);
+    phase_ = cache_hit_phase{std::move(cached->res), cached->expires};
+    return true;
   }
 
   void
-  do_check_cached_response_need_validate()
+  do_send_cached_response()
   {
-    if(need_validate())
-      do_cached_response_validate();
-    else
-      {
-	log(id_ + "in cache, valid");
-	res_ = cached_res;
-	do_http_send_res_to_client();
-      }
+    LOG_EVENT(cache_valid);
+    serve_cached(std::move(std::get<cache_hit_phase>(phase_).res));
+    phase_ = std::monostate();
+    do_http_send_res_to_client();
   }
 
   void
   do_cached_response_validate()
   {
-    cached_res_validation_req = req_;
+    auto& phase = prepare_validation_request();
+    timing_.mark(timing_mark::sending);
+    http::async_write(srv_sock_, phase.req,
+		      on_loop(
+			      std::bind(
+					&session::on_send_validation_req_to_server,
+					shared_from_this(),
+					std::placeholders::_1,
+					std::placeholders::_2)));
+  }
 
-    auto etag = cached_res.base()["ETag"];
-    auto last_modified = cached_res.base()["Last-Modified"];
+  // The conditional GET for the cached response, in a revalidate_phase
+  revalidate_phase&
+  prepare_validation_request()
+  {
+    // a retry on a new connection starts over from the cached response
+    auto revalidating = std::get_if<revalidate_phase>(&phase_);
+    cache_hit_phase cached = revalidating ? std::move(revalidating->cached) : std::move(std::get<cache_hit_phase>(phase_));
+    auto& phase = phase_.emplace<revalidate_phase>();
+    phase.cached = std::move(cached);
+    phase.req = req_;
+
+    auto etag = phase.cached.res->base()["ETag"];
+    auto last_modified = phase.cached.res->base()["Last-Modified"];
     
     if(etag != "")
       {
-	log_mutex.lock();
-	log_ << id_ << "NOTE ETag: " << etag << std::endl;
-	log_mutex.unlock();
+	LOG_EVENT(etag, 0, etag);
       
-	cached_res_validation_req.set("ETag", etag);
+	phase.req.set("ETag", etag);
       }
     if(last_modified != "")
-      cached_res_validation_req.set("If-Modified-Since", last_modified);
+      phase.req.set("If-Modified-Since", last_modified);
     /*
-    log_mutex.lock();
     std::stringstream ss;
-    ss << cached_res_validation_req;
+    ss << phase.req;
     
-    log_ << id_ << "Requesting REQUEST from SERVER" << std::endl;
-    log_ << id_ << endl << ss.str() << std::endl;
-    log_mutex.unlock();
+    log(id_ + "Requesting REQUEST from SERVER");
+    log(id_ + "\n" + ss.str());
     */
-    http::async_write(srv_sock_, cached_res_validation_req,
-		      boost::asio::bind_executor(
-						 strand_,
-						 std::bind(
-							   &session::on_send_validation_req_to_server,
-							   shared_from_this(),
-							   std::placeholders::_1,
-							   std::placeholders::_2)));
+    return phase;
   }
 
   void
@@ -287,8 +1169,11 @@ public:
 				   const boost::system::error_code& ec,
 				   std::size_t bytes_transferred)
   {
+    if(ec && retry_on_new_connection(ec))
+      return;
     if(ec)
       return fail(ec, "on_send_validation_req_to_server", id_);
+    timing_.mark(timing_mark::sent);
         
     do_recv_validation_response_from_server();
   }
@@ -296,41 +1181,41 @@ public:
   void
   do_recv_validation_response_from_server()
   {
-    http::async_read(srv_sock_, validation_buffer_, validation_res,
-		     boost::asio::bind_executor(
-						strand_,
-						std::bind(
-							  &session::on_recv_validation_response_from_server,
-							  shared_from_this(),
-							  std::placeholders::_1,
-							  std::placeholders::_2)));
+    auto& phase = std::get<revalidate_phase>(phase_);
+    do_read_response(phase.buffer, phase.res, &session::on_recv_validation_response_from_server);
   }
 
   void
   on_recv_validation_response_from_server(
-					  const boost::system::error_code& ec,
+					  boost::system::error_code ec,
 					  std::size_t bytes_transferred)
   {
     boost::ignore_unused(bytes_transferred);
 
-    log_mutex.lock();
-    std::stringstream ss;
-    ss << validation_res.base();
-    
-    log_ << id_ << "Received revalidation from SERVER" << std::endl
-	 << id_ << endl << ss.str() << std::endl;
-      
-    log_mutex.unlock();
+    if(ec && retry_on_new_connection(ec))
+      return;
+    if(ec)
+      return fail(ec, "on_recv_validation_response_from_server", id_);
+    auto& phase = std::get<revalidate_phase>(phase_);
+    srv_sock_reused_ = false;
+    srv_sock_reusable_ = ! phase.res.need_eof() && phase.buffer.size() == 0;
+
+    LOG_EVENT(revalidated, phase.res.result_int());
+    proxy_metrics.add(phase.res.result_int() == 304 ? metric::revalidated_not_modified : metric::revalidated_modified);
     
-    if(validation_res.result_int() == 304)
+    if(phase.res.result_int() == 304)
       {
-	res_ = cached_res;
+	serve_cached(std::move(phase.cached.res));
+	phase_ = std::monostate();
 	do_http_send_res_to_client();
       }
-    else if(validation_res.result_int() == 200)
+    else
       {
-	res_ = validation_res;
-	save_res_to_cache();
+	// modified, or whatever else the server says now, goes to the client
+	res_ = std::move(phase.res);
+	phase_ = std::monostate();
+	if(res_.result_int() == 200)
+	  save_res_to_cache();
 	do_http_send_res_to_client();
       }
   }
@@ -345,11 +1230,12 @@ public:
   bool
   cached_response_no_cache()
   {
+    auto const & cached_res = *std::get<cache_hit_phase>(phase_).res;
     if(cached_res.base()["Cache-Control"] != "")
       {
 	if(cached_res.base()["Cache-Control"].find("no-cache") != std::string::npos)
 	  {
-	    log(id_ + "in cache, requires validation");
+	    LOG_EVENT(cache_needs_validation);
 	    return true;
 	  }
       }
@@ -359,20 +1245,14 @@ public:
   bool
   cached_response_out_of_date()
   {
-    time_t expired_time_in_gmt = cached_res_expired_time;
+    time_t expired_time_in_gmt = std::get<cache_hit_phase>(phase_).expires;
     time_t now = time(nullptr);
     struct tm gmt_buffer;
     time_t now_in_gmt = mktime(gmtime_r(&now, &gmt_buffer));
-    
-    char ctime_buffer[100];
-    ctime_r(&expired_time_in_gmt, ctime_buffer);
-    auto expired_time_in_gmt_string = std::string(ctime_buffer);
-    expired_time_in_gmt_string.pop_back();
-    expired_time_in_gmt_string += " GMT";
       
     if(now_in_gmt > expired_time_in_gmt)
       {
-	log(id_ + "in cache, but expired at " + expired_time_in_gmt_string);
+	LOG_EVENT(cache_expired, 0, {}, {}, 11, std::uint32_t(expired_time_in_gmt));
 	return true;
       }
     return false;
@@ -394,17 +1274,18 @@ public:
 	return res;
       };
 
-    // res_200_OK must survive until next callback, so we've made it a property
-    res_200_OK = generate_200_OK_response(); 
-
-    http::async_write(cli_sock_, res_200_OK,
-		      boost::asio::bind_executor(
-						 strand_,
-						 std::bind(
-							   &session::on_https_send_200_OK_res,
-							   shared_from_this(),
-							   std::placeholders::_1,
-							   std::placeholders::_2)));
+    // res_200_OK must survive until next callback, the tunnel phase keeps it
+    phase_ = tunnel_phase();
+    auto& tunnel = std::get<tunnel_phase>(phase_);
+    tunnel.res_200_OK = generate_200_OK_response(); 
+
+    http::async_write(cli_sock_, tunnel.res_200_OK,
+		      on_loop(
+			      std::bind(
+					&session::on_https_send_200_OK_res,
+					shared_from_this(),
+					std::placeholders::_1,
+					std::placeholders::_2)));
         
   }
 
@@ -417,104 +1298,143 @@ public:
        
     if(ec)
       return fail(ec, "on_https_send_200_OK_res", id_);
-    log(id_ + "Successfully send 200-OK to client");
-    do_cli_sock_read_some();
-    do_srv_sock_read_some();
+    LOG_EVENT(tunnel_ok);
+    req_ = {};
+#ifdef __linux__
+    if(TUNNEL_SPLICE && do_splice_tunnel())
+      return;
+#endif
+    do_buffered_tunnel();
   }
 
-  // Client --> Server
-
-  void
-  do_cli_sock_read_some()
+#ifdef __linux__
+  // Relay both directions socket -> pipe -> socket inside the kernel,
+  // false if no pipes are available and the tunnel has to copy instead
+  bool
+  do_splice_tunnel()
   {
-    cli_sock_.async_read_some(
-			      srv_use_write_buf.prepare(read_buf_size),
-			      std::bind(
-					&session::on_cli_sock_read_some,
-					shared_from_this(),
-					std::placeholders::_1,
-					std::placeholders::_2));
+    typedef splice_relay<decltype(executor_)> relay;
+
+    auto cli_to_srv = std::make_shared<relay>(
+					      sid_,
+					      cli_sock_,
+					      srv_sock_,
+					      executor_,
+					      to_server_flow_.get(),
+					      std::bind(
+							&session::on_tunnel_relay,
+							shared_from_this(),
+							std::placeholders::_1,
+							std::placeholders::_2,
+							false));
+    auto srv_to_cli = std::make_shared<relay>(
+					      sid_,
+					      srv_sock_,
+					      cli_sock_,
+					      executor_,
+					      to_client_flow_.get(),
+					      std::bind(
+							&session::on_tunnel_relay,
+							shared_from_this(),
+							std::placeholders::_1,
+							std::placeholders::_2,
+							true));
+    boost::system::error_code ec;
+    if(! cli_to_srv->open(ec) || ! srv_to_cli->open(ec))
+      {
+	fail(ec, "do_splice_tunnel, copying instead", id_);
+	return false;
+      }
+    cli_to_srv->run();
+    srv_to_cli->run();
+    watch_tunnel(cli_to_srv, srv_to_cli);
+    return true;
   }
 
-  void
-  on_cli_sock_read_some(
-			const boost::system::error_code& ec,
-			std::size_t bytes_transferred)
-  {
-    srv_use_write_buf.commit(bytes_transferred);
-    if(ec == boost::asio::error::eof || ec == boost::asio::error::connection_reset)
-      return do_close();
-    if(ec)
-      return fail(ec, "on_cli_sock_read_some", id_);
-        
-    boost::asio::async_write(
-			     srv_sock_,
-			     srv_use_write_buf.data(),
-			     std::bind(
-				       &session::on_srv_sock_write,
-				       shared_from_this(),
-				       std::placeholders::_1,
-				       std::placeholders::_2));
-  }
+#endif
 
   void
-  on_srv_sock_write(const boost::system::error_code& ec,
-		    std::size_t bytes_transferred)
+  on_tunnel_relay(
+		  const boost::system::error_code& ec,
+		  std::size_t bytes_transferred,
+		  bool from_server)
   {
-    srv_use_write_buf.consume(bytes_transferred);
-    if(ec)
-      return fail(ec, "on_srv_sock_write", id_);
-        
-    do_cli_sock_read_some();
-  }
-
-  // Server --> Client
+    boost::ignore_unused(bytes_transferred);
 
-  void
-  do_srv_sock_read_some()
-  {
-    srv_sock_.async_read_some(
-			      cli_use_write_buf.prepare(read_buf_size),
-			      std::bind(
-					&session::on_srv_sock_read_some,
-					shared_from_this(),
-					std::placeholders::_1,
-					std::placeholders::_2));
+    // the other direction already closed the tunnel
+    if(! srv_sock_.is_open())
+      return;
+    note_tunnel_bytes();
+    if(ec == boost::asio::error::eof || ec == boost::asio::error::connection_reset)
+      {
+	if(from_server)
+	  LOG_EVENT(tunnel_response);
+	return do_close();
+      }
+    if(ec)
+      return fail(ec, from_server ? "on_tunnel_relay server to client" : "on_tunnel_relay client to server", id_);
   }
 
+  // Relay both directions through double buffers sized to the traffic
   void
-  on_srv_sock_read_some(
-			const boost::system::error_code& ec,
-			std::size_t bytes_transferred)
+  do_buffered_tunnel()
   {
-    cli_use_write_buf.commit(bytes_transferred);
-    if(ec == boost::asio::error::eof){
-      log(id_ + "Responding RESPONSE");
-      return do_close();
-    }
-    if(ec)
-      return fail(ec, "on_srv_sock_read_some", id_);
-        
-    boost::asio::async_write(
-			     cli_sock_,
-			     cli_use_write_buf.data(),
-			     std::bind(
-				       &session::on_cli_sock_write,
-				       shared_from_this(),
-				       std::placeholders::_1,
-				       std::placeholders::_2));
+    typedef buffered_relay<decltype(executor_)> relay;
+
+    auto cli_to_srv = std::make_shared<relay>(
+					      sid_,
+					      cli_sock_,
+					      srv_sock_,
+					      executor_,
+					      TUNNEL_BUFFER_MIN,
+					      TUNNEL_BUFFER_MAX,
+					      to_server_flow_.get(),
+					      std::bind(
+							&session::on_tunnel_relay,
+							shared_from_this(),
+							std::placeholders::_1,
+							std::placeholders::_2,
+							false));
+    auto srv_to_cli = std::make_shared<relay>(
+					      sid_,
+					      srv_sock_,
+					      cli_sock_,
+					      executor_,
+					      TUNNEL_BUFFER_MIN,
+					      TUNNEL_BUFFER_MAX,
+					      to_client_flow_.get(),
+					      std::bind(
+							&session::on_tunnel_relay,
+							shared_from_this(),
+							std::placeholders::_1,
+							std::placeholders::_2,
+							true));
+    cli_to_srv->run();
+    srv_to_cli->run();
+    watch_tunnel(cli_to_srv, srv_to_cli);
   }
 
+  // A tunnel is closed once both directions stayed silent for the idle timeout
+  template<class Relay>
   void
-  on_cli_sock_write(
-		    const boost::system::error_code& ec,
-		    std::size_t bytes_transferred)
+  watch_tunnel(
+	       std::shared_ptr<Relay> const & cli_to_srv,
+	       std::shared_ptr<Relay> const & srv_to_cli)
   {
-    cli_use_write_buf.consume(bytes_transferred);
-    if(ec)
-      return fail(ec, "on_cli_sock_write_some", id_);
-        
-    do_srv_sock_read_some();
+    std::weak_ptr<Relay> a = cli_to_srv;
+    std::weak_ptr<Relay> b = srv_to_cli;
+    auto& tunnel = std::get<tunnel_phase>(phase_);
+    tunnel.bytes = [a, b]()
+      {
+	std::size_t bytes = 0;
+	if(auto relay = a.lock())
+	  bytes += relay->total();
+	if(auto relay = b.lock())
+	  bytes += relay->total();
+	return bytes;
+      };
+    tunnel.bytes_seen = 0;
+    arm_deadline(timeouts_.idle, "tunnel idle timeout");
   }
 
   /////////////////////////////////////////////////////////////////////////////////
@@ -524,20 +1444,16 @@ public:
   do_http_send_req_to_server()
   {
     // Send req_ to server
-    log_mutex.lock();
-    float version = (req_.version() == 11)? 1.1:1.0;
-    log_ << id_ << "Requesting " << req_.method() << " " << req_.target()
-	 << " " << "HTTP/" << version << " from "
-	 << req_.base()["Host"] << std::endl;
-      log_mutex.unlock();
+    phase_ = forward_phase();
+    LOG_EVENT(requesting, std::uint16_t(req_.method()), req_.target(), req_.base()["Host"], req_.version());
+    timing_.mark(timing_mark::sending);
     http::async_write(srv_sock_, req_,
-		      boost::asio::bind_executor(
-						 strand_,
-						 std::bind(
-							   &session::on_http_send_req_to_server,
-							   shared_from_this(),
-							   std::placeholders::_1,
-							   std::placeholders::_2)));
+		      on_loop(
+			      std::bind(
+					&session::on_http_send_req_to_server,
+					shared_from_this(),
+					std::placeholders::_1,
+					std::placeholders::_2)));
   }
 
   void
@@ -547,8 +1463,11 @@ public:
   {
     boost::ignore_unused(bytes_transferred);
 
+    if(ec && retry_on_new_connection(ec))
+      return;
     if(ec)
       return fail(ec, "on_http_send_req_to_server", id_);
+    timing_.mark(timing_mark::sent);
         
     do_http_recv_res_from_server();
   }
@@ -556,18 +1475,87 @@ public:
   void
   do_http_recv_res_from_server()
   {
-    // Make a new response container
-    res_ = std::move(http::response<http::dynamic_body>());
-
     // Receive res_ from server
-    http::async_read(srv_sock_, srv_http_buffer_, res_,
-		     boost::asio::bind_executor(
-						strand_,
-						std::bind(
-							  &session::on_http_recv_res_from_server,
-							  shared_from_this(),
-							  std::placeholders::_1,
-							  std::placeholders::_2)));
+    do_read_response(std::get<forward_phase>(phase_).buffer, res_, &session::on_http_recv_res_from_server);
+  }
+
+  // Read the answer to the request just sent into res: the origin has the first byte
+  // deadline to start it, after that the idle deadline restarts with every chunk
+  void
+  do_read_response(
+		   session_buffer& buffer,
+		   http::response<http::dynamic_body>& res,
+		   void (session::*on_response)(boost::system::error_code, std::size_t))
+  {
+    res_parser_.emplace();
+    res_buffer_ = &buffer;
+    res_target_ = &res;
+    on_response_ = on_response;
+    res_bytes_ = 0;
+    if(buffer.size() > 0)
+      {
+	timing_.mark(timing_mark::first_byte);
+	PROXY_PROBE2(first_byte, sid_, sub_);
+	return do_read_response_some();
+      }
+
+    arm_deadline(timeouts_.first_byte, "first byte timeout");
+    srv_sock_.async_wait(
+			 tcp::socket::wait_read,
+			 on_loop(
+				 std::bind(
+					   &session::on_server_readable,
+					   shared_from_this(),
+					   std::placeholders::_1)));
+  }
+
+  void
+  on_server_readable(boost::system::error_code ec)
+  {
+    if(timed_out_)
+      return;
+    if(ec)
+      return finish_response(ec);
+    timing_.mark(timing_mark::first_byte);
+    PROXY_PROBE2(first_byte, sid_, sub_);
+    do_read_response_some();
+  }
+
+  void
+  do_read_response_some()
+  {
+    arm_deadline(timeouts_.idle, "response idle timeout");
+    http::async_read_some(srv_sock_, *res_buffer_, *res_parser_,
+			  on_loop(
+				  std::bind(
+					    &session::on_read_response_some,
+					    shared_from_this(),
+					    std::placeholders::_1,
+					    std::placeholders::_2)));
+  }
+
+  void
+  on_read_response_some(
+			boost::system::error_code ec,
+			std::size_t bytes_transferred)
+  {
+    if(timed_out_)
+      return;
+    res_bytes_ += bytes_transferred;
+    if(ec || res_parser_->is_done())
+      return finish_response(ec);
+    do_read_response_some();
+  }
+
+  void
+  finish_response(boost::system::error_code ec)
+  {
+    deadline_.cancel();
+    timing_.mark(timing_mark::received);
+    *res_target_ = res_parser_->release();
+    res_parser_.reset();
+    proxy_metrics.add(metric::upstream_bytes, res_bytes_);
+    (this->*on_response_)(ec, res_bytes_);
   }
 
   void
@@ -575,98 +1563,275 @@ public:
 			       boost::system::error_code ec,
 			       std::size_t bytes_transferred)
   {
-    boost::ignore_unused(bytes_transferred);
+    boost::ignore_unused(bytes_transferred);
+
+    if(ec && retry_on_new_connection(ec))
+      return;
+    srv_sock_reused_ = false;
+    srv_sock_reusable_ = ! ec && ! res_.need_eof() && std::get<forward_phase>(phase_).buffer.size() == 0;
+    phase_ = std::monostate();
+
+    // Server closed the connection
+    if(ec == http::error::end_of_stream)
+      return do_close();
+    if(ec)
+    {
+      auto generate_400_BAD_REQUEST_response = []()
+      {
+      http::response<http::dynamic_body> res;
+      res.result(400); 
+      res.prepare_payload();
+      return res;
+      };
+      res_ = generate_400_BAD_REQUEST_response();
+      do_http_send_res_to_client();
+    }else
+      {
+	LOG_EVENT(received, res_.result_int(), {}, req_.base()["Host"], res_.version());
+	save_res_to_cache();
+	do_http_send_res_to_client();
+      }
+  }
+
+  void
+  do_http_send_res_to_client()
+  {
+    note_response();
+    if(slot_)
+      {
+	note_written();
+	return deliver_pipelined();
+      }
+
+    log_response(id_, sub_, response_out());
+    if(to_client_flow_)
+      {
+	res_serializer_.emplace(response_out());
+	return do_write_response_some();
+      }
+    // the serializer writes a shared response without changing it, async_write
+    // of a message would need it mutable
+    if(shared_res_)
+      {
+	res_serializer_.emplace(*shared_res_);
+	return http::async_write(cli_sock_, *res_serializer_,
+				 on_loop(
+					 std::bind(
+						   &session::on_write_shared_response,
+						   shared_from_this(),
+						   std::placeholders::_1,
+						   std::placeholders::_2)));
+      }
+    http::async_write(cli_sock_, res_,
+		      on_loop(
+			      std::bind(
+					&session::on_http_send_res_to_client,
+					shared_from_this(),
+					std::placeholders::_1,
+					std::placeholders::_2)));
+  }
+
+  void
+  log_response(
+	       std::string const & id,
+	       std::uint32_t sub,
+	       http::response<http::dynamic_body> const & res)
+  {
+    if(event_logged(event_code::responding))
+      event_as(id, sub, event_code::responding, res.result_int(), {}, {}, res.version(), 0);
+  }
+
+  void
+  on_write_shared_response(
+			   boost::system::error_code ec,
+			   std::size_t bytes_transferred)
+  {
+    res_serializer_.reset();
+    on_http_send_res_to_client(ec, bytes_transferred);
+  }
+
+  // Rate limited: every write is cut to what the flow grants, the serializer
+  // still writes straight out of res_, or the shared response
+  void
+  do_write_response_some()
+  {
+    auto self = shared_from_this();
+    std::size_t granted = to_client_flow_->acquire(
+						   RESPONSE_WRITE_CHUNK,
+						   [self](std::size_t granted)
+						   {
+						     self->on_response_write_granted(granted);
+						   });
+    if(granted > 0)
+      on_response_write_granted(granted);
+  }
 
-    // Server closed the connection
-    if(ec == http::error::end_of_stream)
-      return do_close();
-    if(ec)
-    {
-      auto generate_400_BAD_REQUEST_response = []()
-      {
-      http::response<http::dynamic_body> res;
-      res.result(400); 
-      res.prepare_payload();
-      return res;
-      };
-      res_400_BAD_REQUEST = generate_400_BAD_REQUEST_response();
-      res_ = res_400_BAD_REQUEST;
-      do_http_send_res_to_client();
-    }else
-      {
-	log_mutex.lock();
-    
-	float version = (res_.version() == 11)? 1.1:1.0;
-	log_ << id_ << "Received HTTP/"<< version << " "
-	     << res_.result_int() << " from " << req_.base()["Host"] << std::endl;
-	/*
-	//used to check response content
-	std::stringstream ss;
-	ss << res_.base();
-	log_ << id_ << ss.str() << std::endl;
-	*/
-    
-	log_mutex.unlock();
-	save_res_to_cache();
-	do_http_send_res_to_client();
-      }
+  void
+  on_response_write_granted(std::size_t granted)
+  {
+    res_granted_ = granted;
+    res_serializer_->limit(granted);
+    http::async_write_some(cli_sock_, *res_serializer_,
+			   on_loop(
+				   std::bind(
+					     &session::on_write_response_some,
+					     shared_from_this(),
+					     std::placeholders::_1,
+					     std::placeholders::_2)));
   }
 
   void
-  do_http_send_res_to_client()
+  on_write_response_some(
+			 boost::system::error_code ec,
+			 std::size_t bytes_transferred)
   {
-    
-    std::stringstream ss;
-    float version = (res_.version() == 11)? 1.1:1.0;
-    ss << "HTTP/"<< version << " " << res_.result_int();
-    log(id_ + "Responding " + ss.str());
-    http::async_write(cli_sock_, res_,
-		      boost::asio::bind_executor(
-						 strand_,
-						 std::bind(
-							   &session::on_http_send_res_to_client,
-							   shared_from_this(),
-							   std::placeholders::_1,
-							   std::placeholders::_2)));
+    to_client_flow_->give_back(res_granted_ - std::min(res_granted_, bytes_transferred));
+    if(! ec && ! res_serializer_->is_done())
+      return do_write_response_some();
+    res_serializer_.reset();
+    on_http_send_res_to_client(ec, bytes_transferred);
   }
 
   void
   save_res_to_cache()
   {
     
-    if(cached_res.base()["Cache-Control"].find("private") != std::string::npos)
+    if(res_.base()["Cache-Control"].find("private") != std::string::npos)
       {
-	log(id_ + "not cacheable because PRIVATE");
+	LOG_EVENT(not_cacheable, 0);
 	return;
       }
-    if(cached_res.base()["Cache-Control"].find("no-store") != std::string::npos)
+    if(res_.base()["Cache-Control"].find("no-store") != std::string::npos)
       {
-	log(id_ + "not cacheable because NO-STORE");
+	LOG_EVENT(not_cacheable, 1);
 	return;
       }
-    if(cached_res.base()["Cache-Control"] == "" && expire_time_string_not_in_GMT_format(std::string(cached_res.base()["Expires"])))
+    if(res_.base()["Cache-Control"] == "" && expire_time_string_not_in_GMT_format(std::string(res_.base()["Expires"])))
       {
-	log(id_ + "not cacheable because no Cache-Control and Expires");
+	LOG_EVENT(not_cacheable, 2);
 	return;
       }
 
-    log(id_ + "NOTE cache the response");
-    auto key = std::string(req_.target());
-    auto response = res_;
-    auto expire_time = get_expire_time(res_);
-    
-    auto evicted = lru_cache_.store(key, std::make_pair(response, expire_time));
-    
+    if(res_.base()["Vary"].find("*") != std::string::npos)
+      {
+	LOG_EVENT(not_cacheable, 3);
+	return;
+      }
+
+    LOG_EVENT(cached);
+    auto names = parse_vary(res_);
+    std::string variant;
+    variant_key(names, variant);
+    cached_response cached{std::make_shared<http::response<http::dynamic_body> >(res_), get_expire_time(res_)};
+    log_evicted(lru_cache_.update(
+				  std::string(req_.target()),
+				  [&](cache_entry& entry)
+				  {
+				    entry.store(std::move(names), std::move(variant), std::move(cached));
+				  }));
+  }
+
+  void
+  log_evicted(std::pair<bool, std::string> const & evicted)
+  {
     if(std::get<1>(evicted) != "")
       {
-	log("NOTE evicted " + std::get<1>(evicted));
+	PROXY_PROBE2(evicted, std::get<1>(evicted).data(), std::get<1>(evicted).size());
+	proxy_metrics.add(metric::cache_evictions);
+	LOG_EVENT(evicted, 0, std::get<1>(evicted));
+      }
+  }
+
+  std::vector<std::string>
+  parse_vary(http::response<http::dynamic_body> const & res)
+  {
+    return vary_names(res.base()["Vary"]);
+  }
+
+  // Key of one variant within its target's entry, into key: the normalized values
+  // of the request headers named in Vary, "" for none. The space can't occur in a
+  // target, target + key names the variant on its own.
+  void
+  variant_key(std::vector<std::string> const & vary_names, std::string& key)
+  {
+    key.clear();
+    for(auto const & name : vary_names)
+      {
+	std::string value = std::string(req_.base()[name]);
+	key += ' ';
+	key += name;
+	key += '=';
+	key += name == "accept-encoding" ? accept_encoding_bucket(value) : collapse_whitespace(value);
+      }
+  }
+
+  // Fold the Accept-Encoding of a GET into one of a few canonical buckets and
+  // forward only that, so the response we cache is valid for every client in the bucket
+  void
+  normalize_accept_encoding()
+  {
+    req_.set(http::field::accept_encoding,
+	     accept_encoding_bucket(std::string(req_.base()[http::field::accept_encoding])));
+  }
+
+  // br > gzip > identity, codings with q=0 are not acceptable
+  std::string
+  accept_encoding_bucket(std::string const & accept_encoding)
+  {
+    bool br = false;
+    bool gzip = false;
+    std::stringstream ss(accept_encoding);
+    std::string coding;
+    while(std::getline(ss, coding, ','))
+      {
+	auto params = coding.find(';');
+	std::string q = params == std::string::npos ? "" : parse_q_value(coding.substr(params));
+	coding = trim(coding.substr(0, params));
+	std::transform(coding.begin(), coding.end(), coding.begin(), ::tolower);
+	if(q != "" && std::atof(q.c_str()) <= 0)
+	  continue;
+	if(coding == "br")
+	  br = true;
+	else if(coding == "gzip" || coding == "x-gzip" || coding == "*")
+	  gzip = true;
       }
+    return br ? "br" : gzip ? "gzip" : "identity";
+  }
+
+  std::string
+  parse_q_value(std::string const & params)
+  {
+    // compiled once, matching with it is safe from every thread
+    static boost::regex const regexPattern("q[[:space:]]*=[[:space:]]*([0-9.]+)", boost::regex::extended | boost::regex::icase);
+    boost::smatch what;
+    if(boost::regex_search(params, what, regexPattern))
+      return what[1];
+    return std::string("");
+  }
+
+  std::string
+  trim(std::string const & s)
+  {
+    auto begin = s.find_first_not_of(" \t");
+    if(begin == std::string::npos)
+      return std::string("");
+    return s.substr(begin, s.find_last_not_of(" \t") - begin + 1);
+  }
+
+  std::string
+  collapse_whitespace(std::string const & s)
+  {
+    std::stringstream ss(s);
+    std::string word, collapsed;
+    while(ss >> word)
+      collapsed += (collapsed == "" ? "" : " ") + word;
+    return collapsed;
   }
 
   bool
   expire_time_string_not_in_GMT_format(std::string time_string)
   {
-    struct tm tm;
+    struct tm tm = {};
         strptime(time_string.c_str(), "%a, %d %b %Y %H:%M:%S %Z", &tm);
     return (mktime(&tm) < 0) ? true : false;
   }
@@ -732,25 +1897,52 @@ public:
 
     if(ec)
       return fail(ec, "on_http_recv_res_from_server", id_);
+    note_written();
+    res_ = {};
+    shared_res_.reset();
+    req_ = {};
+#ifdef COUNT_ALLOCATIONS
+    LOG(access, debug, id_ + "NOTE " + std::to_string(allocations() - allocations_mark_) + " allocations");
+    allocations_mark_ = allocations();
+#endif
         
-    do_http_recv_req_from_client();
+    do_send_pipelined();
   }
 
   void
   do_http_recv_req_from_client()
   {
-    // Make a new request container
-    req_ = std::move(http::request<http::string_body>());
+    // Receive req_ from client; unless it is already buffered the connection
+    // sits under the idle deadline until the request starts
+    on_request_ = &session::on_http_recv_req_from_client;
+    if(cli_http_buffer_.size() > 0)
+      return do_read_request_header();
+    if(draining)
+      return do_close();
+    // nothing buffered: the request gets a buffer once it arrives
+    cli_http_buffer_.shrink_to_fit();
+
+    arm_deadline(timeouts_.idle, "keep-alive idle timeout");
+    cli_sock_.async_wait(
+			 tcp::socket::wait_read,
+			 on_loop(
+				 std::bind(
+					   &session::on_client_readable,
+					   shared_from_this(),
+					   std::placeholders::_1)));
+  }
 
-    // Receive req_ from server
-    http::async_read(cli_sock_, cli_http_buffer_, req_,
-		     boost::asio::bind_executor(
-						strand_,
-						std::bind(
-							  &session::on_http_recv_req_from_client,
-							  shared_from_this(),
-							  std::placeholders::_1,
-							  std::placeholders::_2)));
+  void
+  on_client_readable(boost::system::error_code ec)
+  {
+    if(timed_out_)
+      return;
+    if(ec)
+      {
+	deadline_.cancel();
+	return (this->*on_request_)(ec, 0);
+      }
+    do_read_request_header();
   }
 
   void
@@ -763,6 +1955,7 @@ public:
     // Client closed the connection
     if(ec == http::error::end_of_stream)
       return do_close();
+    note_request();
     if(ec)
       {
 	auto generate_400_BAD_REQUEST_response = []()
@@ -772,103 +1965,612 @@ public:
 	    res.prepare_payload();
 	    return res;
 	  };
-	res_400_BAD_REQUEST = generate_400_BAD_REQUEST_response();
-	res_ = res_400_BAD_REQUEST;
+	res_ = generate_400_BAD_REQUEST_response();
 	do_http_send_res_to_client();
       }else
       {
-	do_http_send_req_to_server();
+	start_pipelined_requests();
+	do_admit_request();
       }
   }
 
+#ifdef COROUTINE_SESSION
+  /////////////////////////////////////////////////////////////////////////////////
+  // Coroutine section: built with -DCOROUTINE_SESSION the session runs as one
+  // stackless coroutine instead of the do_/on_ chains above, they share the rest.
+  // Pipelined requests are answered one after the other, tunnels always copy.
+
+  // resumes the coroutine with what an operation completed with
+  auto
+  resume()
+  {
+    return on_loop(
+		   [self = shared_from_this()](boost::system::error_code ec, auto&&... result)
+		   {
+		     (*self)(ec, transferred(result...));
+		   });
+  }
+
+  static std::size_t transferred() { return 0; }
+  static std::size_t transferred(std::size_t bytes) { return bytes; }
+
   void
-  do_close()
+  operator()(
+	     boost::system::error_code ec = {},
+	     std::size_t bytes_transferred = 0)
   {
-    // Send a TCP shutdown
-    boost::system::error_code ec;
-    log(id_ + "Tunnel closed");
-    srv_sock_.shutdown(tcp::socket::shutdown_both, ec);
-    cli_sock_.shutdown(tcp::socket::shutdown_both, ec);
+    // a deadline closed the sockets, the connect race may still hand one over
+    if(timed_out_)
+      return release_srv_sock();
+
+    BOOST_ASIO_CORO_REENTER(frame_)
+    {
+      for(;;)
+	{
+	  // Receive req_ from client, the first one under the header deadline from the
+	  // moment it connected, later ones under the idle deadline until they start
+	  if(! frame_.first && cli_http_buffer_.size() == 0)
+	    {
+	      if(draining)
+		break;
+	      cli_http_buffer_.shrink_to_fit();
+	      arm_deadline(timeouts_.idle, "keep-alive idle timeout");
+	      BOOST_ASIO_CORO_YIELD cli_sock_.async_wait(tcp::socket::wait_read, resume());
+	      if(ec)
+		{
+		  deadline_.cancel();
+		  return fail(ec, "coroutine wait for request", id_);
+		}
+	    }
+	  req_parser_.emplace();
+	  arm_deadline(timeouts_.header, "header timeout");
+	  BOOST_ASIO_CORO_YIELD http::async_read_header(cli_sock_, cli_http_buffer_, *req_parser_, resume());
+	  if(! ec && ! req_parser_->is_done())
+	    {
+	      arm_deadline(timeouts_.body, "body timeout");
+	      BOOST_ASIO_CORO_YIELD http::async_read(cli_sock_, cli_http_buffer_, *req_parser_, resume());
+	    }
+	  deadline_.cancel();
+	  req_ = req_parser_->release();
+	  req_parser_.reset();
+
+	  // Client closed the connection
+	  if(ec == http::error::end_of_stream)
+	    break;
+	  // like the callback engine, only the request that opened the connection
+	  if(frame_.first)
+	    log_request();
+	  if(ec)
+	    return fail(ec, "coroutine read request", id_);
+	  if(! method_supported())
+	    return fail(ec, "coroutine: method not supported", id_);
+	  frame_.first = false;
+	  note_request();
+
+	  // Hold the request back until its client and the proxy are within their request rates
+	  while(client_limits_ && (frame_.wait = rate_limits_.request_wait(*client_limits_)).count() > 0)
+	    BOOST_ASIO_CORO_YIELD wheel_.schedule(
+						  throttle_,
+						  frame_.wait,
+						  [self = shared_from_this()]()
+						  {
+						    (*self)();
+						  });
+	  timing_.mark(timing_mark::admitted);
+
+	  // A GET looks into the cache before it takes a connection
+	  frame_.fetch = true;
+	  if(req_.method() == http::verb::get)
+	    {
+	      if(! lookup_cache())
+		LOG_EVENT(not_in_cache);
+	      else if(! need_validate())
+		{
+		  LOG_EVENT(cache_valid);
+		  serve_cached(std::move(std::get<cache_hit_phase>(phase_).res));
+		  phase_ = std::monostate();
+		  frame_.fetch = false;
+		}
+	    }
+
+	  // a GET which failed on a pooled connection before any answer comes back here
+	  while(frame_.fetch)
+	    {
+	      frame_.origin = parse_origin(std::string(req_.base()[http::field::host]), req_.method());
+	      if(! reuse_connection(frame_.origin.first + ":" + frame_.origin.second))
+		{
+		  arm_deadline(timeouts_.connect, "connect timeout");
+		  timing_.mark(timing_mark::resolving);
+		  PROXY_PROBE3(connect_start, sid_, sub_, frame_.origin.first.c_str());
+		  BOOST_ASIO_CORO_YIELD dns_cache_.async_resolve(
+								 frame_.origin.first,
+								 frame_.origin.second,
+								 // answered from the main loop's thread, not through handler_memory_
+								 boost::asio::bind_executor(
+											    executor_,
+											    [self = shared_from_this()](boost::system::error_code ec, dns_cache::endpoints results)
+											    {
+											      self->frame_.endpoints = std::move(results);
+											      (*self)(ec);
+											    }));
+		  if(ec)
+		    {
+		      PROXY_PROBE3(connect_end, sid_, sub_, ec.value());
+		      return fail(ec, "coroutine resolve", id_);
+		    }
+		  note_resolved();
+		  BOOST_ASIO_CORO_YIELD async_connect_race(
+							   ioc_,
+							   srv_sock_,
+							   frame_.endpoints,
+							   CONNECT_ATTEMPT_DELAY,
+							   CONNECT_ATTEMPT_TIMEOUT,
+							   [&sockets = sockets_](tcp::socket& sock)
+							   {
+							     apply_upstream_options(sock, sockets);
+							   },
+							   resume());
+		  deadline_.cancel();
+		  PROXY_PROBE3(connect_end, sid_, sub_, ec.value());
+		  if(ec)
+		    return fail(ec, "coroutine connect", id_);
+		  note_connected();
+		}
+	      srv_sock_reusable_ = false;
+	      if(req_.method() == http::verb::connect)
+		break;
+
+	      // Send req_, or the conditional GET for a cached response, to server
+	      timing_.mark(timing_mark::sending);
+	      if(std::holds_alternative<std::monostate>(phase_) || std::holds_alternative<forward_phase>(phase_))
+		{
+		  phase_ = forward_phase();
+		  LOG_EVENT(requesting, std::uint16_t(req_.method()), req_.target(), req_.base()["Host"], req_.version());
+		  res_buffer_ = &std::get<forward_phase>(phase_).buffer;
+		  res_target_ = &res_;
+		  BOOST_ASIO_CORO_YIELD http::async_write(srv_sock_, req_, resume());
+		}
+	      else
+		{
+		  res_buffer_ = &prepare_validation_request().buffer;
+		  res_target_ = &std::get<revalidate_phase>(phase_).res;
+		  BOOST_ASIO_CORO_YIELD http::async_write(srv_sock_, std::get<revalidate_phase>(phase_).req, resume());
+		}
+	      if(ec && pooled_connection_failed(ec))
+		continue;
+	      if(ec)
+		return fail(ec, "coroutine send request", id_);
+	      timing_.mark(timing_mark::sent);
+
+	      // The origin has the first byte deadline to start its answer, after that
+	      // the idle deadline restarts with every chunk
+	      res_parser_.emplace();
+	      res_bytes_ = 0;
+	      if(res_buffer_->size() == 0)
+		{
+		  arm_deadline(timeouts_.first_byte, "first byte timeout");
+		  BOOST_ASIO_CORO_YIELD srv_sock_.async_wait(tcp::socket::wait_read, resume());
+		}
+	      timing_.mark(timing_mark::first_byte);
+	      PROXY_PROBE2(first_byte, sid_, sub_);
+	      while(! ec && ! res_parser_->is_done())
+		{
+		  arm_deadline(timeouts_.idle, "response idle timeout");
+		  BOOST_ASIO_CORO_YIELD http::async_read_some(srv_sock_, *res_buffer_, *res_parser_, resume());
+		  res_bytes_ += bytes_transferred;
+		}
+	      deadline_.cancel();
+	      timing_.mark(timing_mark::received);
+	      *res_target_ = res_parser_->release();
+	      res_parser_.reset();
+	      proxy_metrics.add(metric::upstream_bytes, res_bytes_);
+	      if(ec && pooled_connection_failed(ec))
+		continue;
+	      srv_sock_reused_ = false;
+	      srv_sock_reusable_ = ! ec && ! res_target_->need_eof() && res_buffer_->size() == 0;
+	      break;
+	    }
+
+	  if(req_.method() == http::verb::connect)
+	    break;
+	  if(auto revalidating = std::get_if<revalidate_phase>(&phase_))
+	    {
+	      if(ec)
+		return fail(ec, "coroutine read revalidation", id_);
+	      LOG_EVENT(revalidated, revalidating->res.result_int());
+	      proxy_metrics.add(revalidating->res.result_int() == 304 ? metric::revalidated_not_modified : metric::revalidated_modified);
+	      bool modified = revalidating->res.result_int() != 304;
+	      if(modified)
+		res_ = std::move(revalidating->res);
+	      else
+		serve_cached(std::move(revalidating->cached.res));
+	      phase_ = std::monostate();
+	      if(modified && res_.result_int() == 200)
+		save_res_to_cache();
+	    }
+	  else if(frame_.fetch)
+	    {
+	      phase_ = std::monostate();
+	      // Server closed the connection
+	      if(ec == http::error::end_of_stream)
+		break;
+	      if(ec)
+		{
+		  res_ = {};
+		  res_.result(400);
+		  res_.prepare_payload();
+		}
+	      else
+		{
+		  LOG_EVENT(received, res_.result_int(), {}, req_.base()["Host"], res_.version());
+		  save_res_to_cache();
+		}
+	    }
+
+	  // Send res_ to client, cut to what the flow grants if it is rate limited
+	  note_response();
+	  log_response(id_, sub_, response_out());
+	  if(to_client_flow_)
+	    {
+	      res_serializer_.emplace(response_out());
+	      while(! ec && ! res_serializer_->is_done())
+		{
+		  frame_.granted = to_client_flow_->acquire(
+							    RESPONSE_WRITE_CHUNK,
+							    [self = shared_from_this()](std::size_t granted)
+							    {
+							      self->frame_.granted = granted;
+							      (*self)();
+							    });
+		  if(frame_.granted == 0)
+		    {
+		      BOOST_ASIO_CORO_YIELD;
+		    }
+		  res_serializer_->limit(frame_.granted);
+		  BOOST_ASIO_CORO_YIELD http::async_write_some(cli_sock_, *res_serializer_, resume());
+		  to_client_flow_->give_back(frame_.granted - std::min(frame_.granted, bytes_transferred));
+		}
+	      res_serializer_.reset();
+	    }
+	  else if(shared_res_)
+	    {
+	      res_serializer_.emplace(*shared_res_);
+	      BOOST_ASIO_CORO_YIELD http::async_write(cli_sock_, *res_serializer_, resume());
+	      res_serializer_.reset();
+	    }
+	  else
+	    BOOST_ASIO_CORO_YIELD http::async_write(cli_sock_, res_, resume());
+	  if(ec)
+	    return fail(ec, "coroutine send response", id_);
+	  note_written();
+	  res_ = {};
+	  shared_res_.reset();
+	  req_ = {};
+#ifdef COUNT_ALLOCATIONS
+	  LOG(access, debug, id_ + "NOTE " + std::to_string(allocations() - allocations_mark_) + " allocations");
+	  allocations_mark_ = allocations();
+#endif
+	}
+
+      if(req_.method() == http::verb::connect)
+	{
+	  // 200 OK, MUST NOT HAVE BODY; the tunnel phase keeps it while it is written
+	  phase_ = tunnel_phase();
+	  std::get<tunnel_phase>(phase_).res_200_OK.result(200);
+	  std::get<tunnel_phase>(phase_).res_200_OK.prepare_payload();
+	  BOOST_ASIO_CORO_YIELD http::async_write(cli_sock_, std::get<tunnel_phase>(phase_).res_200_OK, resume());
+	  if(ec)
+	    return fail(ec, "coroutine send 200-OK", id_);
+	  LOG_EVENT(tunnel_ok);
+	  req_ = {};
+
+	  // Both directions run as coroutines of their own, the first to end stops
+	  // the other and the last one resumes us
+	  BOOST_ASIO_CORO_YIELD
+	    {
+	      auto cli_to_srv = std::make_shared<tunnel_direction>(shared_from_this(), sid_, cli_sock_, srv_sock_, to_server_flow_.get(), false);
+	      auto srv_to_cli = std::make_shared<tunnel_direction>(shared_from_this(), sid_, srv_sock_, cli_sock_, to_client_flow_.get(), true);
+	      frame_.directions = 2;
+	      (*cli_to_srv)();
+	      (*srv_to_cli)();
+	      watch_tunnel(cli_to_srv, srv_to_cli);
+	    }
+	}
+      do_close();
+    }
   }
-};
-////////////////////////////////////////////////////////////////////////////////////
-class listener : public std::enable_shared_from_this<listener>
-{
-private:
-  tcp::acceptor acceptor_;
-  tcp::socket srv_sock_;
-  tcp::socket cli_sock_;
-  net::io_context& ioc_;
-  boost::asio::signal_set signals_;
-  LRUCache<std::string, std::pair<http::response<http::dynamic_body>, time_t>>& lru_cache_;
-  unsigned long id;
-  //std::mutex& cache_mutex_;
-  void become_daemon(){
-    signals_.async_wait(
-			boost::bind(&boost::asio::io_service::stop, &ioc_));
 
-    ioc_.notify_fork(boost::asio::io_service::fork_prepare);
+  // One direction of a tunnel, copying from one socket to the other through a buffer
+  // which grows while reads fill it
+  struct tunnel_direction : boost::asio::coroutine, std::enable_shared_from_this<tunnel_direction>
+  {
+    tunnel_direction(
+		     std::shared_ptr<session> s,
+		     std::uint32_t sid,
+		     tcp::socket& from,
+		     tcp::socket& to,
+		     bandwidth_flow* flow,
+		     bool from_server)
+      : s(std::move(s))
+      , sid(sid)
+      , from(from)
+      , to(to)
+      , flow(flow)
+      , from_server(from_server)
+      , buffer(TUNNEL_BUFFER_MIN)
+    {
+    }
+
+    std::size_t
+    total() const
+    {
+      return bytes;
+    }
+
+    auto
+    resume()
+    {
+      return s->on_loop(
+			[self = this->shared_from_this()](boost::system::error_code ec, std::size_t bytes_transferred)
+			{
+			  (*self)(ec, bytes_transferred);
+			});
+    }
 
-    if (pid_t pid = fork())
+    void
+    operator()(
+	       boost::system::error_code ec = {},
+	       std::size_t bytes_transferred = 0)
+    {
+      BOOST_ASIO_CORO_REENTER(*this)
       {
-	if (pid > 0)
-	  {
-	    exit(0);
-	  }
-	else
+	while(! ec && s->frame_.directions == 2)
 	  {
-	    log("Become Daemon: first fork failed");
-	    exit(EXIT_FAILURE);
+	    BOOST_ASIO_CORO_YIELD from.async_read_some(boost::asio::buffer(buffer), resume());
+	    if(ec)
+	      break;
+	    read = bytes_transferred;
+	    for(written = 0; ! ec && written < read && s->frame_.directions == 2; written += bytes_transferred)
+	      {
+		granted = flow ? flow->acquire(
+					       read - written,
+					       [self = this->shared_from_this()](std::size_t granted)
+					       {
+						 self->granted = granted;
+						 // none when the other direction ended meanwhile
+						 (*self)(granted == 0 ? boost::asio::error::operation_aborted : boost::system::error_code());
+					       })
+		  : read - written;
+		if(granted == 0)
+		  {
+		    BOOST_ASIO_CORO_YIELD;
+		    if(ec)
+		      break;
+		  }
+		BOOST_ASIO_CORO_YIELD boost::asio::async_write(to, boost::asio::buffer(buffer.data() + written, granted), resume());
+		bytes += bytes_transferred;
+		PROXY_PROBE4(tunnel_chunk, sid, from.native_handle(), to.native_handle(), bytes_transferred);
+		if(flow)
+		  flow->give_back(granted - std::min(granted, bytes_transferred));
+	      }
+	    if(read == buffer.size() && buffer.size() < TUNNEL_BUFFER_MAX)
+	      buffer.resize(buffer.size() * 2);
 	  }
+	s->on_tunnel_direction_end(ec, from_server);
       }
-    setsid();
-    chdir("/");
-    umask(0);
+    }
+
+    std::shared_ptr<session> s;
+    std::uint32_t sid;	// s->sid_, for the probes
+    tcp::socket& from;
+    tcp::socket& to;
+    bandwidth_flow* flow;	// null unless bytes are rate limited
+    bool from_server;
+    std::vector<char, recycling_allocator<char> > buffer;
+    std::size_t bytes = 0;	// relayed so far
+    std::size_t read = 0;
+    std::size_t written = 0;
+    std::size_t granted = 0;
+  };
 
-    if (pid_t pid = fork())
+  void
+  on_tunnel_direction_end(
+			  boost::system::error_code ec,
+			  bool from_server)
+  {
+    // the other direction may be waiting for its bytes, socket cancels don't reach it
+    if(to_client_flow_)
+      to_client_flow_->cancel();
+    if(to_server_flow_)
+      to_server_flow_->cancel();
+    // after a deadline closed the tunnel both just wind down
+    if(--frame_.directions == 1 && ! timed_out_)
       {
-	if (pid > 0)
-	  {
-	    exit(0);
-	  }
-	else
+	note_tunnel_bytes();
+	if(ec == boost::asio::error::eof || ec == boost::asio::error::connection_reset)
 	  {
-	    log("Become Daemon: second fork failed");
-	    exit(EXIT_FAILURE);
-     
+	    if(from_server)
+	      LOG_EVENT(tunnel_response);
 	  }
+	else if(ec)
+	  fail(ec, from_server ? "tunnel server to client" : "tunnel client to server", id_);
+	// the other direction is waiting on a socket
+	boost::system::error_code ignored;
+	cli_sock_.cancel(ignored);
+	srv_sock_.cancel(ignored);
+	return;
       }
-    close(0);
-    close(1);
-    close(2);
+    (*this)();
+  }
+#endif
 
-    // We don't want the daemon to have any standard input.
-    if (open("/dev/null", O_RDONLY) < 0)
-      {
-	log("Unable to open /dev/null");
-	exit(EXIT_FAILURE);
+  void
+  do_close()
+  {
+    // Send a TCP shutdown
+    boost::system::error_code ec;
+    LOG_EVENT(tunnel_closed);
+    release_srv_sock();
+    cli_sock_.shutdown(tcp::socket::shutdown_both, ec);
+  }
+};
+////////////////////////////////////////////////////////////////////////////////////
+// One event loop per CPU: an io_context run by a single pinned thread, with its own
+// acceptor and upstream connections. Sessions never leave the loop that accepted them.
+struct worker
+{
+  worker(
+	 int cpu,
+	 std::size_t max_idle_per_origin,
+	 std::size_t max_idle_total,
+	 rate_limits& limits)
+    : ioc{1}
+    , conn_pool{ioc, max_idle_per_origin, max_idle_total, UPSTREAM_IDLE_TIMEOUT}
+    , cpu{cpu}
+    , wheel{ioc, TIMER_WHEEL_TICK}
+    , lag_probe{ioc, LOOP_LAG_PROBE_INTERVAL}
+    , bandwidth{ioc, limits, BANDWIDTH_TICK}
+  {
+  }
+
+  void
+  run()
+  {
+    if(cpu >= 0 && ! pin_to_cpu(cpu))
+      log("Worker could not be pinned to CPU " + std::to_string(cpu));
+    ioc.run();
+  }
+
+  net::io_context ioc;
+  upstream_pool conn_pool;
+  int cpu;	// -1 to leave the thread unpinned
+  timer_wheel wheel;	// deadlines of the loop's sessions
+  loop_lag_probe lag_probe;
+  bandwidth_scheduler bandwidth;	// fair shares of the byte rate limits among the loop's sessions
+};
+
+void become_daemon(std::vector<std::unique_ptr<worker> >& workers){
+  for(auto& w : workers)
+    w->ioc.notify_fork(boost::asio::io_service::fork_prepare);
+
+  if (pid_t pid = fork())
+    {
+      if (pid > 0)
+	{
+	  // not exit(): the parent would write out the log lines the child has too
+	  _exit(0);
+	}
+      else
+	{
+	  log("Become Daemon: first fork failed");
+	  exit(EXIT_FAILURE);
+	}
+    }
+  setsid();
+  chdir("/");
+  umask(0);
+
+  if (pid_t pid = fork())
+    {
+      if (pid > 0)
+	{
+	  _exit(0);
+	}
+      else
+	{
+	  log("Become Daemon: second fork failed");
+	  exit(EXIT_FAILURE);
      
-      }
+	}
+    }
+  close(0);
+  close(1);
+  close(2);
+
+  // We don't want the daemon to have any standard input.
+  if (open("/dev/null", O_RDONLY) < 0)
+    {
+      log("Unable to open /dev/null");
+      exit(EXIT_FAILURE);
+     
+    }
     
-    ioc_.notify_fork(boost::asio::io_service::fork_child);
+  for(auto& w : workers)
+    w->ioc.notify_fork(boost::asio::io_service::fork_child);
 
-    // The io_service can now be used normally.
-    log("Daemon started");
-  }
+  // The io_service can now be used normally.
+  log("Daemon started");
+}
+
+#ifdef SO_REUSEPORT
+// lets every worker bind its own acceptor to the same endpoint, the kernel spreads connections
+typedef boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> reuse_port;
+#endif
+
+// session ids are unique across all workers
+std::atomic<unsigned long> next_session_id{0};
+
+class listener : public std::enable_shared_from_this<listener>
+{
+private:
+  tcp::acceptor acceptor_;
+  tcp::socket srv_sock_;
+  tcp::socket cli_sock_;
+  net::io_context& ioc_;
+  response_cache& lru_cache_;
+  upstream_pool& upstream_pool_;
+  dns_cache& dns_cache_;
+  timer_wheel& wheel_;
+  session_timeouts const & timeouts_;
+  socket_options const & sockets_;
+  request_tracing const & tracing_;
+  admission_control& admission_;
+  loop_lag_probe& lag_probe_;
+  std::chrono::milliseconds max_queue_delay_;
+  rate_limits& rate_limits_;
+  bandwidth_scheduler& bandwidth_;
+  boost::asio::steady_timer retry_timer_;
+  //std::mutex& cache_mutex_;
 
 public:
   listener(
 	   boost::asio::io_context& ioc,
-	   tcp::endpoint endpoint,
-	   LRUCache<std::string, std::pair<http::response<http::dynamic_body>, time_t>>& lru_cache)
+	   response_cache& lru_cache,
+	   upstream_pool& upstream_pool,
+	   dns_cache& dns_cache,
+	   timer_wheel& wheel,
+	   session_timeouts const & timeouts,
+	   socket_options const & sockets,
+	   request_tracing const & tracing,
+	   admission_control& admission,
+	   loop_lag_probe& lag_probe,
+	   std::chrono::milliseconds max_queue_delay,
+	   rate_limits& rate_limits,
+	   bandwidth_scheduler& bandwidth)
     : acceptor_{ioc}
     , srv_sock_{ioc}
     , cli_sock_{ioc}
     , ioc_{ioc}
-    , signals_{ioc_, SIGINT, SIGTERM, SIGHUP}
     , lru_cache_{lru_cache}
-    , id{0}
+    , upstream_pool_{upstream_pool}
+    , dns_cache_{dns_cache}
+    , wheel_{wheel}
+    , timeouts_{timeouts}
+    , sockets_{sockets}
+    , tracing_{tracing}
+    , admission_{admission}
+    , lag_probe_{lag_probe}
+    , max_queue_delay_{max_queue_delay}
+    , rate_limits_(rate_limits)
+    , bandwidth_(bandwidth)
+    , retry_timer_{ioc}
       //, cache_mutex_{cache_mutex}
+  {
+  }
+
+  // false if a listening socket on endpoint couldn't be set up
+  bool
+  listen(tcp::endpoint endpoint)
   {
     boost::system::error_code ec;
 
@@ -876,47 +2578,125 @@ public:
     if(ec)
       {
 	fail(ec, "open acceptor, listener init", "(no id)");
-	return;
+	return false;
       }
 
     acceptor_.set_option(boost::asio::socket_base::reuse_address(true), ec);
     if(ec)
       {
 	fail(ec, "acceptor set_option, listener init","(no id)");
-	return;
+	acceptor_.close(ec);
+	return false;
+      }
+
+#ifdef SO_REUSEPORT
+    acceptor_.set_option(reuse_port(true), ec);
+    if(ec)
+      {
+	fail(ec, "acceptor set_option reuse_port, listener init","(no id)");
+	acceptor_.close(ec);
+	return false;
+      }
+#endif
+
+    apply_listener_options(acceptor_, sockets_, ec);
+    if(ec)
+      {
+	fail(ec, "acceptor socket options, listener init","(no id)");
+	acceptor_.close(ec);
+	return false;
       }
         
     acceptor_.bind(endpoint, ec);
     if(ec)
       {
 	fail(ec, "bind acceptor, listener init","(no id)");
-	return;
+	acceptor_.close(ec);
+	return false;
       }
-            
-    become_daemon();
 	
     acceptor_.listen(
 		     boost::asio::socket_base::max_listen_connections, ec);
     if(ec)
       {
 	fail(ec, "listen acceptor, listener init", "(no id)");
-	return;
+	acceptor_.close(ec);
+	return false;
+      }
+    return true;
+  }
+
+  // Accept on a listening socket the previous process handed over
+  bool
+  adopt(int fd)
+  {
+    boost::system::error_code ec;
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    if(getsockname(fd, reinterpret_cast<struct sockaddr*>(&addr), &len) != 0)
+      {
+	fail(boost::system::error_code(errno, boost::system::system_category()), "adopt acceptor, listener init", "(no id)");
+	return false;
       }
-            
+    acceptor_.assign(addr.ss_family == AF_INET6 ? tcp::v6() : tcp::v4(), fd, ec);
+    if(ec)
+      {
+	fail(ec, "adopt acceptor, listener init", "(no id)");
+	return false;
+      }
+    return true;
   }
 
+  // Stop accepting, on the listener's own loop. A socket shared with a new process
+  // keeps listening there.
   void
+  stop()
+  {
+    boost::asio::post(
+		      ioc_,
+		      [self = shared_from_this()]()
+		      {
+			boost::system::error_code ec;
+			self->acceptor_.close(ec);
+			self->retry_timer_.cancel();
+		      });
+  }
+
+  int
+  native_handle()
+  {
+    return acceptor_.native_handle();
+  }
+
+  // false if the acceptor couldn't be set up
+  bool
   run()
   {
     if(! acceptor_.is_open())
-      return;
+      return false;
 
     do_accept();
+    return true;
   }
 
   void
   do_accept()
   {
+    if(! acceptor_.is_open())
+      return;
+    // with every slot taken new connections wait in the kernel's backlog
+    auto self = shared_from_this();
+    if(! admission_.when_room(
+			      [self]()
+			      {
+				boost::asio::post(
+						  self->ioc_,
+						  std::bind(
+							    &listener::do_accept,
+							    self));
+			      }))
+      return;
+
     acceptor_.async_accept(
 			   cli_sock_,
 			   std::bind(
@@ -928,18 +2708,59 @@ public:
   void
   on_accept(boost::system::error_code ec)
   {
+    if(ec && ! acceptor_.is_open())
+      return;
     if(ec)
-      return fail(ec, "on_accept", "(no id)");
+      {
+	// keep the listener alive, e.g. out of descriptors until some sessions end
+	fail(ec, "on_accept", "(no id)");
+	retry_timer_.expires_after(ACCEPT_RETRY_DELAY);
+	return retry_timer_.async_wait(
+				       std::bind(
+						 &listener::on_retry_accept,
+						 shared_from_this(),
+						 std::placeholders::_1));
+      }
 
-	
-    std::make_shared<session>(
-			      std::move(srv_sock_),
-			      std::move(cli_sock_),
-			      ioc_,
-			      lru_cache_,
-			      id)->run();
-
-    id++;
+    // the sessions we have keep their latency, newcomers get a cheap 503 instead
+    auto client = cli_sock_.remote_endpoint(ec).address();
+    auto ticket = admission_.admit(client);
+    bool lagging = max_queue_delay_.count() > 0 && lag_probe_.lag() > max_queue_delay_;
+    if(! ticket || lagging)
+      {
+	LOG(errors, info, "NOTE shedding connection from " + client.to_string() +
+	    (lagging ? ", event loop lagging " + std::to_string(lag_probe_.lag().count()) + "ms"
+	     : ", too many sessions"));
+	shed_connection(ioc_, std::move(cli_sock_));
+	return do_accept();
+      }
+
+    apply_connection_options(cli_sock_, sockets_);
+    std::allocate_shared<session>(
+				  recycling_allocator<session>(),
+				  std::move(srv_sock_),
+				  std::move(cli_sock_),
+				  ioc_,
+				  lru_cache_,
+				  upstream_pool_,
+				  dns_cache_,
+				  wheel_,
+				  timeouts_,
+				  sockets_,
+				  tracing_,
+				  std::move(ticket),
+				  rate_limits_,
+				  bandwidth_,
+				  next_session_id++)->run();
+
+    do_accept();
+  }
+
+  void
+  on_retry_accept(boost::system::error_code ec)
+  {
+    if(ec)
+      return;
     do_accept();
   }
 };
@@ -947,41 +2768,285 @@ public:
 
 int main(int argc, char* argv[])
 {
-  log_.open(LOG_FILE_PATH,std::fstream::in | std::fstream::out | std::fstream::trunc);
-  if(!log_.is_open()){
+  proxy_config config;
+  config.log_file = LOG_FILE_PATH;
+  std::string error;
+  if(! parse_command_line(config, argc, argv, error)){
+    cerr << error << "\n" << config_usage;
+    exit(EXIT_FAILURE);
+  }
+
+  // one loop per CPU we may use unless the thread count is given
+  auto cpus = worker_cpus(config, error);
+  if(! error.empty()){
+    cerr << error << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  auto const threads = config.threads > 0 ? config.threads : std::max<int>(1, cpus.size());
+  log_filter.apply(config.logging);
+
+  boost::system::error_code ec;
+  auto const address = net::ip::make_address(config.address, ec);
+  if(ec){
+    cerr << "bad listen address " << config.address << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  auto const port = config.port;
+
+  // a process already serving on the upgrade socket hands its listening sockets and
+  // its cache over, both processes write the same log for a while
+  std::vector<int> inherited_fds;
+  int cache_fd = -1;
+  std::size_t cache_size = 0;
+  int predecessor = -1;
+  if(! config.upgrade_socket.empty())
+    predecessor = take_over(config.upgrade_socket, PROXY_UID, inherited_fds, cache_fd, cache_size);
+
+  if(! logger.open(config.log_file, predecessor < 0)){
     cerr << "log file can't be opened/created" << std::endl;
     exit(EXIT_FAILURE);
   }
+  // a successor carries on in the events its predecessor wrote
+  if(! config.binary_log.empty() &&
+     ! binary_events.open(config.binary_log, config.binary_log_mb << 20, predecessor < 0, error)){
+    cerr << "binary log can't be opened/created: " << error << std::endl;
+    exit(EXIT_FAILURE);
+  }
 
   //drop root privilege after open the file
-  setuid(1001);
+  setuid(PROXY_UID);
+
+  // splice(2) into a reset tunnel socket raises SIGPIPE, it has no MSG_NOSIGNAL
+  signal(SIGPIPE, SIG_IGN);
 
   std::cout << "Server start\n" << std::endl;
   log("Server start");
-  //start listen and receive request from client
-  auto const address = net::ip::make_address("127.0.0.1");
-  auto const port = static_cast<unsigned short>(std::atoi("12345"));
-  auto const threads = std::max<int>(1, std::atoi("4"));
+  log("Listening on " + config.address + ":" + std::to_string(port) + " with " + std::to_string(threads) + " threads");
 
-  LRUCache<std::string, std::pair<http::response<http::dynamic_body>, time_t>> lru_cache{CACHE_LINES};
+  response_cache lru_cache{CACHE_LINES};
   //std::mutex cache_mutex;
-    
-  net::io_context ioc{threads};
-    
-  std::make_shared<listener>(
-			     ioc,
-			     tcp::endpoint(address, port),
-			     lru_cache)->run();
+  if(predecessor >= 0)
+    {
+      std::size_t cached = 0;
+      if(cache_fd >= 0)
+	{
+	  cached = import_cache(cache_fd, cache_size, lru_cache);
+	  ::close(cache_fd);
+	}
+      log("Took over " + std::to_string(inherited_fds.size()) + " listening sockets and " + std::to_string(cached) + " cached responses");
+    }
+
+  // sessions hold on to these, they go after the workers
+  raise_descriptor_limit();
+  if(config.admission.max_sessions == 0)
+    config.admission.max_sessions = default_max_sessions();
+  admission_control admission{config.admission.max_sessions, config.admission.max_sessions_per_client};
+  log("Admitting " + (config.admission.max_sessions ? std::to_string(config.admission.max_sessions) : std::string("unlimited")) + " concurrent sessions");
+  rate_limits limits{
+    config.rates.requests_per_client,
+    config.rates.bytes_per_client,
+    config.rates.requests_total,
+    config.rates.bytes_total,
+    BANDWIDTH_QUANTUM};
+
+  // worker i is pinned to the i-th CPU; with more workers than CPUs they wrap around
+  std::vector<std::unique_ptr<worker> > workers;
+  for(int i = 0; i < threads; i++)
+    workers.emplace_back(new worker(
+				    cpus.empty() ? -1 : cpus[i % cpus.size()],
+				    UPSTREAM_MAX_IDLE_PER_ORIGIN,
+				    std::max<std::size_t>(1, UPSTREAM_MAX_IDLE_TOTAL / threads),
+				    limits));
+
+  // name resolution stays shared, it posts answers back to the asking session's loop
+  auto& main_ioc = workers.front()->ioc;
+  dns_client resolver{main_ioc, DNS_RESOLV_CONF, DNS_HOSTS_FILE};
+  dns_cache dns{main_ioc, resolver, DNS_MIN_TTL, DNS_MAX_TTL, DNS_MAX_ENTRIES};
+  binary_events.run(main_ioc, EVENT_LOG_CALIBRATE_INTERVAL);
+
+  boost::asio::signal_set signals{main_ioc, SIGINT, SIGTERM};
+  signals.async_wait(
+		     [&workers](boost::system::error_code, int)
+		     {
+		       for(auto& w : workers)
+			 w->ioc.stop();
+		     });
+
+  // SIGHUP after logrotate moved the log away: go on in a new file under its name,
+  // with the log levels the config file has now
+  boost::asio::signal_set hangup{main_ioc, SIGHUP};
+  std::function<void(boost::system::error_code, int)> on_hangup =
+    [&hangup, &on_hangup, &config, argc, argv](boost::system::error_code ec, int)
+    {
+      if(ec)
+	return;
+      logger.reopen();
+      log_settings logging;
+      std::string error;
+      if(reload_log_settings(config, argc, argv, logging, error))
+	log_filter.apply(logging);
+      else
+	log("NOTE log levels unchanged: " + error);
+      hangup.async_wait(on_hangup);
+    };
+  hangup.async_wait(on_hangup);
+
+#ifdef PROFILE_LOCKS
+  // SIGUSR1: what the locks cost so far, a line per lock into the log
+  boost::asio::signal_set user1{main_ioc, SIGUSR1};
+  std::function<void(boost::system::error_code, int)> on_user1 =
+    [&user1, &on_user1](boost::system::error_code ec, int)
+    {
+      if(ec)
+	return;
+      for(auto const & line : lock_profile_report())
+	log("NOTE " + line);
+      user1.async_wait(on_user1);
+    };
+  user1.async_wait(on_user1);
+#endif
+
+  become_daemon(workers);
+  logger.start();
+
+  // listener k runs on worker k % threads and adopts the k-th inherited socket if
+  // there is one, a predecessor with more threads leaves us more sockets than workers
+  std::vector<std::shared_ptr<listener> > listeners;
+  auto const listener_count = std::max<std::size_t>(workers.size(), inherited_fds.size());
+  for(std::size_t k = 0; k < listener_count; k++)
+    {
+      auto& w = workers[k % workers.size()];
+      auto l = std::make_shared<listener>(
+					  w->ioc,
+					  lru_cache,
+					  w->conn_pool,
+					  dns,
+					  w->wheel,
+					  config.timeouts,
+					  config.sockets,
+					  config.tracing,
+					  admission,
+					  w->lag_probe,
+					  config.admission.max_queue_delay,
+					  limits,
+					  w->bandwidth);
+      bool ok = k < inherited_fds.size() ? l->adopt(inherited_fds[k]) : l->listen(tcp::endpoint(address, port));
+      if(! ok || ! l->run())
+	{
+#ifdef SO_REUSEPORT
+	  return EXIT_FAILURE;
+#else
+	  // without SO_REUSEPORT only the first worker can own the endpoint
+	  if(k == 0)
+	    return EXIT_FAILURE;
+	  break;
+#endif
+	}
+      listeners.push_back(l);
+    }
+  for(auto& w : workers)
+    {
+      w->conn_pool.run();
+      w->lag_probe.run();
+    }
+
+  // the metrics on the admin port, gauges read when asked for
+  std::shared_ptr<admin_server> admin;
+  if(config.admin_port)
+    {
+      admin = std::make_shared<admin_server>(
+					     main_ioc,
+					     [&admission, &lru_cache]()
+					     {
+					       std::string events;
+					       if(binary_events.enabled())
+						 events = "# TYPE proxy_event_log_string_restarts_total counter\nproxy_event_log_string_restarts_total " +
+						   std::to_string(binary_events.string_restarts()) +
+						   "\n# TYPE proxy_event_log_strings_dropped_total counter\nproxy_event_log_strings_dropped_total " +
+						   std::to_string(binary_events.strings_dropped()) + "\n";
+					       std::string locks;
+#ifdef PROFILE_LOCKS
+					       locks = lock_profile_prometheus();
+#endif
+					       return proxy_metrics.prometheus(
+									       "# TYPE proxy_sessions gauge\nproxy_sessions " + std::to_string(admission.active()) +
+									       "\n# TYPE proxy_open_fds gauge\nproxy_open_fds " + std::to_string(open_fds()) +
+									       "\n# TYPE proxy_cache_entries gauge\nproxy_cache_entries " + std::to_string(lru_cache.size()) +
+									       "\n# TYPE proxy_log_dropped_lines_total counter\nproxy_log_dropped_lines_total " + std::to_string(logger.dropped()) + "\n" +
+									       events + locks);
+					     });
+      auto const admin_address = net::ip::make_address(config.admin_address, ec);
+      if(! ec)
+	admin->listen(tcp::endpoint(admin_address, config.admin_port), ec);
+      if(ec)
+	{
+	  log("NOTE no admin port " + config.admin_address + ":" + std::to_string(config.admin_port) + ": " + ec.message());
+	  admin.reset();
+	}
+      else
+	admin->run();
+    }
+  if(predecessor >= 0)
+    finish_take_over(predecessor);
+
+  // The next process takes over on the upgrade socket. Then this one stops accepting
+  // and serves what it has until the sessions end or the drain timeout passes.
+  if(! config.upgrade_socket.empty())
+    {
+      auto handoff = std::make_shared<handoff_server>(
+						      main_ioc,
+						      config.upgrade_socket,
+						      lru_cache,
+						      [&listeners]()
+						      {
+							std::vector<int> fds;
+							for(auto& l : listeners)
+							  fds.push_back(l->native_handle());
+							return fds;
+						      },
+						      [&]()
+						      {
+							log("NOTE handed over to the new process, draining");
+							draining = true;
+							for(auto& l : listeners)
+							  l->stop();
+							if(admin)
+							  admin->stop();
+							std::make_shared<drain_monitor>(
+											main_ioc,
+											[&admission]() { return admission.active(); },
+											config.drain_timeout,
+											[&workers](std::size_t left)
+											{
+											  if(left == 0)
+											    log("Drained, exiting");
+											  else
+											    log("Drain timeout passed with " + std::to_string(left) + " sessions left, exiting");
+											  for(auto& w : workers)
+											    w->ioc.stop();
+											})->run();
+						      },
+						      [](std::string const & note)
+						      {
+							log("NOTE " + note);
+						      });
+      if(! handoff->run(ec))
+	fail(ec, "upgrade socket", "(no id)");
+    }
 
   std::vector<std::thread> v;
   v.reserve(threads - 1);
-  for(auto i = threads - 1; i > 0; --i)
+  for(auto i = 1; i < threads; ++i)
     v.emplace_back(
-		   [&ioc]
+		   [&workers, i]
 		   {
-		     ioc.run();
+		     workers[i]->run();
 		   });
-  ioc.run();
+  workers.front()->run();
+  for(auto& t : v)
+    t.join();
+  binary_events.stop();
+  logger.stop();
     
   return EXIT_SUCCESS;    
 }
@@ -0,0 +1,435 @@
+#include <boost/asio.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Tokens trickle in at rate per second and pile up to burst. Shared between loops.
+class token_bucket
+{
+public:
+  // rate 0 means unlimited
+  token_bucket(double rate, double burst)
+    : rate_{rate}
+    , burst_{burst}
+    , tokens_{burst}
+    , last_{std::chrono::steady_clock::now()}
+  {
+  }
+
+  bool
+  unlimited() const
+  {
+    return rate_ <= 0;
+  }
+
+  double
+  burst() const
+  {
+    return burst_;
+  }
+
+  // all n tokens or none
+  bool
+  take(double n)
+  {
+    if(unlimited())
+      return true;
+    std::lock_guard<proxy_mutex> lock(bucket_mutex);
+    refill();
+    if(tokens_ < n)
+      return false;
+    tokens_ -= n;
+    return true;
+  }
+
+  void
+  give_back(double n)
+  {
+    if(unlimited())
+      return;
+    std::lock_guard<proxy_mutex> lock(bucket_mutex);
+    tokens_ = std::min(burst_, tokens_ + n);
+  }
+
+  // as good as a new bucket
+  bool
+  full()
+  {
+    if(unlimited())
+      return true;
+    std::lock_guard<proxy_mutex> lock(bucket_mutex);
+    refill();
+    return tokens_ >= burst_;
+  }
+
+  // until n tokens will be there
+  std::chrono::milliseconds
+  wait_for(double n)
+  {
+    if(unlimited())
+      return std::chrono::milliseconds(0);
+    std::lock_guard<proxy_mutex> lock(bucket_mutex);
+    refill();
+    if(tokens_ >= n)
+      return std::chrono::milliseconds(0);
+    return std::chrono::milliseconds(static_cast<long>(std::ceil((n - tokens_) * 1000 / rate_)));
+  }
+
+private:
+  void
+  refill()
+  {
+    auto now = std::chrono::steady_clock::now();
+    std::chrono::duration<double> elapsed = now - last_;
+    last_ = now;
+    tokens_ = std::min(burst_, tokens_ + elapsed.count() * rate_);
+  }
+
+  double rate_;
+  double burst_;
+  double tokens_;
+  std::chrono::steady_clock::time_point last_;
+  proxy_mutex bucket_mutex{"rate_limit_bucket"};
+};
+
+// Request and byte budgets of the whole proxy and of every client address.
+// Byte buckets hold at least one scheduling quantum so any grant can be met.
+class rate_limits
+{
+public:
+  struct client
+  {
+    client(double requests_rate, double bytes_rate, double bytes_burst)
+      : requests{requests_rate, std::max(1.0, requests_rate)}
+      , bytes{bytes_rate, bytes_burst}
+    {
+    }
+
+    token_bucket requests;
+    token_bucket bytes;
+  };
+
+  // rates per second, 0 is unlimited
+  rate_limits(
+	      double requests_per_client,
+	      double bytes_per_client,
+	      double requests_total,
+	      double bytes_total,
+	      std::size_t quantum)
+    : requests_per_client_{requests_per_client}
+    , bytes_per_client_{bytes_per_client}
+    , quantum_{quantum}
+    , requests_{requests_total, std::max(1.0, requests_total)}
+    , bytes_{bytes_total, burst(bytes_total)}
+  {
+  }
+
+  bool
+  limits_bytes() const
+  {
+    return bytes_per_client_ > 0 || ! bytes_.unlimited();
+  }
+
+  bool
+  limits_requests() const
+  {
+    return requests_per_client_ > 0 || ! requests_.unlimited();
+  }
+
+  token_bucket&
+  bytes()
+  {
+    return bytes_;
+  }
+
+  std::size_t
+  quantum() const
+  {
+    return quantum_;
+  }
+
+  // The buckets of address, shared by all its sessions. They outlive the sessions
+  // until they are full again, a client can't reset them by reconnecting.
+  std::shared_ptr<client>
+  for_client(boost::asio::ip::address const & address)
+  {
+    std::lock_guard<proxy_mutex> lock(clients_mutex);
+    auto& c = clients_[address.to_string()];
+    if(c)
+      return c;
+
+    // before the map grows, forget clients without sessions whose buckets refilled
+    if(clients_.size() > std::max<std::size_t>(1024, 2 * kept_))
+      {
+	for(auto it = clients_.begin(); it != clients_.end(); )
+	  if(it->second && it->second.use_count() == 1 && it->second->requests.full() && it->second->bytes.full())
+	    it = clients_.erase(it);
+	  else
+	    ++it;
+	kept_ = clients_.size();
+      }
+    auto created = std::make_shared<client>(requests_per_client_, bytes_per_client_, burst(bytes_per_client_));
+    clients_[address.to_string()] = created;
+    return created;
+  }
+
+  // 0 if c may send a request now, else how long to wait before asking again
+  std::chrono::milliseconds
+  request_wait(client& c)
+  {
+    if(! c.requests.take(1))
+      return std::max(std::chrono::milliseconds(1), c.requests.wait_for(1));
+    if(! requests_.take(1))
+      {
+	c.requests.give_back(1);
+	return std::max(std::chrono::milliseconds(1), requests_.wait_for(1));
+      }
+    return std::chrono::milliseconds(0);
+  }
+
+private:
+  // a tenth of a second worth of bytes, never less than a quantum
+  double
+  burst(double rate) const
+  {
+    return std::max(rate / 10, static_cast<double>(quantum_));
+  }
+
+  double requests_per_client_;
+  double bytes_per_client_;
+  std::size_t quantum_;
+  token_bucket requests_;
+  token_bucket bytes_;
+  std::unordered_map<std::string, std::shared_ptr<client> > clients_;
+  std::size_t kept_ = 0;	// clients left after the last pruning
+  proxy_mutex clients_mutex{"rate_limit_clients"};
+};
+
+class bandwidth_scheduler;
+
+// One direction of a session that sends shaped bytes. It asks for permission
+// to write before every write; the answer is how much it may write.
+class bandwidth_flow
+{
+public:
+  typedef std::function<void(std::size_t)> grant_handler;
+
+  bandwidth_flow(bandwidth_scheduler& scheduler, std::shared_ptr<rate_limits::client> client)
+    : scheduler_(scheduler)
+    , client_{client}
+    , want_{0}
+    , waiting_{false}
+  {
+  }
+
+  bandwidth_flow(bandwidth_flow const &) = delete;
+  bandwidth_flow& operator=(bandwidth_flow const &) = delete;
+
+  ~bandwidth_flow();
+
+  // Bytes the caller may write now, at most want. 0 means the flow has to wait
+  // its turn and granted(bytes) is called later on the loop.
+  std::size_t acquire(std::size_t want, grant_handler granted);
+
+  // what a write didn't use of its grant
+  void give_back(std::size_t bytes);
+
+  // Stop waiting for a grant: the flow leaves its place in the queue and granted(0)
+  // is posted to the loop, 0 being no grant. Nothing happens unless it waits.
+  void cancel();
+
+private:
+  friend class bandwidth_scheduler;
+  bandwidth_scheduler& scheduler_;
+  std::shared_ptr<rate_limits::client> client_;
+  std::size_t want_;
+  grant_handler granted_;
+  bool waiting_;
+  std::list<bandwidth_flow*>::iterator position_;
+};
+
+// Shares the byte budget among the flows of one event loop round robin: while the
+// global bucket runs dry, waiting flows are visited in turn every tick and each gets
+// at most one quantum per round, all of it or nothing. A flow writing less than a
+// quantum, like a small response, is done within its first round instead of queueing
+// behind a bulk transfer. A flow takes its bytes right away while its client's bucket
+// and the global one have them; it queues behind the others only once the global
+// bucket is short, and on its own when its client's bucket is.
+class bandwidth_scheduler
+{
+public:
+  bandwidth_scheduler(
+		      boost::asio::io_context& ioc,
+		      rate_limits& limits,
+		      std::chrono::milliseconds tick)
+    : timer_{ioc}
+    , limits_(limits)
+    , tick_{tick}
+    , ticking_{false}
+    , global_short_{false}
+  {
+  }
+
+  // flows outliving the scheduler must not touch it any more
+  ~bandwidth_scheduler()
+  {
+    for(auto f : waiting_)
+      f->waiting_ = false;
+  }
+
+private:
+  friend class bandwidth_flow;
+
+  std::size_t
+  acquire(bandwidth_flow& f, std::size_t want, bandwidth_flow::grant_handler granted)
+  {
+    std::size_t grant = grant_size(f, want);
+    // nobody waits for the global bucket: take it right away if the buckets have it
+    if(! global_short_ && f.client_->bytes.take(grant))
+      {
+	if(limits_.bytes().take(grant))
+	  return grant;
+	f.client_->bytes.give_back(grant);
+	global_short_ = true;
+      }
+
+    f.want_ = want;
+    f.granted_ = std::move(granted);
+    f.waiting_ = true;
+    f.position_ = waiting_.insert(waiting_.end(), &f);
+    if(! ticking_)
+      do_tick();
+    return 0;
+  }
+
+  void
+  remove(bandwidth_flow& f)
+  {
+    if(! f.waiting_)
+      return;
+    waiting_.erase(f.position_);
+    f.waiting_ = false;
+  }
+
+  std::size_t
+  grant_size(bandwidth_flow& f, std::size_t want)
+  {
+    std::size_t grant = std::min(want, limits_.quantum());
+    if(! limits_.bytes().unlimited())
+      grant = std::min(grant, static_cast<std::size_t>(limits_.bytes().burst()));
+    if(! f.client_->bytes.unlimited())
+      grant = std::min(grant, static_cast<std::size_t>(f.client_->bytes.burst()));
+    return std::max<std::size_t>(1, grant);
+  }
+
+  void
+  give_back(bandwidth_flow& f, std::size_t bytes)
+  {
+    f.client_->bytes.give_back(bytes);
+    limits_.bytes().give_back(bytes);
+  }
+
+  void
+  do_tick()
+  {
+    ticking_ = true;
+    timer_.expires_after(tick_);
+    timer_.async_wait(
+		      [this](boost::system::error_code ec)
+		      {
+			if(ec)
+			  return;
+			on_tick();
+		      });
+  }
+
+  // one round: every waiting flow in turn, a flow whose client is out of tokens
+  // keeps its place for the next round, an empty global bucket ends the round
+  void
+  on_tick()
+  {
+    std::vector<std::pair<bandwidth_flow::grant_handler, std::size_t> > grants;
+    global_short_ = false;
+    for(std::size_t n = waiting_.size(); n > 0 && ! waiting_.empty(); n--)
+      {
+	auto& f = *waiting_.front();
+	waiting_.pop_front();
+	std::size_t grant = grant_size(f, f.want_);
+	if(! f.client_->bytes.take(grant))
+	  {
+	    f.position_ = waiting_.insert(waiting_.end(), &f);
+	    continue;
+	  }
+	if(! limits_.bytes().take(grant))
+	  {
+	    f.client_->bytes.give_back(grant);
+	    waiting_.push_front(&f);
+	    f.position_ = waiting_.begin();
+	    global_short_ = true;
+	    break;
+	  }
+	f.waiting_ = false;
+	grants.emplace_back(std::move(f.granted_), grant);
+      }
+
+    ticking_ = false;
+    if(! waiting_.empty())
+      do_tick();
+    // flows may ask again from inside their handler
+    for(auto& g : grants)
+      g.first(g.second);
+  }
+
+  boost::asio::steady_timer timer_;
+  rate_limits& limits_;
+  std::chrono::milliseconds tick_;
+  bool ticking_;
+  bool global_short_;	// flows wait for the global bucket, newcomers queue behind them
+  std::list<bandwidth_flow*> waiting_;	// in round robin order
+};
+
+inline
+bandwidth_flow::~bandwidth_flow()
+{
+  if(waiting_)
+    scheduler_.remove(*this);
+}
+
+inline
+std::size_t
+bandwidth_flow::acquire(std::size_t want, grant_handler granted)
+{
+  return scheduler_.acquire(*this, want, std::move(granted));
+}
+
+inline
+void
+bandwidth_flow::give_back(std::size_t bytes)
+{
+  if(bytes > 0)
+    scheduler_.give_back(*this, bytes);
+}
+
+inline
+void
+bandwidth_flow::cancel()
+{
+  if(! waiting_)
+    return;
+  scheduler_.remove(*this);
+  boost::asio::post(
+		    scheduler_.timer_.get_executor(),
+		    [granted = std::move(granted_)]()
+		    {
+		      granted(0);
+		    });
+  granted_ = nullptr;
+}
@@ -0,0 +1,172 @@
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+// Where a request is on its way through a session, in the order it passes them.
+// A request passes some only: a cache hit never resolves, a POST never looks up.
+enum class timing_mark : std::uint8_t
+{
+  read,		// the request is in
+  admitted,	// within the request rates
+  looked_up,	// the cache answered
+  resolving,
+  resolved,
+  connected,
+  sending,	// to the origin
+  sent,
+  first_byte,	// of the origin's response
+  received,	// all of it
+  responding,	// to the client
+  written,
+  count
+};
+
+char const* const timing_mark_names[] = {
+  "read", "admitted", "looked up", "resolving", "resolved", "connected",
+  "sending", "sent", "first byte", "received", "responding", "written"
+};
+static_assert(sizeof(timing_mark_names) / sizeof(timing_mark_names[0]) == std::size_t(timing_mark::count), "a name for every mark");
+
+// The spans between marks a request's time is broken down into
+enum class timing_phase : std::uint8_t
+{
+  wait,		// held back by the request rates
+  cache,
+  dns,
+  connect,
+  send,		// the request to the origin
+  ttfb,		// the origin thinking, sent until its first byte
+  transfer,	// the rest of its response
+  write,	// the response to the client
+  total,	// read until the last mark
+  count
+};
+
+struct timing_span
+{
+  char const* name;
+  timing_mark from;
+  timing_mark to;
+};
+
+timing_span const timing_phases[] = {
+  {"wait", timing_mark::read, timing_mark::admitted},
+  {"cache", timing_mark::admitted, timing_mark::looked_up},
+  {"dns", timing_mark::resolving, timing_mark::resolved},
+  {"connect", timing_mark::resolved, timing_mark::connected},
+  {"send", timing_mark::sending, timing_mark::sent},
+  {"ttfb", timing_mark::sent, timing_mark::first_byte},
+  {"transfer", timing_mark::first_byte, timing_mark::received},
+  {"write", timing_mark::responding, timing_mark::written},
+  {"total", timing_mark::read, timing_mark::count}
+};
+static_assert(sizeof(timing_phases) / sizeof(timing_phases[0]) == std::size_t(timing_phase::count), "a span for every phase");
+
+// "1.234", microseconds as milliseconds
+inline std::string
+timing_ms(std::uint64_t us)
+{
+  char buffer[32];
+  std::snprintf(buffer, sizeof(buffer), "%.3f", us / 1000.0);
+  return buffer;
+}
+
+// The monotonic time a request passed each mark. A mark passed again, say by a
+// retry on a new connection, keeps the later time.
+class request_timing
+{
+public:
+  typedef std::chrono::steady_clock clock;
+
+  request_timing()
+    : marked_{0}
+  {
+  }
+
+  // a new request, read at t; forgets the previous one
+  void
+  start(clock::time_point t = clock::now())
+  {
+    marked_ = 0;
+    mark(timing_mark::read, t);
+  }
+
+  void
+  mark(timing_mark m, clock::time_point t = clock::now())
+  {
+    at_[int(m)] = t;
+    marked_ |= 1u << int(m);
+  }
+
+  void
+  clear(timing_mark m)
+  {
+    marked_ &= ~(1u << int(m));
+  }
+
+  bool
+  has(timing_mark m) const
+  {
+    return marked_ & (1u << int(m));
+  }
+
+  // The length of phase p, false if the request didn't pass both its marks
+  bool
+  span(timing_phase p, clock::duration& d) const
+  {
+    auto const & s = timing_phases[int(p)];
+    auto to = p == timing_phase::total ? last() : s.to;
+    if(! has(s.from) || to == timing_mark::count || ! has(to))
+      return false;
+    d = at_[int(to)] - at_[int(s.from)];
+    return true;
+  }
+
+  static std::uint64_t
+  microseconds(clock::duration d)
+  {
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+    return us > 0 ? std::uint64_t(us) : 0;
+  }
+
+  // "cache;dur=0.012, ttfb;dur=5.310, total;dur=5.402", the Server-Timing
+  // header of the phases so far, in milliseconds
+  std::string
+  server_timing() const
+  {
+    std::string out;
+    clock::duration d;
+    for(int p = 0; p < int(timing_phase::count); p++)
+      if(span(timing_phase(p), d))
+	out += (out.empty() ? "" : ", ") + std::string(timing_phases[p].name) + ";dur=" + timing_ms(microseconds(d));
+    return out;
+  }
+
+  // "read +0.000ms, admitted +0.004ms, ...", every mark passed since the request was read
+  std::string
+  timeline() const
+  {
+    std::string out;
+    for(int m = 0; m < int(timing_mark::count); m++)
+      if(has(timing_mark(m)))
+	out += (out.empty() ? "" : ", ") + std::string(timing_mark_names[m]) + " +" +
+	  timing_ms(microseconds(at_[m] - at_[int(timing_mark::read)])) + "ms";
+    return out;
+  }
+
+private:
+  // the latest mark passed, count if none
+  timing_mark
+  last() const
+  {
+    auto latest = timing_mark::count;
+    for(int m = 0; m < int(timing_mark::count); m++)
+      if(has(timing_mark(m)) && (latest == timing_mark::count || at_[m] >= at_[int(latest)]))
+	latest = timing_mark(m);
+    return latest;
+  }
+
+  clock::time_point at_[int(timing_mark::count)];
+  std::uint32_t marked_;	// bit per mark passed
+};
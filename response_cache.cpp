@@ -0,0 +1,84 @@
+#include <boost/beast/http.hpp>
+#include <algorithm>
+#include <ctime>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// One response as cached, with the time it expires; a hit shares it with the
+// cache and is written out of it, it is never changed once stored
+struct cached_response
+{
+  std::shared_ptr<boost::beast::http::response<boost::beast::http::dynamic_body> const> res;
+  time_t expires;
+};
+
+// Lower-cased, sorted and de-duplicated field names listed in Vary,
+// so "Accept-Encoding, User-Agent" and "user-agent,accept-encoding" share variants
+inline std::vector<std::string>
+vary_names(boost::beast::string_view vary)
+{
+  std::vector<std::string> names;
+  std::stringstream ss(std::string(vary.data(), vary.size()));
+  std::string name;
+  while(std::getline(ss, name, ','))
+    {
+      auto begin = name.find_first_not_of(" \t");
+      if(begin == std::string::npos)
+	continue;
+      name = name.substr(begin, name.find_last_not_of(" \t") - begin + 1);
+      std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+      names.push_back(name);
+    }
+  std::sort(names.begin(), names.end());
+  names.erase(std::unique(names.begin(), names.end()), names.end());
+  return names;
+}
+
+// What the cache keeps for one URL, in one slot: its response, or for a response
+// carrying Vary the request headers it varies on and a response per combination
+// of their values, the most recently stored first
+struct cache_entry
+{
+  static constexpr std::size_t max_variants = 8;
+
+  // the variant under key, nullptr if there is none
+  cached_response const *
+  find(std::string const & key) const
+  {
+    for(auto const & v : variants)
+      if(v.first == key)
+	return &v.second;
+    return nullptr;
+  }
+
+  // r under key, replacing what is there; a response varying on other headers
+  // than the ones stored makes those variants unreachable, they are dropped
+  void
+  store(std::vector<std::string> names, std::string key, cached_response r)
+  {
+    if(names != vary)
+      {
+	vary = std::move(names);
+	variants.clear();
+      }
+    auto it = std::find_if(variants.begin(), variants.end(),
+			   [&key](std::pair<std::string, cached_response> const & v)
+			   {
+			     return v.first == key;
+			   });
+    if(it != variants.end())
+      variants.erase(it);
+    else if(variants.size() >= max_variants)
+      variants.pop_back();
+    variants.emplace(variants.begin(), std::move(key), std::move(r));
+  }
+
+  std::vector<std::string> vary;	// see vary_names, empty without Vary
+  // by variant key: " name=value" per name of vary, "" without Vary
+  std::vector<std::pair<std::string, cached_response> > variants;
+};
+
+typedef LRUCache<std::string, cache_entry> response_cache;
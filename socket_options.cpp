@@ -0,0 +1,98 @@
+#include <boost/asio.hpp>
+#ifdef __linux__
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+
+// Socket options of the listener, the client connections it accepts and the upstream
+// connections. 0 or false leaves the kernel's default.
+struct socket_options
+{
+  bool nodelay = true;		// TCP_NODELAY: headers and other small writes go out without waiting for an ACK
+  int fastopen = 0;		// TCP_FASTOPEN queue of the listener: returning clients send their request in the SYN
+  bool fastopen_connect = false;	// TCP_FASTOPEN_CONNECT upstream, see apply_upstream_options
+  int defer_accept = 0;		// TCP_DEFER_ACCEPT seconds: accept only completes once the request is there
+  bool quickack = false;	// TCP_QUICKACK: no delayed ACKs at the start of a connection
+  int keepalive_idle = 0;	// SO_KEEPALIVE, probing after this many idle seconds
+  int keepalive_interval = 0;	// seconds between probes
+  int keepalive_count = 0;	// unanswered probes before the connection is dropped
+  int rcvbuf = 0;		// SO_RCVBUF bytes, turns off the kernel's autotuning
+  int sndbuf = 0;		// SO_SNDBUF bytes, likewise
+  int notsent_lowat = 0;	// TCP_NOTSENT_LOWAT bytes: writable only while less than this is unsent
+};
+
+#ifdef __linux__
+typedef boost::asio::detail::socket_option::integer<IPPROTO_TCP, TCP_FASTOPEN> tcp_fastopen;
+typedef boost::asio::detail::socket_option::integer<IPPROTO_TCP, TCP_DEFER_ACCEPT> tcp_defer_accept;
+typedef boost::asio::detail::socket_option::boolean<IPPROTO_TCP, TCP_QUICKACK> tcp_quickack;
+typedef boost::asio::detail::socket_option::integer<IPPROTO_TCP, TCP_KEEPIDLE> tcp_keepidle;
+typedef boost::asio::detail::socket_option::integer<IPPROTO_TCP, TCP_KEEPINTVL> tcp_keepintvl;
+typedef boost::asio::detail::socket_option::integer<IPPROTO_TCP, TCP_KEEPCNT> tcp_keepcnt;
+typedef boost::asio::detail::socket_option::integer<IPPROTO_TCP, TCP_NOTSENT_LOWAT> tcp_notsent_lowat;
+#ifdef TCP_FASTOPEN_CONNECT
+typedef boost::asio::detail::socket_option::boolean<IPPROTO_TCP, TCP_FASTOPEN_CONNECT> tcp_fastopen_connect;
+#endif
+#endif
+
+// Before listen(): accepted sockets inherit the buffer sizes, which also decide
+// the window scale offered in the handshake
+void apply_listener_options(
+			    boost::asio::ip::tcp::acceptor& acceptor,
+			    socket_options const & o,
+			    boost::system::error_code& ec)
+{
+  if(! ec && o.rcvbuf)
+    acceptor.set_option(boost::asio::socket_base::receive_buffer_size(o.rcvbuf), ec);
+  if(! ec && o.sndbuf)
+    acceptor.set_option(boost::asio::socket_base::send_buffer_size(o.sndbuf), ec);
+#ifdef __linux__
+  if(! ec && o.fastopen)
+    acceptor.set_option(tcp_fastopen(o.fastopen), ec);
+  if(! ec && o.defer_accept)
+    acceptor.set_option(tcp_defer_accept(o.defer_accept), ec);
+#endif
+}
+
+// For accepted and upstream connections alike. An option the socket doesn't take is
+// skipped, the connection works without it.
+void apply_connection_options(boost::asio::ip::tcp::socket& sock, socket_options const & o)
+{
+  boost::system::error_code ec;
+  if(o.nodelay)
+    sock.set_option(boost::asio::ip::tcp::no_delay(true), ec);
+  if(o.keepalive_idle)
+    {
+      sock.set_option(boost::asio::socket_base::keep_alive(true), ec);
+#ifdef __linux__
+      sock.set_option(tcp_keepidle(o.keepalive_idle), ec);
+      if(o.keepalive_interval)
+	sock.set_option(tcp_keepintvl(o.keepalive_interval), ec);
+      if(o.keepalive_count)
+	sock.set_option(tcp_keepcnt(o.keepalive_count), ec);
+#endif
+    }
+#ifdef __linux__
+  // the kernel falls back to delayed ACKs by itself later on
+  if(o.quickack)
+    sock.set_option(tcp_quickack(true), ec);
+  if(o.notsent_lowat)
+    sock.set_option(tcp_notsent_lowat(o.notsent_lowat), ec);
+#endif
+}
+
+// On a fresh upstream socket before it connects. With TCP_FASTOPEN_CONNECT the
+// connect completes at once and the request rides in the SYN, so a dead address
+// only shows on the first write and happy eyeballs can't race the handshakes.
+void apply_upstream_options(boost::asio::ip::tcp::socket& sock, socket_options const & o)
+{
+  boost::system::error_code ec;
+  if(o.rcvbuf)
+    sock.set_option(boost::asio::socket_base::receive_buffer_size(o.rcvbuf), ec);
+  if(o.sndbuf)
+    sock.set_option(boost::asio::socket_base::send_buffer_size(o.sndbuf), ec);
+#ifdef TCP_FASTOPEN_CONNECT
+  if(o.fastopen_connect)
+    sock.set_option(tcp_fastopen_connect(true), ec);
+#endif
+  apply_connection_options(sock, o);
+}
@@ -0,0 +1,215 @@
+#include <boost/asio.hpp>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+
+// Hierarchical timing wheel for one event loop: 4 levels of 64 slots, the first one
+// tick wide, every further level 64 times coarser, so arming and cancelling is O(1)
+// whatever the number of timers. A single steady_timer drives it and only runs while
+// something is armed. Not thread safe, everything happens on the loop's thread.
+class timer_wheel
+{
+public:
+  // Intrusive entry, lives inside its owner and is cancelled when destroyed
+  class timer
+  {
+  public:
+    timer()
+      : wheel_{nullptr}
+      , slot_{nullptr}
+      , prev_{nullptr}
+      , next_{nullptr}
+      , expires_{0}
+    {
+    }
+
+    timer(timer const &) = delete;
+    timer& operator=(timer const &) = delete;
+
+    ~timer()
+    {
+      cancel();
+    }
+
+    void
+    cancel()
+    {
+      if(wheel_)
+	wheel_->unlink(*this);
+    }
+
+    bool
+    armed() const
+    {
+      return wheel_ != nullptr;
+    }
+
+  private:
+    friend class timer_wheel;
+    timer_wheel* wheel_;
+    timer** slot_;	// head of the list this timer is in
+    timer* prev_;
+    timer* next_;
+    std::uint64_t expires_;	// in ticks
+    std::function<void()> callback_;
+  };
+
+  timer_wheel(
+	      boost::asio::io_context& ioc,
+	      std::chrono::milliseconds tick)
+    : tick_timer_{ioc}
+    , tick_{tick}
+    , start_{std::chrono::steady_clock::now()}
+    , now_{0}
+    , armed_{0}
+    , ticking_{false}
+  {
+    for(auto& level : slots_)
+      for(auto& slot : level)
+	slot = nullptr;
+  }
+
+  timer_wheel(timer_wheel const &) = delete;
+  timer_wheel& operator=(timer_wheel const &) = delete;
+
+  // timers outliving the wheel must not touch it any more
+  ~timer_wheel()
+  {
+    for(auto& level : slots_)
+      for(auto& slot : level)
+	while(slot)
+	  unlink(*slot);
+  }
+
+  // (Re)arm t to call callback once after at least after, rounded up to whole ticks
+  void
+  schedule(timer& t, std::chrono::milliseconds after, std::function<void()> callback)
+  {
+    t.cancel();
+    // the clock stood still while nothing was armed
+    if(! ticking_)
+      now_ = elapsed_ticks();
+    std::uint64_t ticks = (after.count() + tick_.count() - 1) / tick_.count();
+    t.expires_ = now_ + std::max<std::uint64_t>(1, ticks);
+    t.callback_ = std::move(callback);
+    link(t);
+    if(! ticking_)
+      do_tick();
+  }
+
+private:
+  static constexpr int LEVELS = 4;
+  static constexpr int BITS = 6;
+  static constexpr std::uint64_t SLOTS = 1 << BITS;
+
+  void
+  link(timer& t)
+  {
+    if(t.expires_ < now_)
+      t.expires_ = now_;
+    std::uint64_t delta = t.expires_ - now_;
+    int level = 0;
+    while(level < LEVELS - 1 && delta >= (SLOTS << (BITS * level)))
+      level++;
+    // the wheel reaches 64^4 ticks ahead, anything further out fires then
+    if(delta >= (SLOTS << (BITS * level)))
+      t.expires_ = now_ + (SLOTS << (BITS * level)) - 1;
+
+    timer*& head = slots_[level][(t.expires_ >> (BITS * level)) & (SLOTS - 1)];
+    t.wheel_ = this;
+    t.slot_ = &head;
+    t.prev_ = nullptr;
+    t.next_ = head;
+    if(head)
+      head->prev_ = &t;
+    head = &t;
+    armed_++;
+  }
+
+  void
+  unlink(timer& t)
+  {
+    if(t.prev_)
+      t.prev_->next_ = t.next_;
+    else
+      *t.slot_ = t.next_;
+    if(t.next_)
+      t.next_->prev_ = t.prev_;
+    t.wheel_ = nullptr;
+    t.slot_ = nullptr;
+    t.prev_ = t.next_ = nullptr;
+    armed_--;
+  }
+
+  void
+  do_tick()
+  {
+    ticking_ = true;
+    tick_timer_.expires_at(start_ + tick_ * static_cast<std::chrono::milliseconds::rep>(now_ + 1));
+    tick_timer_.async_wait(
+			   [this](boost::system::error_code ec)
+			   {
+			     if(ec)
+			       return;
+			     on_tick();
+			   });
+  }
+
+  // catch up with the clock, the loop may have been busy for several ticks
+  void
+  on_tick()
+  {
+    std::uint64_t target = elapsed_ticks();
+    while(now_ < target && armed_ > 0)
+      {
+	now_++;
+	// a lower level wrapped around: spread the next slot of the level above over it
+	for(int level = 1; level < LEVELS; level++)
+	  {
+	    if((now_ & ((std::uint64_t(1) << (BITS * level)) - 1)) != 0)
+	      break;
+	    timer*& slot = slots_[level][(now_ >> (BITS * level)) & (SLOTS - 1)];
+	    timer* t = slot;
+	    slot = nullptr;
+	    while(t)
+	      {
+		timer* next = t->next_;
+		armed_--;
+		link(*t);
+		t = next;
+	      }
+	  }
+
+	// callbacks may arm or cancel other timers, take one at a time
+	timer*& due = slots_[0][now_ & (SLOTS - 1)];
+	while(due)
+	  {
+	    timer& t = *due;
+	    auto callback = std::move(t.callback_);
+	    unlink(t);
+	    callback();
+	  }
+      }
+    if(now_ < target)
+      now_ = target;
+
+    ticking_ = false;
+    if(armed_ > 0)
+      do_tick();
+  }
+
+  std::uint64_t
+  elapsed_ticks() const
+  {
+    return (std::chrono::steady_clock::now() - start_) / tick_;
+  }
+
+private:
+  boost::asio::steady_timer tick_timer_;
+  std::chrono::milliseconds tick_;
+  std::chrono::steady_clock::time_point start_;
+  std::uint64_t now_;	// ticks since start_ handled so far
+  std::size_t armed_;
+  bool ticking_;
+  timer* slots_[LEVELS][SLOTS];
+};
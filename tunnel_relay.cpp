@@ -0,0 +1,460 @@
+#include <boost/asio.hpp>
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+#include "rate_limit.cpp"
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+#ifdef __linux__
+// Moves one direction of a CONNECT tunnel from one socket to the other through a pipe
+// with splice(2): the payload never leaves the kernel. Readiness comes from async_wait
+// on the io_context, splice itself never blocks. With a shaper every splice out
+// of the pipe is limited to what it grants.
+template<class Executor>
+class splice_relay : public std::enable_shared_from_this<splice_relay<Executor> >
+{
+public:
+  // eof when from is closed by the peer, any other error when the relay broke
+  typedef std::function<void(boost::system::error_code, std::size_t)> handler;
+
+  splice_relay(
+	       std::uint32_t session,
+	       boost::asio::ip::tcp::socket& from,
+	       boost::asio::ip::tcp::socket& to,
+	       Executor executor,
+	       bandwidth_flow* shaper,
+	       handler h)
+    : session_{session}
+    , from_(from)
+    , to_(to)
+    , executor_(executor)
+    , shaper_{shaper}
+    , handler_(h)
+    , in_pipe_{0}
+    , granted_{0}
+    , total_{0}
+  {
+    pipe_[0] = pipe_[1] = -1;
+  }
+
+  ~splice_relay()
+  {
+    if(pipe_[0] >= 0)
+      ::close(pipe_[0]);
+    if(pipe_[1] >= 0)
+      ::close(pipe_[1]);
+  }
+
+  // false when no pipe could be made, the caller copies through user space instead
+  bool
+  open(boost::system::error_code& ec)
+  {
+    if(::pipe2(pipe_, O_NONBLOCK | O_CLOEXEC) != 0)
+      {
+	ec = boost::system::error_code(errno, boost::system::system_category());
+	return false;
+      }
+    // splice only stays non-blocking if the sockets themselves are
+    from_.native_non_blocking(true, ec);
+    if(! ec)
+      to_.native_non_blocking(true, ec);
+    return ! ec;
+  }
+
+  void
+  run()
+  {
+    do_fill();
+  }
+
+  // bytes moved so far
+  std::size_t
+  total() const
+  {
+    return total_;
+  }
+
+private:
+  static constexpr std::size_t CHUNK = 64 * 1024;
+  // chunks moved before the io_context gets to run the other handlers waiting
+  static constexpr int CHUNKS_PER_TURN = 4;
+
+  // socket -> pipe -> socket, a few chunks at a time; the pipe is always empty here
+  void
+  do_fill()
+  {
+    for(int chunks = 0; chunks < CHUNKS_PER_TURN; chunks++)
+      {
+	ssize_t n = ::splice(from_.native_handle(), nullptr, pipe_[1], nullptr, CHUNK,
+			     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if(n == 0)
+	  return handler_(boost::asio::error::eof, total_);
+	if(n < 0)
+	  {
+	    if(errno == EAGAIN || errno == EWOULDBLOCK)
+	      return from_.async_wait(
+				      boost::asio::ip::tcp::socket::wait_read,
+				      boost::asio::bind_executor(
+								 executor_,
+								 std::bind(
+									   &splice_relay::on_readable,
+									   this->shared_from_this(),
+									   std::placeholders::_1)));
+	    return handler_(boost::system::error_code(errno, boost::system::system_category()), total_);
+	  }
+	in_pipe_ = n;
+	if(! drain())
+	  return;
+      }
+    post_fill();
+  }
+
+  // do_fill again once the handlers queued meanwhile had their turn
+  void
+  post_fill()
+  {
+    boost::asio::post(executor_, std::bind(&splice_relay::do_fill, this->shared_from_this()));
+  }
+
+  void
+  on_readable(boost::system::error_code ec)
+  {
+    if(ec)
+      return handler_(ec, total_);
+    do_fill();
+  }
+
+  // pipe -> socket until the pipe is empty again. False if it has to wait for
+  // the socket or the shaper, which go on in do_drain, or if the relay broke.
+  bool
+  drain()
+  {
+    while(in_pipe_ > 0)
+      {
+	if(granted_ == 0 && ! acquire())
+	  return false;
+	ssize_t n = ::splice(pipe_[0], nullptr, to_.native_handle(), nullptr, std::min(in_pipe_, granted_),
+			     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if(n > 0)
+	  {
+	    in_pipe_ -= n;
+	    granted_ -= n;
+	    total_ += n;
+	    PROXY_PROBE4(tunnel_chunk, session_, from_.native_handle(), to_.native_handle(), n);
+	    continue;
+	  }
+	if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	  {
+	    to_.async_wait(
+			   boost::asio::ip::tcp::socket::wait_write,
+			   boost::asio::bind_executor(
+						      executor_,
+						      std::bind(
+								&splice_relay::on_writable,
+								this->shared_from_this(),
+								std::placeholders::_1)));
+	    return false;
+	  }
+	handler_(n < 0 ? boost::system::error_code(errno, boost::system::system_category())
+		 : boost::asio::error::broken_pipe, total_);
+	return false;
+      }
+    // the pipe ran dry before the grant did
+    if(shaper_)
+      shaper_->give_back(granted_);
+    granted_ = 0;
+    return true;
+  }
+
+  void
+  do_drain()
+  {
+    if(drain())
+      post_fill();
+  }
+
+  // false if the shaper makes us wait, do_drain goes on once it grants
+  bool
+  acquire()
+  {
+    if(! shaper_)
+      {
+	granted_ = in_pipe_;
+	return true;
+      }
+    auto self = this->shared_from_this();
+    granted_ = shaper_->acquire(
+				in_pipe_,
+				[self](std::size_t granted)
+				{
+				  self->granted_ = granted;
+				  self->do_drain();
+				});
+    return granted_ > 0;
+  }
+
+  void
+  on_writable(boost::system::error_code ec)
+  {
+    if(ec)
+      return handler_(ec, total_);
+    do_drain();
+  }
+
+private:
+  std::uint32_t session_;	// whose tunnel, for the probes
+  boost::asio::ip::tcp::socket& from_;
+  boost::asio::ip::tcp::socket& to_;
+  Executor executor_;
+  bandwidth_flow* shaper_;	// nullptr if unshaped
+  handler handler_;
+  int pipe_[2];
+  std::size_t in_pipe_;	// bytes spliced in but not out yet
+  std::size_t granted_;	// bytes the shaper allows out before asking again
+  std::size_t total_;
+};
+#endif
+
+// Moves one direction of a CONNECT tunnel through two user space buffers: while one
+// chunk is being written the next one is already read. Chunks grow from min_size to
+// max_size while the peer sends bursts (full reads, FIONREAD) and shrink again for
+// small ones. Both buffers are freed whenever the direction goes idle. With a
+// shaper a chunk goes out in the pieces it grants.
+template<class Executor>
+class buffered_relay : public std::enable_shared_from_this<buffered_relay<Executor> >
+{
+public:
+  // eof when from is closed by the peer and everything read was written
+  typedef std::function<void(boost::system::error_code, std::size_t)> handler;
+
+  buffered_relay(
+		 std::uint32_t session,
+		 boost::asio::ip::tcp::socket& from,
+		 boost::asio::ip::tcp::socket& to,
+		 Executor executor,
+		 std::size_t min_size,
+		 std::size_t max_size,
+		 bandwidth_flow* shaper,
+		 handler h)
+    : session_{session}
+    , from_(from)
+    , to_(to)
+    , executor_(executor)
+    , shaper_{shaper}
+    , handler_(h)
+    , min_size_{min_size}
+    , max_size_{max_size}
+    , size_{min_size}
+    , small_reads_{0}
+    , next_read_{0}
+    , next_write_{0}
+    , written_{0}
+    , writing_{false}
+    , waiting_{false}
+    , total_{0}
+  {
+    filled_[0] = filled_[1] = 0;
+  }
+
+  void
+  run()
+  {
+    // reads must return would_block instead of waiting so an idle direction can give its buffers back
+    boost::system::error_code ec;
+    from_.non_blocking(true, ec);
+    if(ec)
+      return handler_(ec, total_);
+    do_read();
+  }
+
+  // bytes written so far
+  std::size_t
+  total() const
+  {
+    return total_;
+  }
+
+private:
+  void
+  do_read()
+  {
+    // already waiting, stopped, or both buffers are waiting to be written
+    if(waiting_ || read_ec_ || filled_[next_read_] != 0)
+      return;
+
+    boost::system::error_code ec;
+    std::size_t pending = from_.available(ec);
+    if(! ec && pending > size_)
+      size_ = std::min(max_size_, round_up(pending));
+
+    auto& buf = buffers_[next_read_];
+    if(buf.size() != size_)
+      std::vector<char>(size_).swap(buf);
+
+    std::size_t n = from_.read_some(boost::asio::buffer(buf), ec);
+    if(ec == boost::asio::error::would_block)
+      {
+	if(! writing_)
+	  release_buffers();
+	waiting_ = true;
+	return from_.async_wait(
+				boost::asio::ip::tcp::socket::wait_read,
+				boost::asio::bind_executor(
+							   executor_,
+							   std::bind(
+								     &buffered_relay::on_readable,
+								     this->shared_from_this(),
+								     std::placeholders::_1)));
+      }
+    if(ec)
+      {
+	read_ec_ = ec;
+	if(! writing_)
+	  handler_(read_ec_, total_);
+	return;
+      }
+
+    adapt(n);
+    filled_[next_read_] = n;
+    next_read_ ^= 1;
+    if(! writing_)
+      do_write();
+    do_read();
+  }
+
+  void
+  on_readable(boost::system::error_code ec)
+  {
+    waiting_ = false;
+    if(ec)
+      {
+	read_ec_ = ec;
+	if(! writing_)
+	  handler_(read_ec_, total_);
+	return;
+      }
+    do_read();
+  }
+
+  void
+  do_write()
+  {
+    writing_ = true;
+    std::size_t remaining = filled_[next_write_] - written_;
+    if(! shaper_)
+      return do_write_granted(remaining);
+
+    auto self = this->shared_from_this();
+    std::size_t granted = shaper_->acquire(
+					   remaining,
+					   [self](std::size_t granted)
+					   {
+					     self->do_write_granted(granted);
+					   });
+    if(granted > 0)
+      do_write_granted(granted);
+  }
+
+  void
+  do_write_granted(std::size_t bytes)
+  {
+    boost::asio::async_write(
+			     to_,
+			     boost::asio::buffer(buffers_[next_write_].data() + written_, bytes),
+			     boost::asio::bind_executor(
+							executor_,
+							std::bind(
+								  &buffered_relay::on_write,
+								  this->shared_from_this(),
+								  std::placeholders::_1,
+								  std::placeholders::_2)));
+  }
+
+  void
+  on_write(boost::system::error_code ec, std::size_t bytes_transferred)
+  {
+    writing_ = false;
+    total_ += bytes_transferred;
+    if(bytes_transferred)
+      PROXY_PROBE4(tunnel_chunk, session_, from_.native_handle(), to_.native_handle(), bytes_transferred);
+    if(ec)
+      return handler_(ec, total_);
+
+    // the shaper let only part of the chunk go
+    written_ += bytes_transferred;
+    if(written_ < filled_[next_write_])
+      return do_write();
+
+    written_ = 0;
+    filled_[next_write_] = 0;
+    next_write_ ^= 1;
+    if(filled_[next_write_] != 0)
+      do_write();
+    // the reader stopped on an error and everything it read is out now
+    else if(read_ec_)
+      return handler_(read_ec_, total_);
+    else if(waiting_)
+      release_buffers();
+    do_read();
+  }
+
+  // a read that filled the whole buffer asks for a bigger one, a run of small reads for a smaller one
+  void
+  adapt(std::size_t n)
+  {
+    if(n == size_)
+      {
+	size_ = std::min(max_size_, size_ * 2);
+	small_reads_ = 0;
+      }
+    else if(n < size_ / 4 && ++small_reads_ >= 4)
+      {
+	size_ = std::max(min_size_, size_ / 2);
+	small_reads_ = 0;
+      }
+  }
+
+  std::size_t
+  round_up(std::size_t n)
+  {
+    std::size_t size = min_size_;
+    while(size < n)
+      size *= 2;
+    return size;
+  }
+
+  void
+  release_buffers()
+  {
+    for(int i = 0; i < 2; i++)
+      if(filled_[i] == 0)
+	std::vector<char>().swap(buffers_[i]);
+  }
+
+private:
+  std::uint32_t session_;	// whose tunnel, for the probes
+  boost::asio::ip::tcp::socket& from_;
+  boost::asio::ip::tcp::socket& to_;
+  Executor executor_;
+  bandwidth_flow* shaper_;	// nullptr if unshaped
+  handler handler_;
+  std::vector<char> buffers_[2];
+  std::size_t filled_[2];	// bytes read into a buffer and not written yet, 0 if free
+  std::size_t min_size_;
+  std::size_t max_size_;
+  std::size_t size_;	// size of the next read
+  unsigned small_reads_;
+  int next_read_;
+  int next_write_;
+  std::size_t written_;	// of the buffer being written
+  bool writing_;
+  bool waiting_;	// async_wait for readability in flight
+  boost::system::error_code read_ec_;
+  std::size_t total_;
+};
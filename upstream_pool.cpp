@@ -0,0 +1,159 @@
+#include <boost/asio.hpp>
+#include <boost/optional.hpp>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <sys/socket.h>
+#include <errno.h>
+
+// Pool of idle keep-alive connections to origin servers, keyed by "host:port", one per worker
+// loop so a reused socket stays on the io_context it was opened on.
+// A session checks a connection out for each request that misses the cache and checks it
+// back in once the response has been read completely and both sides allow keep-alive.
+class upstream_pool
+{
+public:
+
+upstream_pool(
+	      boost::asio::io_context& ioc,
+	      std::size_t max_idle_per_origin,
+	      std::size_t max_idle_total,
+	      std::chrono::steady_clock::duration idle_timeout)
+  : sweep_timer_{ioc}
+  , max_idle_per_origin_{max_idle_per_origin}
+  , max_idle_total_{max_idle_total}
+  , idle_timeout_{idle_timeout}
+  , idle_total_{0}
+{
+}
+
+// start closing connections which stayed idle longer than idle_timeout
+void run()
+{
+  do_sweep();
+}
+
+// take the most recently used healthy connection to origin, boost::none if there is none
+boost::optional<boost::asio::ip::tcp::socket> checkout(std::string const & origin)
+{
+  std::lock_guard<proxy_mutex> lock(pool_mutex);
+
+  auto it = idle_.find(origin);
+  if(it == idle_.end())
+    return boost::optional<boost::asio::ip::tcp::socket>();
+
+  auto now = std::chrono::steady_clock::now();
+  auto& conns = it->second;
+  while(! conns.empty())
+    {
+      idle_connection conn = std::move(conns.back());
+      conns.pop_back();
+      idle_total_--;
+
+      if(now - conn.since < idle_timeout_ && is_healthy(conn.sock))
+	{
+	  if(conns.empty())
+	    idle_.erase(it);
+	  return boost::optional<boost::asio::ip::tcp::socket>(std::move(conn.sock));
+	}
+      discard(conn.sock);
+    }
+  idle_.erase(it);
+  return boost::optional<boost::asio::ip::tcp::socket>();
+}
+
+// give back a connection whose last response was read completely
+void checkin(std::string const & origin, boost::asio::ip::tcp::socket sock)
+{
+  if(! sock.is_open())
+    return;
+
+  std::lock_guard<proxy_mutex> lock(pool_mutex);
+
+  auto& conns = idle_[origin];
+  // the oldest connection of this origin makes room for the new one
+  if(conns.size() >= max_idle_per_origin_)
+    {
+      discard(conns.front().sock);
+      conns.pop_front();
+      idle_total_--;
+    }
+  if(idle_total_ >= max_idle_total_)
+    {
+      discard(sock);
+      if(conns.empty())
+	idle_.erase(origin);
+      return;
+    }
+  conns.push_back(idle_connection{std::move(sock), std::chrono::steady_clock::now()});
+  idle_total_++;
+}
+
+private:
+struct idle_connection
+{
+  boost::asio::ip::tcp::socket sock;
+  std::chrono::steady_clock::time_point since;
+};
+
+// An idle keep-alive connection must have nothing to read: EOF means the origin closed it,
+// pending bytes mean a response we didn't ask for. Only EAGAIN says it's still usable.
+bool is_healthy(boost::asio::ip::tcp::socket& sock)
+{
+  char c;
+  ssize_t n = ::recv(sock.native_handle(), &c, 1, MSG_PEEK | MSG_DONTWAIT);
+  return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+void discard(boost::asio::ip::tcp::socket& sock)
+{
+  boost::system::error_code ec;
+  sock.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
+  sock.close(ec);
+}
+
+void do_sweep()
+{
+  sweep_timer_.expires_after(idle_timeout_ / 2);
+  sweep_timer_.async_wait(
+			  [this](boost::system::error_code ec)
+			  {
+			    if(ec)
+			      return;
+			    sweep();
+			    do_sweep();
+			  });
+}
+
+// close every connection which has been idle for longer than idle_timeout
+void sweep()
+{
+  std::lock_guard<proxy_mutex> lock(pool_mutex);
+
+  auto now = std::chrono::steady_clock::now();
+  for(auto it = idle_.begin(); it != idle_.end(); )
+    {
+      auto& conns = it->second;
+      while(! conns.empty() && now - conns.front().since >= idle_timeout_)
+	{
+	  discard(conns.front().sock);
+	  conns.pop_front();
+	  idle_total_--;
+	}
+      it = conns.empty() ? idle_.erase(it) : std::next(it);
+    }
+}
+
+private:
+  // idle connections of every origin, the most recently returned one at the back
+  std::unordered_map<std::string, std::deque<idle_connection> > idle_;
+  boost::asio::steady_timer sweep_timer_;
+  std::size_t max_idle_per_origin_;
+  std::size_t max_idle_total_;
+  std::chrono::steady_clock::duration idle_timeout_;
+  std::size_t idle_total_;
+  proxy_mutex pool_mutex{"upstream_pool"};
+};